@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef int unknown;
 typedef void* typevar;
@@ -13,8 +14,17 @@ typedef void* any;
 
 typedef char* string;
 
+typedef int64_t i64;
+typedef uint64_t u64;
+
 int intsqrt(int x) { return sqrt(x); }
 float itof(int x) { return (float)x; }
+double itod(int x) { return (double)x; }
+double ftod(float x) { return (double)x; }
+float dtof(double x) { return (float)x; }
+int dtoi(double x) { return (int)x; }
+i64 itol(int x) { return (i64)x; }
+int ltoi(i64 x) { return (int)x; }
 
 string itos(int x) {
   char *s = malloc(sizeof(char) * 32);
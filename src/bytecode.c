@@ -0,0 +1,644 @@
+#include "bytecode.h"
+#include "eval.h"
+#include "env.h"
+#include "gc.h"
+#include "lexical.h"
+#include "assertions.h"
+
+// The operands follow the instruction in the code, 'k' is an index into the constants
+// and 'to' is the index of the instruction to jump to.
+enum Op {
+  OP_CONST, // k
+  OP_SLOT, // depth index, a param in a frame (see lexical.h)
+  OP_GLOBAL, // k, a global ref
+  OP_NAME, // k, a ref with REF_NAME depth, the symbol is looked up by name with the inline cache of the ref
+  OP_SET_SLOT, // depth index, the value stays on the stack
+  OP_SET_NAME, // k
+  OP_POP,
+  OP_JUMP, // to
+  OP_JUMP_IF_FALSE, // to, pops the condition
+  OP_JUMP_IF_TRUE, // to, pops the condition
+  OP_LOOP, // to, a jump backwards with a GC point
+  OP_LET, // enters a new env
+  OP_BIND, // k, binds the symbol to the popped value in the env of the let
+  OP_END_LET,
+  OP_LAMBDA, // k, the resolved 'fn' form, with the code of its body at k + 1
+  OP_MATCH, // k, an array of pattern/code pairs to try on the value on top of the stack
+  OP_MACRO, // k to, if the function on top of the stack is a macro the form at k is expanded and evaluated
+  OP_CALL, // n k, the function is below the n args, the form is at k (for the function trace)
+  // In tail position, these continue with the code of the match body, expansion or lambda in the same run
+  OP_TAIL_MATCH,
+  OP_TAIL_MACRO,
+  OP_TAIL_CALL,
+  OP_EVAL, // k, the form is given to eval_internal
+  OP_RETURN,
+  OP_COUNT
+};
+
+typedef struct {
+  int *ops;
+  int count;
+  int capacity;
+  Obj *constants;
+} Compiler;
+
+void bytecode_init() {
+  char *vm = getenv("CARP_VM");
+  bytecode_enabled = !(vm && strcmp(vm, "0") == 0);
+}
+
+void emit(Compiler *c, int op) {
+  if(c->count == c->capacity) {
+    c->capacity *= 2;
+    c->ops = realloc(c->ops, sizeof(int) * c->capacity);
+  }
+  c->ops[c->count++] = op;
+}
+
+void emit_with_constant(Compiler *c, int op, Obj *o) {
+  emit(c, op);
+  emit(c, c->constants->count);
+  obj_array_push(c->constants, o);
+}
+
+// Emits a jump with a target that is filled in by patch_jump, returns where it is
+int emit_jump(Compiler *c, int op) {
+  emit(c, op);
+  emit(c, -1);
+  return c->count - 1;
+}
+
+void patch_jump(Compiler *c, int at) {
+  c->ops[at] = c->count;
+}
+
+void compile(Compiler *c, Obj *form, bool tail);
+
+void compile_do(Compiler *c, Obj *form, bool tail) {
+  Obj *p = form->cdr;
+  if(!p || !p->car) {
+    emit_with_constant(c, OP_CONST, nil);
+    return;
+  }
+  while(p && p->car) {
+    compile(c, p->car, tail && !(p->cdr && p->cdr->car));
+    p = p->cdr;
+    if(p && p->car) {
+      emit(c, OP_POP);
+    }
+  }
+}
+
+void compile_let(Compiler *c, Obj *form, bool tail) {
+  Obj *bindings = form->cdr ? form->cdr->car : NULL;
+  if(!bindings || !form->cdr->cdr || !form->cdr->cdr->car || form->cdr->cdr->cdr->car) {
+    emit_with_constant(c, OP_EVAL, form); // reports the error
+    return;
+  }
+  if(obj_tag(bindings) == 'A') {
+    if(bindings->count % 2 != 0) {
+      emit_with_constant(c, OP_EVAL, form);
+      return;
+    }
+    for(int i = 0; i < bindings->count; i += 2) {
+      if(obj_tag(bindings->items[i]) != 'Y') {
+	emit_with_constant(c, OP_EVAL, form);
+	return;
+      }
+    }
+    emit(c, OP_LET);
+    for(int i = 0; i < bindings->count; i += 2) {
+      compile(c, bindings->items[i + 1], false);
+      emit_with_constant(c, OP_BIND, bindings->items[i]);
+    }
+  }
+  else {
+    for(Obj *p = bindings; p && p->car; p = p->cdr->cdr) {
+      if(!p->cdr || obj_tag(p->car) != 'Y') {
+	emit_with_constant(c, OP_EVAL, form);
+	return;
+      }
+    }
+    emit(c, OP_LET);
+    for(Obj *p = bindings; p && p->car; p = p->cdr->cdr) {
+      compile(c, p->cdr->car, false);
+      emit_with_constant(c, OP_BIND, p->car);
+    }
+  }
+  compile(c, form->cdr->cdr->car, tail);
+  emit(c, OP_END_LET);
+}
+
+// Stops at the first true arg like the evaluator, args that are NULL are skipped.
+// The jumps to the 'false' result are chained through their operands until they are patched.
+void compile_not(Compiler *c, Obj *form) {
+  int chain = -1;
+  for(Obj *p = form->cdr; p; p = p->cdr) {
+    if(p->car) {
+      compile(c, p->car, false);
+      emit(c, OP_JUMP_IF_TRUE);
+      emit(c, chain);
+      chain = c->count - 1;
+    }
+  }
+  emit_with_constant(c, OP_CONST, lisp_true);
+  int jump_to_end = emit_jump(c, OP_JUMP);
+  while(chain >= 0) {
+    int next = c->ops[chain];
+    patch_jump(c, chain);
+    chain = next;
+  }
+  emit_with_constant(c, OP_CONST, lisp_false);
+  patch_jump(c, jump_to_end);
+}
+
+void compile_if(Compiler *c, Obj *form, bool tail) {
+  if(!form->cdr || !form->cdr->car || !form->cdr->cdr || !form->cdr->cdr->car ||
+     !form->cdr->cdr->cdr || !form->cdr->cdr->cdr->car || form->cdr->cdr->cdr->cdr->car) {
+    emit_with_constant(c, OP_EVAL, form);
+    return;
+  }
+  compile(c, form->cdr->car, false);
+  int jump_to_else = emit_jump(c, OP_JUMP_IF_FALSE);
+  compile(c, form->cdr->cdr->car, tail);
+  int jump_to_end = emit_jump(c, OP_JUMP);
+  patch_jump(c, jump_to_else);
+  compile(c, form->cdr->cdr->cdr->car, tail);
+  patch_jump(c, jump_to_end);
+}
+
+void compile_while(Compiler *c, Obj *form) {
+  if(!form->cdr || !form->cdr->car || !form->cdr->cdr || !form->cdr->cdr->car) {
+    emit_with_constant(c, OP_EVAL, form);
+    return;
+  }
+  int start = c->count;
+  compile(c, form->cdr->car, false);
+  int jump_to_end = emit_jump(c, OP_JUMP_IF_FALSE);
+  compile(c, form->cdr->cdr->car, false);
+  emit(c, OP_POP);
+  emit(c, OP_LOOP);
+  emit(c, start);
+  patch_jump(c, jump_to_end);
+  emit_with_constant(c, OP_CONST, nil);
+}
+
+// Each body is compiled on its own, it runs in the env that its pattern binds the names in
+void compile_match(Compiler *c, Obj *form, bool tail) {
+  if(!form->cdr || !form->cdr->car) {
+    emit_with_constant(c, OP_EVAL, form);
+    return;
+  }
+  for(Obj *p = form->cdr->cdr; p && p->car; p = p->cdr->cdr) {
+    if(!p->cdr || !p->cdr->car) {
+      emit_with_constant(c, OP_EVAL, form);
+      return;
+    }
+  }
+  Obj *clauses = obj_new_array(4);
+  for(Obj *p = form->cdr->cdr; p && p->car; p = p->cdr->cdr) {
+    obj_array_push(clauses, p->car);
+    obj_array_push(clauses, bytecode_compile(p->cdr->car));
+  }
+  compile(c, form->cdr->car, false);
+  emit_with_constant(c, tail ? OP_TAIL_MATCH : OP_MATCH, clauses);
+}
+
+void compile_reset(Compiler *c, Obj *form) {
+  Obj *target = form->cdr ? form->cdr->car : NULL;
+  if(!target || !form->cdr->cdr || !form->cdr->cdr->car ||
+     !(obj_tag(target) == 'Y' || (obj_tag(target) == 'X' && target->ref_depth >= 0))) {
+    emit_with_constant(c, OP_EVAL, form);
+    return;
+  }
+  compile(c, form->cdr->cdr->car, false);
+  if(obj_tag(target) == 'X') {
+    emit(c, OP_SET_SLOT);
+    emit(c, target->ref_depth);
+    emit(c, target->ref_index);
+  }
+  else {
+    emit_with_constant(c, OP_SET_NAME, target);
+  }
+}
+
+void compile_lambda(Compiler *c, Obj *form) {
+  emit_with_constant(c, OP_LAMBDA, form);
+  obj_array_push(c->constants, bytecode_compile(form->cdr->cdr->car));
+}
+
+void compile_call(Compiler *c, Obj *form, bool tail) {
+  compile(c, form->car, false);
+  emit_with_constant(c, tail ? OP_TAIL_MACRO : OP_MACRO, form);
+  int form_index = c->constants->count - 1;
+  emit(c, -1);
+  int jump_to_end = c->count - 1;
+  int arg_count = 0;
+  for(Obj *p = form->cdr; p && p->car; p = p->cdr) {
+    compile(c, p->car, false);
+    arg_count++;
+  }
+  emit(c, tail ? OP_TAIL_CALL : OP_CALL);
+  emit(c, arg_count);
+  emit(c, form_index);
+  patch_jump(c, jump_to_end);
+}
+
+void compile_list(Compiler *c, Obj *form, bool tail) {
+  if(!form->car) {
+    emit_with_constant(c, OP_CONST, form); // the empty list
+    return;
+  }
+  int special_form = obj_tag(form->car) == 'Y' ? form->car->dispatch : SPECIAL_FORM_NONE;
+  switch(special_form) {
+  case SPECIAL_FORM_NONE:
+    compile_call(c, form, tail);
+    break;
+  case SPECIAL_FORM_DO:
+    compile_do(c, form, tail);
+    break;
+  case SPECIAL_FORM_LET:
+    compile_let(c, form, tail);
+    break;
+  case SPECIAL_FORM_NOT:
+    compile_not(c, form);
+    break;
+  case SPECIAL_FORM_QUOTE:
+    emit_with_constant(c, OP_CONST, form->cdr && form->cdr->car ? form->cdr->car : nil);
+    break;
+  case SPECIAL_FORM_WHILE:
+    compile_while(c, form);
+    break;
+  case SPECIAL_FORM_IF:
+    compile_if(c, form, tail);
+    break;
+  case SPECIAL_FORM_MATCH:
+    compile_match(c, form, tail);
+    break;
+  case SPECIAL_FORM_RESET:
+    compile_reset(c, form);
+    break;
+  case SPECIAL_FORM_RESOLVED_FN:
+    compile_lambda(c, form);
+    break;
+  case SPECIAL_FORM_REF:
+    if(form->cdr && form->cdr->car) {
+      compile(c, form->cdr->car, tail);
+    }
+    else {
+      emit_with_constant(c, OP_EVAL, form);
+    }
+    break;
+  default:
+    // fn (in bodies that aren't resolved), macro, def and def?
+    emit_with_constant(c, OP_EVAL, form);
+    break;
+  }
+}
+
+void compile(Compiler *c, Obj *form, bool tail) {
+  if(!form) {
+    emit_with_constant(c, OP_CONST, nil);
+    return;
+  }
+  switch(obj_tag(form)) {
+  case 'X':
+    if(form->ref_depth >= 0) {
+      emit(c, OP_SLOT);
+      emit(c, form->ref_depth);
+      emit(c, form->ref_index);
+    }
+    else {
+      emit_with_constant(c, OP_GLOBAL, form);
+    }
+    break;
+  case 'Y':
+    emit_with_constant(c, OP_NAME, obj_new_ref(form, REF_NAME, 0));
+    break;
+  case 'C':
+    compile_list(c, form, tail);
+    break;
+  case 'A': case 'H': case 'E':
+    // Literals that make a new object each time
+    emit_with_constant(c, OP_EVAL, form);
+    break;
+  default:
+    emit_with_constant(c, OP_CONST, form);
+    break;
+  }
+}
+
+Obj *bytecode_compile(Obj *body) {
+  Compiler c = { malloc(sizeof(int) * 16), 0, 16, obj_new_array(8) };
+  compile(&c, body, true);
+  emit(&c, OP_RETURN);
+  return obj_new_bytecode(realloc(c.ops, sizeof(int) * c.count), c.count, c.constants);
+}
+
+Obj *frame_at_depth(Obj *env, int depth) {
+  for(; depth > 0; depth--) {
+    env = env_parent(env);
+  }
+  assert(obj_tag(env) == 'G');
+  return env;
+}
+
+// 'frame_function' is the lambda that 'env' is a new frame of, or NULL
+void vm_run(Obj *code, Obj *env, Obj *frame_function) {
+  if(c_stack_exhausted()) {
+    return;
+  }
+
+  static void *dispatch[OP_COUNT] = {
+    [OP_CONST] = &&op_const,
+    [OP_SLOT] = &&op_slot,
+    [OP_GLOBAL] = &&op_global,
+    [OP_NAME] = &&op_name,
+    [OP_SET_SLOT] = &&op_set_slot,
+    [OP_SET_NAME] = &&op_set_name,
+    [OP_POP] = &&op_pop,
+    [OP_JUMP] = &&op_jump,
+    [OP_JUMP_IF_FALSE] = &&op_jump_if_false,
+    [OP_JUMP_IF_TRUE] = &&op_jump_if_true,
+    [OP_LOOP] = &&op_loop,
+    [OP_LET] = &&op_let,
+    [OP_BIND] = &&op_bind,
+    [OP_END_LET] = &&op_end_let,
+    [OP_LAMBDA] = &&op_lambda,
+    [OP_MATCH] = &&op_match,
+    [OP_MACRO] = &&op_macro,
+    [OP_CALL] = &&op_call,
+    [OP_TAIL_MATCH] = &&op_match,
+    [OP_TAIL_MACRO] = &&op_macro,
+    [OP_TAIL_CALL] = &&op_call,
+    [OP_EVAL] = &&op_eval,
+    [OP_RETURN] = &&op_return,
+  };
+
+  // Tail calls put the stacks and the function trace back to how they were when the run started
+  int stack_base = stack_pos;
+  int shadow_base = shadow_stack_pos;
+  int trace_base = function_trace_pos;
+
+  int *ops = code->bc_ops;
+  Obj **constants = code->bc_constants->items;
+  int *pc = ops;
+
+  // The frame goes back to its lambda when the call is done, unless a closure, a match
+  // or a macro expansion was made in it (those can keep a reference to their env)
+  Obj *frame = env;
+  bool frame_kept = false;
+
+#define NEXT goto *dispatch[*pc++]
+
+  // Continues the run with other code, from a tail position where the stack only has the operands of the instruction
+#define TAIL_RUN(next_code, next_env) {		\
+    stack_pos = stack_base;			\
+    shadow_stack_pos = shadow_base;		\
+    code = (next_code);				\
+    env = (next_env);				\
+    shadow_stack_push(code);			\
+    shadow_stack_push(env);			\
+    ops = code->bc_ops;				\
+    constants = code->bc_constants->items;	\
+    pc = ops;					\
+  }
+
+  NEXT;
+
+ op_const:
+  stack_push(constants[*pc++]);
+  NEXT;
+
+ op_slot: {
+    Obj *frame = frame_at_depth(env, pc[0]);
+    stack_push(frame->frame_slots[pc[1]]);
+    pc += 2;
+    NEXT;
+  }
+
+ op_global: {
+    Obj *ref = constants[*pc++];
+    Obj *value = lexical_lookup(env, ref);
+    if(!value) {
+      lookup_error(ref);
+      return;
+    }
+    stack_push(value);
+    NEXT;
+  }
+
+ op_name: {
+    Obj *ref = constants[*pc++];
+    Obj *value = lexical_lookup_name(env, ref);
+    if(!value) {
+      lookup_error(ref->ref_symbol);
+      return;
+    }
+    stack_push(value);
+    NEXT;
+  }
+
+ op_set_slot: {
+    Obj *frame = frame_at_depth(env, pc[0]);
+    Obj *value = stack[stack_pos - 1];
+    frame->frame_slots[pc[1]] = value;
+    gc_write_barrier(frame, value);
+    pc += 2;
+    NEXT;
+  }
+
+ op_set_name: {
+    Obj *symbol = constants[*pc++];
+    Obj *owner = NULL;
+    Obj **place = env_lookup_place(env, symbol, &owner);
+    if(!place) {
+      printf("Can't reset! binding '%s', it's not defined\n", symbol->s);
+      stack[stack_pos - 1] = nil;
+      NEXT;
+    }
+    *place = stack[stack_pos - 1];
+    gc_write_barrier(owner, *place);
+    NEXT;
+  }
+
+ op_pop:
+  stack_pos--;
+  NEXT;
+
+ op_jump:
+  pc = ops + *pc;
+  NEXT;
+
+ op_jump_if_false:
+  if(is_true(stack[--stack_pos])) {
+    pc++;
+  }
+  else {
+    pc = ops + *pc;
+  }
+  NEXT;
+
+ op_jump_if_true:
+  if(is_true(stack[--stack_pos])) {
+    pc = ops + *pc;
+  }
+  else {
+    pc++;
+  }
+  NEXT;
+
+ op_loop:
+  if(error) { return; } // a push went over the stack limit
+  gc_point();
+  pc = ops + *pc;
+  NEXT;
+
+ op_let:
+  env = obj_new_environment(env);
+  shadow_stack_push(env);
+  NEXT;
+
+ op_bind: {
+    Obj *symbol = constants[*pc++];
+    env_extend(env, symbol, stack[--stack_pos]);
+    NEXT;
+  }
+
+ op_end_let:
+  shadow_stack_pop(); // the env of the let
+  env = env->parent;
+  NEXT;
+
+ op_lambda: {
+    frame_kept = true;
+    Obj *form = constants[pc[0]];
+    Obj *lambda = obj_new_lambda(form->cdr->car, form->cdr->cdr->car, env, form);
+    lambda->frame_size = lexical_frame_size(form->cdr->car);
+    lambda->bytecode = constants[pc[0] + 1];
+    stack_push(lambda);
+    pc++;
+    NEXT;
+  }
+
+ op_match: {
+    frame_kept = true;
+    bool tail = pc[-1] == OP_TAIL_MATCH;
+    Obj *clauses = constants[*pc++];
+    Obj *value = stack[stack_pos - 1]; // stays on the stack so the GC sees it
+    for(int i = 0; i < clauses->count; i += 2) {
+      Obj *match_env = obj_new_environment(env);
+      shadow_stack_push(match_env);
+      if(obj_match(match_env, clauses->items[i], value)) {
+	if(tail) {
+	  TAIL_RUN(clauses->items[i + 1], match_env);
+	  NEXT;
+	}
+	bytecode_run(clauses->items[i + 1], match_env);
+	if(error) { return; }
+	shadow_stack_pop(); // match_env
+	stack[stack_pos - 2] = stack[stack_pos - 1];
+	stack_pos--;
+	NEXT;
+      }
+      shadow_stack_pop(); // match_env
+    }
+    set_error("Failed to find a suitable match for: ", value);
+  }
+
+ op_macro: {
+    Obj *function = stack[stack_pos - 1];
+    if(function && obj_tag(function) == 'M') {
+      frame_kept = true;
+      stack_pos--;
+      Obj *form = constants[pc[0]];
+      shadow_stack_push(form);
+      if(pc[-1] == OP_TAIL_MACRO) {
+	Obj *expansion_code;
+	Obj *expanded = macro_expansion(function, form, &expansion_code);
+	if(error) { return; }
+	if(expansion_code) {
+	  TAIL_RUN(expansion_code, env);
+	  NEXT;
+	}
+	// Not compiled on its first use
+	shadow_stack_push(expanded);
+	eval_internal(env, expanded);
+	if(error) { return; }
+	shadow_stack_pop(); // expanded
+      }
+      else {
+	apply_macro(env, function, form);
+	if(error) { return; }
+      }
+      shadow_stack_pop(); // form
+      pc = ops + pc[1];
+    }
+    else {
+      pc += 2;
+    }
+    NEXT;
+  }
+
+ op_call: {
+    bool tail = pc[-1] == OP_TAIL_CALL;
+    int arg_count = pc[0];
+    Obj *form = constants[pc[1]];
+    pc += 2;
+    int base = stack_pos - arg_count - 1;
+    Obj *function = stack[base];
+    assert_or_set_error(function, "Can't call NULL.", form);
+    gc_point(); // the function and the args are on the stack
+    if(tail && obj_tag(function) == 'L' && bytecode_enabled) {
+      function_trace_pos = trace_base;
+      function_trace_push(form);
+      if(error) { return; }
+      if(frame_function && !frame_kept) {
+	lambda_release_frame(frame_function, frame); // before the new frame is made, a self call gets it back
+      }
+      Obj *calling_env = lambda_calling_env(function, stack + base + 1, arg_count);
+      if(error) { return; }
+      Obj *body_code = lambda_bytecode(function);
+      TAIL_RUN(body_code, calling_env);
+      shadow_stack_push(function);
+      frame_function = function->frame_size >= 0 ? function : NULL;
+      frame = calling_env;
+      frame_kept = false;
+      NEXT;
+    }
+    int trace_pos = function_trace_pos;
+    function_trace_push(form);
+    if(error) { return; }
+    apply(function, stack + base + 1, arg_count);
+    if(error) { return; }
+    function_trace_pos = trace_pos;
+    stack[base] = stack[stack_pos - 1];
+    stack_pos = base + 1;
+    NEXT;
+  }
+
+ op_eval:
+  frame_kept = true;
+  eval_internal(env, constants[*pc++]);
+  if(error) { return; }
+  NEXT;
+
+ op_return:
+  shadow_stack_pos = shadow_base; // the code and env of the last tail call
+  function_trace_pos = trace_base;
+  if(frame_function && !frame_kept) {
+    lambda_release_frame(frame_function, frame);
+  }
+  return;
+
+#undef TAIL_RUN
+#undef NEXT
+}
+
+void bytecode_run(Obj *code, Obj *env) {
+  vm_run(code, env, NULL);
+}
+
+void bytecode_call(Obj *function, Obj *frame) {
+  vm_run(lambda_bytecode(function), frame, function->frame_size >= 0 ? function : NULL);
+}
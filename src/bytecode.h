@@ -0,0 +1,23 @@
+#pragma once
+
+#include "obj.h"
+
+// Lambda bodies are compiled to bytecode ('B') on the first call of the lambda, the result is kept
+// in its 'bytecode' field. The VM runs the instructions with a computed goto per instruction and
+// keeps its operands on the same stack as the evaluator, so apply() and the primops work as before.
+// Forms that are rare or malformed are compiled to an instruction that gives them to eval_internal(),
+// as are macro calls (after their function has been looked up, so macros can be defined late).
+
+// Off with the CARP_VM=0 environment variable or (set-bytecode! false), to compare with the evaluator
+bool bytecode_enabled;
+
+void bytecode_init();
+
+Obj *bytecode_compile(Obj *body);
+
+// Pushes the value of the compiled form in 'env', or sets 'error'
+void bytecode_run(Obj *code, Obj *env);
+
+// Runs the body of 'function' in the env or frame from lambda_calling_env(). The frame is given
+// back to the function for its next call when nothing can have kept a reference to it.
+void bytecode_call(Obj *function, Obj *frame);
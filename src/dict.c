@@ -0,0 +1,349 @@
+#include "dict.h"
+#include "gc.h"
+#include "pvec.h"
+
+#define DICT_BITS 5
+#define DICT_MASK ((1 << DICT_BITS) - 1)
+
+// After using up all 32 bits of the hash, keys with the same hash go into a collision node (bitmap 0)
+#define DICT_MAX_SHIFT 32
+
+unsigned int hash_mix(unsigned int x) {
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+void hash_dict_entry(Obj *key, Obj *value, void *data) {
+  *(unsigned int*)data += hash_mix(obj_hash(key) ^ obj_hash(value));
+}
+
+unsigned int obj_hash(Obj *o) {
+  if(!o) {
+    return 0;
+  }
+  switch(obj_tag(o)) {
+  case 'I':
+    return hash_mix((unsigned int)obj_int(o));
+  case 'V': {
+    float x = obj_float(o);
+    uint32_t bits;
+    if(x == 0) {
+      x = 0; // -0.0 is = to 0.0
+    }
+    memcpy(&bits, &x, sizeof(bits));
+    return hash_mix(bits ^ 0x9e3779b9);
+  }
+  case 'W': {
+    double x = o->d == 0 ? 0 : o->d;
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return hash_mix((unsigned int)(bits ^ (bits >> 32)) ^ 0x7f4a7c15);
+  }
+  case 'Q':
+    // Pointer objects are = when they point to the same address
+    return hash_mix((unsigned int)((uintptr_t)o->void_ptr >> 3) ^ ((uintptr_t)o->void_ptr >> 35));
+  case 'E':
+    // Envs are = when they have the same bindings, which can come from their parents, so they all get
+    // the same hash. They are rare as keys.
+    return 43;
+  case 'J':
+    return hash_mix((unsigned int)(o->l ^ (o->l >> 32)));
+  case 'S': case 'Y': case 'K':
+    // Symbols and keywords are hashed by name (not address) so that the order of 'keys' is the same every run
+    return intern_hash(obj_tag(o), o->s);
+  case 'C': {
+    unsigned int h = 17;
+    for(Obj *p = o; p && p->car; p = p->cdr) {
+      h = h * 31 + obj_hash(p->car);
+    }
+    return h;
+  }
+  case 'A': {
+    unsigned int h = 19;
+    for(int i = 0; i < o->count; i++) {
+      h = h * 31 + obj_hash(o->items[i]);
+    }
+    return h;
+  }
+  case 'R': {
+    unsigned int h = 37;
+    for(int i = 0; i < o->pvec_count; i++) {
+      h = h * 31 + obj_hash(pvec_nth(o, i));
+    }
+    return h;
+  }
+  case 'N': {
+    unsigned int h = 23;
+    unsigned int *bits = o->numbers;
+    for(int i = 0; i < o->number_count; i++) {
+      h = h * 31 + bits[i];
+    }
+    return h;
+  }
+  case 'H': {
+    // The same entries can be in tries of different shapes, so the entry hashes are just added up
+    unsigned int h = 29;
+    dict_each(o, hash_dict_entry, &h);
+    return h;
+  }
+  default:
+    return hash_mix((unsigned int)((uintptr_t)o >> 3));
+  }
+}
+
+int entry_index(Obj *node, unsigned int bit) {
+  return __builtin_popcount(node->bitmap & (bit - 1));
+}
+
+unsigned int slice_bit(unsigned int hash, int shift) {
+  return 1u << ((hash >> shift) & DICT_MASK);
+}
+
+Obj *node_lookup(Obj *node, Obj *key, unsigned int hash) {
+  int shift = 0;
+  while(node) {
+    if(node->bitmap == 0) {
+      for(int i = 0; i < node->entry_count; i++) {
+	if(obj_eq(node->entries[i * 2], key)) {
+	  return node->entries[i * 2 + 1];
+	}
+      }
+      return NULL;
+    }
+    unsigned int bit = slice_bit(hash, shift);
+    if(!(node->bitmap & bit)) {
+      return NULL;
+    }
+    int i = entry_index(node, bit);
+    Obj *k = node->entries[i * 2];
+    Obj *v = node->entries[i * 2 + 1];
+    if(!k) {
+      node = v;
+      shift += DICT_BITS;
+    }
+    else {
+      return obj_eq(k, key) ? v : NULL;
+    }
+  }
+  return NULL;
+}
+
+// A copy of 'node' with one entry inserted at 'at' (when 'insert') or with its value replaced
+Obj *node_with_entry(Obj *node, unsigned int bitmap, int at, Obj *key, Obj *value, bool insert) {
+  Obj *new_node = obj_new_dict_node(bitmap, node->entry_count + (insert ? 1 : 0));
+  if(insert) {
+    memcpy(new_node->entries, node->entries, sizeof(Obj*) * at * 2);
+    memcpy(new_node->entries + (at + 1) * 2, node->entries + at * 2, sizeof(Obj*) * (node->entry_count - at) * 2);
+  }
+  else {
+    memcpy(new_node->entries, node->entries, sizeof(Obj*) * node->entry_count * 2);
+  }
+  new_node->entries[at * 2] = key;
+  new_node->entries[at * 2 + 1] = value;
+  return new_node;
+}
+
+Obj *node_without_entry(Obj *node, unsigned int bitmap, int at) {
+  if(node->entry_count == 1) {
+    return NULL;
+  }
+  Obj *new_node = obj_new_dict_node(bitmap, node->entry_count - 1);
+  memcpy(new_node->entries, node->entries, sizeof(Obj*) * at * 2);
+  memcpy(new_node->entries + at * 2, node->entries + (at + 1) * 2, sizeof(Obj*) * (node->entry_count - at - 1) * 2);
+  return new_node;
+}
+
+// A node with two keys that had the same hash slice in the level above
+Obj *node_pair(Obj *k1, unsigned int h1, Obj *v1, Obj *k2, unsigned int h2, Obj *v2, int shift) {
+  if(shift >= DICT_MAX_SHIFT) {
+    Obj *node = obj_new_dict_node(0, 2);
+    node->entries[0] = k1;
+    node->entries[1] = v1;
+    node->entries[2] = k2;
+    node->entries[3] = v2;
+    return node;
+  }
+  unsigned int b1 = slice_bit(h1, shift);
+  unsigned int b2 = slice_bit(h2, shift);
+  if(b1 == b2) {
+    Obj *node = obj_new_dict_node(b1, 1);
+    node->entries[1] = node_pair(k1, h1, v1, k2, h2, v2, shift + DICT_BITS);
+    return node;
+  }
+  Obj *node = obj_new_dict_node(b1 | b2, 2);
+  int i1 = b1 < b2 ? 0 : 1;
+  node->entries[i1 * 2] = k1;
+  node->entries[i1 * 2 + 1] = v1;
+  node->entries[(1 - i1) * 2] = k2;
+  node->entries[(1 - i1) * 2 + 1] = v2;
+  return node;
+}
+
+Obj *node_assoc(Obj *node, Obj *key, unsigned int hash, Obj *value, int shift, bool *added) {
+  if(!node) {
+    *added = true;
+    Obj *new_node = obj_new_dict_node(slice_bit(hash, shift), 1);
+    new_node->entries[0] = key;
+    new_node->entries[1] = value;
+    return new_node;
+  }
+  if(node->bitmap == 0) {
+    for(int i = 0; i < node->entry_count; i++) {
+      if(obj_eq(node->entries[i * 2], key)) {
+	return node_with_entry(node, 0, i, key, value, false);
+      }
+    }
+    *added = true;
+    return node_with_entry(node, 0, node->entry_count, key, value, true);
+  }
+  unsigned int bit = slice_bit(hash, shift);
+  int i = entry_index(node, bit);
+  if(!(node->bitmap & bit)) {
+    *added = true;
+    return node_with_entry(node, node->bitmap | bit, i, key, value, true);
+  }
+  Obj *k = node->entries[i * 2];
+  Obj *v = node->entries[i * 2 + 1];
+  if(!k) {
+    Obj *child = node_assoc(v, key, hash, value, shift + DICT_BITS, added);
+    return node_with_entry(node, node->bitmap, i, NULL, child, false);
+  }
+  else if(obj_eq(k, key)) {
+    return v == value ? node : node_with_entry(node, node->bitmap, i, k, value, false);
+  }
+  else {
+    *added = true;
+    Obj *child = node_pair(k, obj_hash(k), v, key, hash, value, shift + DICT_BITS);
+    return node_with_entry(node, node->bitmap, i, NULL, child, false);
+  }
+}
+
+Obj *node_dissoc(Obj *node, Obj *key, unsigned int hash, int shift, bool *removed) {
+  if(!node) {
+    return NULL;
+  }
+  if(node->bitmap == 0) {
+    for(int i = 0; i < node->entry_count; i++) {
+      if(obj_eq(node->entries[i * 2], key)) {
+	*removed = true;
+	return node_without_entry(node, 0, i);
+      }
+    }
+    return node;
+  }
+  unsigned int bit = slice_bit(hash, shift);
+  if(!(node->bitmap & bit)) {
+    return node;
+  }
+  int i = entry_index(node, bit);
+  Obj *k = node->entries[i * 2];
+  Obj *v = node->entries[i * 2 + 1];
+  if(!k) {
+    Obj *child = node_dissoc(v, key, hash, shift + DICT_BITS, removed);
+    if(child == v) {
+      return node;
+    }
+    else if(!child) {
+      return node_without_entry(node, node->bitmap & ~bit, i);
+    }
+    else {
+      return node_with_entry(node, node->bitmap, i, NULL, child, false);
+    }
+  }
+  else if(obj_eq(k, key)) {
+    *removed = true;
+    return node_without_entry(node, node->bitmap & ~bit, i);
+  }
+  else {
+    return node;
+  }
+}
+
+void node_each(Obj *node, void (*visit)(Obj *key, Obj *value, void *data), void *data) {
+  for(int i = 0; i < node->entry_count; i++) {
+    Obj *k = node->entries[i * 2];
+    Obj *v = node->entries[i * 2 + 1];
+    if(k) {
+      visit(k, v, data);
+    }
+    else {
+      node_each(v, visit, data);
+    }
+  }
+}
+
+Obj *dict_get(Obj *dict, Obj *key) {
+  assert(obj_tag(dict) == 'H');
+  return node_lookup(dict->dict_root, key, obj_hash(key));
+}
+
+Obj *dict_assoc(Obj *dict, Obj *key, Obj *value) {
+  assert(obj_tag(dict) == 'H');
+  bool added = false;
+  Obj *root = node_assoc(dict->dict_root, key, obj_hash(key), value, 0, &added);
+  return obj_new_dict(root, dict->dict_count + (added ? 1 : 0));
+}
+
+Obj *dict_dissoc(Obj *dict, Obj *key) {
+  assert(obj_tag(dict) == 'H');
+  bool removed = false;
+  Obj *root = node_dissoc(dict->dict_root, key, obj_hash(key), 0, &removed);
+  return obj_new_dict(root, dict->dict_count - (removed ? 1 : 0));
+}
+
+void dict_set(Obj *dict, Obj *key, Obj *value) {
+  assert(obj_tag(dict) == 'H');
+  bool added = false;
+  dict->dict_root = node_assoc(dict->dict_root, key, obj_hash(key), value, 0, &added);
+  gc_write_barrier(dict, dict->dict_root);
+  if(added) {
+    dict->dict_count++;
+  }
+}
+
+void dict_remove(Obj *dict, Obj *key) {
+  assert(obj_tag(dict) == 'H');
+  bool removed = false;
+  dict->dict_root = node_dissoc(dict->dict_root, key, obj_hash(key), 0, &removed);
+  gc_write_barrier(dict, dict->dict_root);
+  if(removed) {
+    dict->dict_count--;
+  }
+}
+
+void dict_each(Obj *dict, void (*visit)(Obj *key, Obj *value, void *data), void *data) {
+  assert(obj_tag(dict) == 'H');
+  if(dict->dict_root) {
+    node_each(dict->dict_root, visit, data);
+  }
+}
+
+// Appends to the list that 'data' points to the last cell of
+void collect_key(Obj *key, Obj *value, void *data) {
+  Obj **last = data;
+  (*last)->car = key;
+  (*last)->cdr = obj_new_cons(NULL, NULL);
+  *last = (*last)->cdr;
+}
+
+void collect_value(Obj *key, Obj *value, void *data) {
+  collect_key(value, key, data);
+}
+
+Obj *dict_keys(Obj *dict) {
+  Obj *list = obj_new_cons(NULL, NULL);
+  Obj *last = list;
+  dict_each(dict, collect_key, &last);
+  return list;
+}
+
+Obj *dict_values(Obj *dict) {
+  Obj *list = obj_new_cons(NULL, NULL);
+  Obj *last = list;
+  dict_each(dict, collect_value, &last);
+  return list;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "obj.h"
+
+// Dictionaries ('H') are persistent hash array mapped tries. Each trie node ('T') uses
+// 5 bits of the key hash to pick one of 32 slots, only the used slots are stored (see 'bitmap').
+// Nodes are never changed once made, so an updated dictionary shares all nodes
+// except the ones on the path to the updated key. 'copy' still rebuilds the trie, since the
+// values in it can be mutable.
+// The 'H' object itself is mutable: dict_set and dict_remove replace its root.
+
+Obj *dict_get(Obj *dict, Obj *key); // NULL when the key is missing
+
+Obj *dict_assoc(Obj *dict, Obj *key, Obj *value); // new dictionary
+Obj *dict_dissoc(Obj *dict, Obj *key); // new dictionary
+
+void dict_set(Obj *dict, Obj *key, Obj *value);
+void dict_remove(Obj *dict, Obj *key);
+
+// Calls 'visit' for each entry, in the order of the key hashes
+void dict_each(Obj *dict, void (*visit)(Obj *key, Obj *value, void *data), void *data);
+
+Obj *dict_keys(Obj *dict);
+Obj *dict_values(Obj *dict);
+
+// Hash that agrees with obj_eq, i.e. equal objects get the same hash
+unsigned int obj_hash(Obj *o);
@@ -0,0 +1,154 @@
+#include "direct_call.h"
+
+// Arg classes are 'i' (ints), 'f' (floats), 'd' (doubles), 'l' (:i64 and :u64) and 'p' (strings and
+// pointers), the result can also be 'v' (void) or 'b' (bool). Signatures are written like "ff>f", args first.
+#define TRAMPOLINE(name, R, store, params, call_args)			\
+  void name(VoidFn f, FfiValue *a, FfiValue *r) {			\
+    store ((R (*)params)f)call_args;					\
+  }
+
+TRAMPOLINE(direct_0_v, void, , (void), ())
+TRAMPOLINE(direct_0_i, int, r->i =, (void), ())
+TRAMPOLINE(direct_0_b, bool, r->i = (int), (void), ())
+TRAMPOLINE(direct_0_f, float, r->f =, (void), ())
+TRAMPOLINE(direct_0_p, void*, r->p =, (void), ())
+TRAMPOLINE(direct_i_v, void, , (int), (a[0].i))
+TRAMPOLINE(direct_i_i, int, r->i =, (int), (a[0].i))
+TRAMPOLINE(direct_i_b, bool, r->i = (int), (int), (a[0].i))
+TRAMPOLINE(direct_i_f, float, r->f =, (int), (a[0].i))
+TRAMPOLINE(direct_i_p, void*, r->p =, (int), (a[0].i))
+TRAMPOLINE(direct_f_v, void, , (float), (a[0].f))
+TRAMPOLINE(direct_f_i, int, r->i =, (float), (a[0].f))
+TRAMPOLINE(direct_f_f, float, r->f =, (float), (a[0].f))
+TRAMPOLINE(direct_p_v, void, , (void*), (a[0].p))
+TRAMPOLINE(direct_p_i, int, r->i =, (void*), (a[0].p))
+TRAMPOLINE(direct_p_b, bool, r->i = (int), (void*), (a[0].p))
+TRAMPOLINE(direct_p_p, void*, r->p =, (void*), (a[0].p))
+TRAMPOLINE(direct_ii_v, void, , (int, int), (a[0].i, a[1].i))
+TRAMPOLINE(direct_ii_i, int, r->i =, (int, int), (a[0].i, a[1].i))
+TRAMPOLINE(direct_ii_b, bool, r->i = (int), (int, int), (a[0].i, a[1].i))
+TRAMPOLINE(direct_ff_v, void, , (float, float), (a[0].f, a[1].f))
+TRAMPOLINE(direct_ff_f, float, r->f =, (float, float), (a[0].f, a[1].f))
+TRAMPOLINE(direct_pp_v, void, , (void*, void*), (a[0].p, a[1].p))
+TRAMPOLINE(direct_pp_i, int, r->i =, (void*, void*), (a[0].p, a[1].p))
+TRAMPOLINE(direct_pp_b, bool, r->i = (int), (void*, void*), (a[0].p, a[1].p))
+TRAMPOLINE(direct_pp_p, void*, r->p =, (void*, void*), (a[0].p, a[1].p))
+TRAMPOLINE(direct_pi_v, void, , (void*, int), (a[0].p, a[1].i))
+TRAMPOLINE(direct_pi_i, int, r->i =, (void*, int), (a[0].p, a[1].i))
+TRAMPOLINE(direct_pi_p, void*, r->p =, (void*, int), (a[0].p, a[1].i))
+TRAMPOLINE(direct_iii_v, void, , (int, int, int), (a[0].i, a[1].i, a[2].i))
+TRAMPOLINE(direct_iii_i, int, r->i =, (int, int, int), (a[0].i, a[1].i, a[2].i))
+TRAMPOLINE(direct_fff_v, void, , (float, float, float), (a[0].f, a[1].f, a[2].f))
+TRAMPOLINE(direct_fff_f, float, r->f =, (float, float, float), (a[0].f, a[1].f, a[2].f))
+TRAMPOLINE(direct_ffff_v, void, , (float, float, float, float), (a[0].f, a[1].f, a[2].f, a[3].f))
+TRAMPOLINE(direct_i_d, double, r->d =, (int), (a[0].i))
+TRAMPOLINE(direct_f_d, double, r->d =, (float), (a[0].f))
+TRAMPOLINE(direct_d_i, int, r->i =, (double), (a[0].d))
+TRAMPOLINE(direct_d_f, float, r->f =, (double), (a[0].d))
+TRAMPOLINE(direct_d_d, double, r->d =, (double), (a[0].d))
+TRAMPOLINE(direct_dd_d, double, r->d =, (double, double), (a[0].d, a[1].d))
+TRAMPOLINE(direct_ddd_d, double, r->d =, (double, double, double), (a[0].d, a[1].d, a[2].d))
+TRAMPOLINE(direct_i_l, int64_t, r->l =, (int), (a[0].i))
+TRAMPOLINE(direct_l_i, int, r->i =, (int64_t), (a[0].l))
+TRAMPOLINE(direct_l_l, int64_t, r->l =, (int64_t), (a[0].l))
+TRAMPOLINE(direct_ll_l, int64_t, r->l =, (int64_t, int64_t), (a[0].l, a[1].l))
+TRAMPOLINE(direct_l_p, void*, r->p =, (int64_t), (a[0].l))
+TRAMPOLINE(direct_p_l, int64_t, r->l =, (void*), (a[0].p))
+
+typedef struct {
+  char *signature;
+  FfiDirect trampoline;
+} Trampoline;
+
+// The signatures of the builtins (with the libm ones on doubles), of most baked functions and of the GL and
+// GLFW functions in glfw_test.carp
+Trampoline trampolines[] = {
+  { ">v", direct_0_v },
+  { ">i", direct_0_i },
+  { ">b", direct_0_b },
+  { ">f", direct_0_f },
+  { ">p", direct_0_p },
+  { "i>v", direct_i_v },
+  { "i>i", direct_i_i },
+  { "i>b", direct_i_b },
+  { "i>f", direct_i_f },
+  { "i>p", direct_i_p },
+  { "f>v", direct_f_v },
+  { "f>i", direct_f_i },
+  { "f>f", direct_f_f },
+  { "p>v", direct_p_v },
+  { "p>i", direct_p_i },
+  { "p>b", direct_p_b },
+  { "p>p", direct_p_p },
+  { "ii>v", direct_ii_v },
+  { "ii>i", direct_ii_i },
+  { "ii>b", direct_ii_b },
+  { "ff>v", direct_ff_v },
+  { "ff>f", direct_ff_f },
+  { "pp>v", direct_pp_v },
+  { "pp>i", direct_pp_i },
+  { "pp>b", direct_pp_b },
+  { "pp>p", direct_pp_p },
+  { "pi>v", direct_pi_v },
+  { "pi>i", direct_pi_i },
+  { "pi>p", direct_pi_p },
+  { "iii>v", direct_iii_v },
+  { "iii>i", direct_iii_i },
+  { "fff>v", direct_fff_v },
+  { "fff>f", direct_fff_f },
+  { "ffff>v", direct_ffff_v },
+  { "i>d", direct_i_d },
+  { "f>d", direct_f_d },
+  { "d>i", direct_d_i },
+  { "d>f", direct_d_f },
+  { "d>d", direct_d_d },
+  { "dd>d", direct_dd_d },
+  { "ddd>d", direct_ddd_d },
+  { "i>l", direct_i_l },
+  { "l>i", direct_l_i },
+  { "l>l", direct_l_l },
+  { "ll>l", direct_ll_l },
+  { "l>p", direct_l_p },
+  { "p>l", direct_p_l },
+};
+
+void direct_call_init() {
+  char *direct = getenv("CARP_FFI_DIRECT");
+  ffi_direct_enabled = !(direct && strcmp(direct, "0") == 0);
+}
+
+char ffi_kind_class(char kind, bool result) {
+  switch(kind) {
+  case FFI_KIND_INT: return 'i';
+  case FFI_KIND_FLOAT: return 'f';
+  case FFI_KIND_DOUBLE: return 'd';
+  case FFI_KIND_INT64: return 'l';
+  case FFI_KIND_STRING: case FFI_KIND_PTR: case FFI_KIND_INT_PTR: case FFI_KIND_FLOAT_PTR:
+  case FFI_KIND_DOUBLE_PTR: case FFI_KIND_INT64_PTR: case FFI_KIND_STRUCT_PTR: return 'p';
+  case FFI_KIND_BOOL: return result ? 'b' : 0; // bool args aren't supported by 'apply'
+  case FFI_KIND_VOID: return result ? 'v' : 0;
+  default: return 0;
+  }
+}
+
+FfiDirect direct_call_find(FfiPlan *plan) {
+  if(plan->arg_count > 4) {
+    return NULL;
+  }
+  char signature[8];
+  for(int i = 0; i < plan->arg_count; i++) {
+    signature[i] = ffi_kind_class(plan->arg_kinds[i], false);
+    if(!signature[i]) {
+      return NULL;
+    }
+  }
+  signature[plan->arg_count] = '>';
+  signature[plan->arg_count + 1] = ffi_kind_class(plan->return_kind, true);
+  signature[plan->arg_count + 2] = '\0';
+  for(int i = 0; i < (int)(sizeof(trampolines) / sizeof(Trampoline)); i++) {
+    if(strcmp(trampolines[i].signature, signature) == 0) {
+      return trampolines[i].trampoline;
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "obj.h"
+
+// Foreign functions with one of the common signatures in direct_call.c are called through a function
+// pointer of their C type ("trampolines") instead of ffi_call(), which copies every arg through a
+// generic path. The args are checked and unboxed by 'apply' the same way for both.
+// Off with the CARP_FFI_DIRECT=0 environment variable or (set-ffi-direct! false), to compare with libffi.
+bool ffi_direct_enabled;
+
+void direct_call_init();
+
+// The trampoline for the signature in 'plan', or NULL when the calls have to go through libffi
+FfiDirect direct_call_find(FfiPlan *plan);
@@ -2,52 +2,276 @@
 #include "eval.h"
 #include "obj_string.h"
 #include "assertions.h"
+#include "gc.h"
 
-Obj *env_lookup(Obj *env, Obj *symbol) {
-  Obj *p = env->bindings;
-  while(p && p->car) {
-    Obj *pair = p->car;
-    if(obj_eq(pair->car, symbol)) {
-      return pair->cdr;
+// Environments with many bindings (like the global env) get an open addressing
+// hash index from key to binding pair, next to the 'bindings' list.
+// Only symbols and keywords are indexed since those are interned and can be hashed by pointer.
+#define ENV_INDEX_THRESHOLD 16
+
+typedef struct EnvIndex {
+  int size;
+  int count;
+  Obj *indexed_bindings; // the head of 'bindings' when the index was last updated
+  Obj **pairs;
+} EnvIndex;
+
+bool is_indexable_key(Obj *key) {
+  return key && (obj_tag(key) == 'Y' || obj_tag(key) == 'K');
+}
+
+unsigned int env_index_hash(Obj *key) {
+  uintptr_t x = (uintptr_t)key;
+  return (unsigned int)((x >> 4) ^ (x >> 20));
+}
+
+void env_index_insert(EnvIndex *index, Obj *pair, bool overwrite);
+
+void env_index_grow(EnvIndex *index) {
+  Obj **old_pairs = index->pairs;
+  int old_size = index->size;
+  index->size = old_size * 2;
+  index->pairs = calloc(index->size, sizeof(Obj*));
+  index->count = 0;
+  for(int i = 0; i < old_size; i++) {
+    if(old_pairs[i]) {
+      env_index_insert(index, old_pairs[i], true);
     }
-    else {
-      p = p->cdr;
+  }
+  free(old_pairs);
+}
+
+void env_index_insert(EnvIndex *index, Obj *pair, bool overwrite) {
+  if(index->count * 2 >= index->size) {
+    env_index_grow(index);
+  }
+  unsigned int mask = index->size - 1;
+  unsigned int i = env_index_hash(pair->car) & mask;
+  while(index->pairs[i]) {
+    if(index->pairs[i]->car == pair->car) {
+      if(overwrite) {
+        index->pairs[i] = pair;
+      }
+      return;
     }
+    i = (i + 1) & mask;
   }
-  if(env->parent) {
-    return env_lookup(env->parent, symbol);
+  index->pairs[i] = pair;
+  index->count++;
+}
+
+void env_index_build(Obj *env) {
+  env_index_free(env);
+  EnvIndex *index = malloc(sizeof(EnvIndex));
+  index->size = 64;
+  index->count = 0;
+  index->pairs = calloc(index->size, sizeof(Obj*));
+  // The list is newest first, so never overwrite; shadowed bindings further down are ignored.
+  Obj *p = env->bindings;
+  while(p && p->car) {
+    if(is_indexable_key(p->car->car)) {
+      env_index_insert(index, p->car, false);
+    }
+    p = p->cdr;
   }
-  else {
-    return NULL;
+  index->indexed_bindings = env->bindings;
+  env->index = index;
+}
+
+void env_index_free(Obj *env) {
+  if(env->index) {
+    free(env->index->pairs);
+    free(env->index);
+    env->index = NULL;
   }
 }
 
-Obj *env_lookup_binding(Obj *env, Obj *symbol) {
+Obj *env_find_pair(Obj *env, Obj *key) {
+  if(env->index && env->index->indexed_bindings != env->bindings) {
+    env_index_build(env); // bindings were replaced behind our back
+  }
+  if(env->index && is_indexable_key(key)) {
+    EnvIndex *index = env->index;
+    unsigned int mask = index->size - 1;
+    unsigned int i = env_index_hash(key) & mask;
+    while(index->pairs[i]) {
+      if(index->pairs[i]->car == key) {
+        return index->pairs[i];
+      }
+      i = (i + 1) & mask;
+    }
+    return NULL;
+  }
+  int steps = 0;
   Obj *p = env->bindings;
   while(p && p->car) {
     Obj *pair = p->car;
-    if(obj_eq(pair->car, symbol)) {
+    if(obj_eq(pair->car, key)) {
       return pair;
     }
-    else {
-      p = p->cdr;
+    p = p->cdr;
+    steps++;
+  }
+  if(steps > ENV_INDEX_THRESHOLD && !env->index && is_indexable_key(key)) {
+    env_index_build(env);
+  }
+  return NULL;
+}
+
+int frame_find_slot(Obj *frame, Obj *symbol) {
+  int slot = -1;
+  Obj *p = frame->frame_names;
+  for(int i = 0; i < frame->frame_count; i++) {
+    if(p->car == symbol) {
+      slot = i; // the last one wins, like when the params were bound one at a time
     }
+    p = p->cdr;
   }
-  if(env->parent) {
-    return env_lookup_binding(env->parent, symbol);
+  return slot;
+}
+
+// The shape after adding a key to an env of 'shape' is looked up in a table, so envs that get the
+// same keys end up with the same shape. It's cleared when full, shapes made after that are new
+// numbers, which is fine since they only have to be the same for the same keys, not all the time.
+#define SHAPE_TABLE_SIZE (1 << 16)
+
+typedef struct {
+  long from;
+  Obj *key; // interned, but a cell whose symbol is freed can get another one (see env_extend)
+  long to;
+} ShapeTransition;
+
+ShapeTransition *shape_table = NULL;
+int shape_table_count = 0;
+long shape_count = 0; // the last shape that was handed out, 0 is the shape of new envs
+
+long env_shape_after(long shape, Obj *key) {
+  if(!shape_table || shape_table_count * 2 >= SHAPE_TABLE_SIZE) {
+    free(shape_table);
+    shape_table = calloc(SHAPE_TABLE_SIZE, sizeof(ShapeTransition));
+    shape_table_count = 0;
+  }
+  unsigned int mask = SHAPE_TABLE_SIZE - 1;
+  unsigned int i = (env_index_hash(key) ^ (unsigned int)(shape * 0x9E3779B1)) & mask;
+  while(shape_table[i].key) {
+    if(shape_table[i].from == shape && shape_table[i].key == key) {
+      return shape_table[i].to;
+    }
+    i = (i + 1) & mask;
+  }
+  shape_table[i].from = shape;
+  shape_table[i].key = key;
+  shape_table[i].to = ++shape_count;
+  shape_table_count++;
+  return shape_table[i].to;
+}
+
+Obj *env_parent(Obj *env) {
+  return obj_tag(env) == 'G' ? env->frame_parent : env->parent;
+}
+
+Obj *env_lookup(Obj *env, Obj *symbol) {
+  while(env) {
+    if(obj_tag(env) == 'G') {
+      int slot = frame_find_slot(env, symbol);
+      if(slot >= 0) {
+	return env->frame_slots[slot];
+      }
+      env = env->frame_parent;
+      continue;
+    }
+    Obj *pair = env_find_pair(env, symbol);
+    if(pair) {
+      return pair->cdr;
+    }
+    env = env->parent;
+  }
+  return NULL;
+}
+
+// Frames have no binding pairs, so they are skipped
+Obj *env_lookup_binding(Obj *env, Obj *symbol) {
+  while(env) {
+    if(obj_tag(env) == 'E') {
+      Obj *pair = env_find_pair(env, symbol);
+      if(pair) {
+	return pair;
+      }
+    }
+    env = env_parent(env);
   }
-  else {
-    return nil;
+  return nil;
+}
+
+Obj **env_lookup_place(Obj *env, Obj *symbol, Obj **owner) {
+  while(env) {
+    if(obj_tag(env) == 'G') {
+      int slot = frame_find_slot(env, symbol);
+      if(slot >= 0) {
+	*owner = env;
+	return &env->frame_slots[slot];
+      }
+    }
+    else {
+      Obj *pair = env_find_pair(env, symbol);
+      if(pair) {
+	*owner = pair;
+	return &pair->cdr;
+      }
+    }
+    env = env_parent(env);
   }
+  return NULL;
 }
 
 void env_extend(Obj *env, Obj *key, Obj *value) {
-  assert(env->tag == 'E');
+  assert(obj_tag(env) == 'E');
   
   Obj *pair = obj_new_cons(key, value);
   Obj *cons = obj_new_cons(pair, env->bindings);
 
+  if(env->index && env->index->indexed_bindings == env->bindings) {
+    if(is_indexable_key(key)) {
+      env_index_insert(env->index, pair, true);
+    }
+    env->index->indexed_bindings = cons;
+  }
+  
   env->bindings = cons;
+  gc_write_barrier(env, cons);
+  // A key in the table can be a reused cell of a freed symbol, but then the envs with that shape only
+  // differ in keys that no name with a cached lookup can have (its symbol is kept alive by the ref)
+  env->shape = is_indexable_key(key) && !env->index ? env_shape_after(env->shape, key) : ++shape_count;
+  env->key_bits |= is_indexable_key(key) ? env_key_bit(key) : ~(uint64_t)0;
+}
+
+void env_remove(Obj *env, Obj *key) {
+  assert(obj_tag(env) == 'E');
+
+  Obj *prev = NULL;
+  Obj *p = env->bindings;
+  while(p && p->car) {
+    Obj *pair = p->car;
+    if(obj_eq(pair->car, key)) {
+      pair->car = NULL; // tells the cached global references (see lexical.c) that the binding is gone
+      if(prev) {
+	prev->cdr = p->cdr;
+	gc_write_barrier(prev, p->cdr);
+      }
+      else {
+	env->bindings = p->cdr;
+	gc_write_barrier(env, p->cdr);
+      }
+      // A shadowed binding with the same key may become visible, so just rebuild the index when needed.
+      env_index_free(env);
+      env->shape = ++shape_count;
+      break;
+    }
+    else {
+      prev = p;
+      p = p->cdr;
+    }
+  }
 }
 
 void env_extend_with_args(Obj *calling_env, Obj *function, int arg_count, Obj **args) {
@@ -69,6 +293,7 @@ void global_env_extend(Obj *key, Obj *val) {
   Obj *existing_binding = env_lookup_binding(global_env, key);
   if(existing_binding->car) {
     existing_binding->cdr = val;
+    gc_write_barrier(existing_binding, val);
   } else {
     env_extend(global_env, key, val);
   }
@@ -5,7 +5,31 @@
 Obj *env_lookup(Obj *env, Obj *symbol);
 Obj *env_lookup_binding(Obj *env, Obj *symbol);
 
+// Where the value of 'symbol' is kept (in a binding pair or a frame slot), or NULL.
+// 'owner' is set to the object that holds it, for the write barrier when changing it.
+Obj **env_lookup_place(Obj *env, Obj *symbol, Obj **owner);
+
+Obj *env_parent(Obj *env);
+
+// The binding pair for 'key' in this env only (not the parents), or NULL
+Obj *env_find_pair(Obj *env, Obj *key);
+
+// The slot of the param named 'symbol' in a frame, or -1
+int frame_find_slot(Obj *frame, Obj *symbol);
+
+// Binding shapes, for the cached lookups of names (see lexical_lookup_name).
+// Envs that got the same keys in the same order have the same 'shape', so a binding that was found
+// at some place in the list of one of them is at the same place in the others. The shape changes
+// when a binding is added or removed. Envs with an index (like the global env) get a new shape of
+// their own for each change, since their bindings are looked up in the index anyway.
+// 'key_bits' has the bit of each key that the env has had, an env without the bit of a key
+// doesn't have it (but one with the bit may not have it either).
+#define env_key_bit(key) ((uint64_t)1 << (((uintptr_t)(key) >> 4) & 63))
+
 void env_extend(Obj *env, Obj *key, Obj *value);
+void env_remove(Obj *env, Obj *key);
 void env_extend_with_args(Obj *calling_env, Obj *function, int arg_count, Obj **args);
 
 void global_env_extend(Obj *key, Obj *val);
+
+void env_index_free(Obj *env);
@@ -3,6 +3,15 @@
 #include "assertions.h"
 #include "reader.h"
 #include "gc.h"
+#include "dict.h"
+#include "lexical.h"
+#include "bytecode.h"
+#include "expansion.h"
+#include "direct_call.h"
+#include "ffi_values.h"
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #define LOG_EVAL 0
 #define LOG_STACK 0
@@ -11,9 +20,117 @@
 #define LOG_FUNC_APPLICATION 0
 #define GC_COLLECT_AFTER_EACH_FORM 0
 
+// Only the innermost calls of the function trace are printed, each at most this long
+#define FUNCTION_TRACE_PRINT_MAX 50
 #define STACK_TRACE_LEN 256
-char function_trace[STACK_SIZE][STACK_TRACE_LEN];
-int function_trace_pos;
+
+// 'c_stack_max' bytes below the frame of stack_init(), some room is left for primops and printing
+#define C_STACK_DEFAULT_SIZE (8 * 1024 * 1024)
+#define C_STACK_MARGIN (256 * 1024)
+char *c_stack_base;
+size_t c_stack_max;
+
+// Each stack is one range of addresses that is reserved up front and never moves, so pointers
+// into it stay valid while it grows (see primops.h). Only the first 'size' entries of it are
+// backed by memory, the rest can't be touched until the stack grows into it.
+// The range has room for twice the largest limit, see stack_grow().
+#define STACK_RESERVED_ENTRIES (2 * (size_t)STACK_MAX_LIMIT)
+
+Obj **stack_reserve(char *name) {
+  Obj **array = mmap(NULL, sizeof(Obj*) * STACK_RESERVED_ENTRIES, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(array == MAP_FAILED || mprotect(array, sizeof(Obj*) * STACK_INITIAL_SIZE, PROT_READ | PROT_WRITE) != 0) {
+    printf("Failed to map memory for the %s.\n", name);
+    exit(1);
+  }
+  return array;
+}
+
+void stack_init() {
+  stack_limit = STACK_DEFAULT_LIMIT;
+  char *limit = getenv("CARP_STACK_LIMIT");
+  if(limit) {
+    if(atoi(limit) >= STACK_INITIAL_SIZE && atoi(limit) <= STACK_MAX_LIMIT) {
+      stack_limit = atoi(limit);
+    }
+    else {
+      printf("Ignoring CARP_STACK_LIMIT=%s, it must be between %d and %d.\n", limit, STACK_INITIAL_SIZE, STACK_MAX_LIMIT);
+    }
+  }
+
+  c_stack_base = __builtin_frame_address(0);
+  size_t c_stack_size = C_STACK_DEFAULT_SIZE;
+  struct rlimit rlimit;
+  if(getrlimit(RLIMIT_STACK, &rlimit) == 0 && rlimit.rlim_cur != RLIM_INFINITY) {
+    c_stack_size = rlimit.rlim_cur;
+  }
+  c_stack_max = c_stack_size > 2 * C_STACK_MARGIN ? c_stack_size - C_STACK_MARGIN : c_stack_size / 2;
+
+  char *trace = getenv("CARP_TRACE");
+  function_trace_enabled = !(trace && strcmp(trace, "0") == 0);
+
+  stack_size = shadow_stack_size = function_trace_size = STACK_INITIAL_SIZE;
+  stack = stack_reserve("stack");
+  shadow_stack = stack_reserve("shadow stack");
+  function_trace = stack_reserve("function trace");
+  stack_pos = 0;
+  shadow_stack_pos = 0;
+  function_trace_pos = 0;
+}
+
+bool c_stack_exhausted() {
+  char *here = __builtin_frame_address(0);
+  if((size_t)(c_stack_base - here) > c_stack_max) {
+    if(!error) {
+      error = obj_new_string("Out of C stack, the calls are nested too deeply (the stack size is set with 'ulimit -s').");
+    }
+    return true;
+  }
+  return false;
+}
+
+// Doubles the size of one of the stacks, going over the limit sets 'error' (but the stack still grows,
+// so the pushes of the instruction that is running are kept until the error has stopped the evaluation)
+Obj **stack_grow(Obj **array, int *size, char *name) {
+  if(*size >= stack_limit && !error) {
+    char buffer[256];
+    snprintf(buffer, 256, "%s overflow, it's over the limit of %d entries (see 'set-stack-limit!').", name, stack_limit);
+    error = obj_new_string(buffer);
+  }
+  if((size_t)*size * 2 > STACK_RESERVED_ENTRIES ||
+     mprotect(array, sizeof(Obj*) * *size * 2, PROT_READ | PROT_WRITE) != 0) {
+    printf("Failed to grow the %s to %d entries.\n", name, *size * 2);
+    exit(1);
+  }
+  *size *= 2;
+  return array;
+}
+
+// Shrinks a stack that has grown past a new limit (but not below the entries in use), so growing it again is an error.
+// The memory of the entries that are dropped is given back, their addresses stay reserved.
+Obj **stack_shrink(Obj **array, int *size, int pos) {
+  int new_size = *size;
+  while(new_size > STACK_INITIAL_SIZE && new_size / 2 >= stack_limit && new_size / 2 >= pos) {
+    new_size /= 2;
+  }
+  if(new_size < *size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t kept = (sizeof(Obj*) * new_size + page - 1) / page * page;
+    if(kept < sizeof(Obj*) * *size) {
+      size_t dropped = sizeof(Obj*) * *size - kept;
+      madvise((char*)array + kept, dropped, MADV_DONTNEED);
+      mprotect((char*)array + kept, dropped, PROT_NONE);
+    }
+    *size = new_size;
+  }
+  return array;
+}
+
+void stack_set_limit(int limit) {
+  stack_limit = limit;
+  stack = stack_shrink(stack, &stack_size, stack_pos);
+  shadow_stack = stack_shrink(shadow_stack, &shadow_stack_size, shadow_stack_pos);
+  function_trace = stack_shrink(function_trace, &function_trace_size, function_trace_pos);
+}
 
 void stack_print() {
   printf("----- STACK -----\n");
@@ -27,9 +144,8 @@ void stack_push(Obj *o) {
   if(LOG_STACK) {
     printf("Pushing %s\n", obj_to_string(o)->s);
   }
-  if(stack_pos >= STACK_SIZE) {
-    printf("Stack overflow.");
-    exit(1);
+  if(stack_pos == stack_size) {
+    stack = stack_grow(stack, &stack_size, "Stack");
   }
   stack[stack_pos++] = o;
   if(LOG_STACK) {
@@ -61,9 +177,8 @@ void shadow_stack_push(Obj *o) {
     obj_print_cout(o);
     printf("\n");
   }
-  if(shadow_stack_pos >= STACK_SIZE) {
-    printf("Shadow stack overflow.");
-    exit(1);
+  if(shadow_stack_pos == shadow_stack_size) {
+    shadow_stack = stack_grow(shadow_stack, &shadow_stack_size, "Shadow stack");
   }
   shadow_stack[shadow_stack_pos++] = o;
 }
@@ -94,13 +209,37 @@ void shadow_stack_print() {
 
 void function_trace_print() {
   printf("     -----------------\n");
-  for(int i = function_trace_pos - 1; i >= 0; i--) {
-    printf("%3d  %s\n", i, function_trace[i]);
+  if(!function_trace_enabled) {
+    printf("     (the function trace is off, see 'set-function-trace!')\n");
+  }
+  int last = function_trace_pos > FUNCTION_TRACE_PRINT_MAX ? function_trace_pos - FUNCTION_TRACE_PRINT_MAX : 0;
+  for(int i = function_trace_pos - 1; i >= last; i--) {
+    printf("%3d  %.*s\n", i, STACK_TRACE_LEN, obj_to_string(function_trace[i])->s);
+  }
+  if(last > 0) {
+    printf("     ... %d more\n", last);
   }
   printf("     -----------------\n");
 }
 
-bool obj_match(Obj *env, Obj *attempt, Obj *value);
+void function_trace_push(Obj *form) {
+  if(!function_trace_enabled) {
+    return;
+  }
+  if(LOG_FUNC_APPLICATION) {
+    printf("evaluating form %s\n", obj_to_string(form)->s);
+  }
+  if(function_trace_pos == function_trace_size) {
+    function_trace = stack_grow(function_trace, &function_trace_size, "Function trace");
+  }
+  function_trace[function_trace_pos++] = form;
+}
+
+void lookup_error(Obj *o) {
+  char buffer[256];
+  snprintf(buffer, 256, "Can't find '%s' in environment.", obj_to_string(o)->s);
+  error = obj_new_string(buffer);
+}
 
 bool obj_match_lists(Obj *env, Obj *attempt, Obj *value) {
   //printf("Matching list %s with %s\n", obj_to_string(attempt)->s, obj_to_string(value)->s);
@@ -132,18 +271,18 @@ bool obj_match_lists(Obj *env, Obj *attempt, Obj *value) {
 
 bool obj_match(Obj *env, Obj *attempt, Obj *value) {
 
-  if(attempt->tag == 'C' && obj_eq(attempt->car, lisp_quote) && attempt->cdr && attempt->cdr->car) {
+  if(obj_tag(attempt) == 'C' && obj_eq(attempt->car, lisp_quote) && attempt->cdr && attempt->cdr->car) {
     // Dubious HACK to enable matching on quoted things...
     // Don't want to extend environment in this case!
     Obj *quoted_attempt = attempt->cdr->car;
     return obj_eq(quoted_attempt, value);
   }
-  else if(attempt->tag == 'Y') {
+  else if(obj_tag(attempt) == 'Y') {
     //printf("Binding %s to value %s in match.\n", obj_to_string(attempt)->s, obj_to_string(value)->s);
     env_extend(env, attempt, value);
     return true;
   }
-  else if(attempt->tag == 'C' && value->tag == 'C') {
+  else if(obj_tag(attempt) == 'C' && obj_tag(value) == 'C') {
     return obj_match_lists(env, attempt, value);
   }
   else if(obj_eq(attempt, value)) {
@@ -152,14 +291,21 @@ bool obj_match(Obj *env, Obj *attempt, Obj *value) {
   else {
     /* printf("attempt %s (%c) is NOT equal to value %s (%c)\n", */
     /* 	   obj_to_string(attempt)->s, */
-    /* 	   attempt->tag, */
+    /* 	   obj_tag(attempt), */
     /* 	   obj_to_string(value)->s, */
-    /* 	   value->tag); */
+    /* 	   obj_tag(value)); */
     return false;
   }
 }
 
-void match(Obj *env, Obj *value, Obj *attempts) {
+// A form in tail position, eval_list leaves it to the loop in eval_internal instead of evaluating it
+typedef struct {
+  Obj *env;
+  Obj *form;
+  int trace_base; // the function trace pos when the loop started, tail calls replace the entries above it
+} Tail;
+
+void match(Obj *env, Obj *value, Obj *attempts, Tail *tail) {
   Obj *p = attempts;
   while(p && p->car) {
     //printf("\nWill match %s with value %s\n", obj_to_string(p->car)->s, obj_to_string(value)->s);
@@ -169,8 +315,9 @@ void match(Obj *env, Obj *value, Obj *attempts) {
 
     if(result) {
       //printf("Match found, evaling %s in env\n", obj_to_string(p->cdr->car)->s); //, obj_to_string(new_env)->s);
-      eval_internal(new_env, p->cdr->car); // eval the following form using the new environment
       shadow_stack_pop(); // new_env
+      tail->env = new_env; // eval the following form using the new environment
+      tail->form = p->cdr->car;
       return;
     }
     
@@ -187,144 +334,247 @@ void match(Obj *env, Obj *value, Obj *attempts) {
   set_error("Failed to find a suitable match for: ", value);
 }
 
+Obj *lambda_calling_env(Obj *function, Obj **args, int arg_count) {
+  Obj *calling_env;
+  if(function->frame_size >= 0) {
+    if(arg_count != function->frame_size) {
+      set_error_and_return(arg_count > function->frame_size ? "Too many arguments to function: " : "Too few arguments to function: ", function);
+    }
+    if(function->free_frame) {
+      calling_env = function->free_frame;
+      function->free_frame = NULL;
+      for(int i = 0; i < arg_count; i++) {
+	calling_env->frame_slots[i] = args[i];
+	gc_write_barrier(calling_env, args[i]);
+      }
+    }
+    else {
+      calling_env = obj_new_frame(function->env, function->params, arg_count);
+      memcpy(calling_env->frame_slots, args, sizeof(Obj*) * arg_count);
+    }
+  }
+  else {
+    calling_env = obj_new_environment(function->env);
+    env_extend_with_args(calling_env, function, arg_count, args);
+  }
+  //printf("Lambda env: %s\n", obj_to_string(calling_env)->s);
+  return calling_env;
+}
+
+void lambda_release_frame(Obj *function, Obj *frame) {
+  if(function->free_frame) {
+    return;
+  }
+  memset(frame->frame_slots, 0, sizeof(Obj*) * frame->frame_count); // the old args can be collected
+  function->free_frame = frame;
+  gc_write_barrier(function, frame);
+}
+
+Obj *lambda_bytecode(Obj *function) {
+  if(!function->bytecode) {
+    function->bytecode = bytecode_compile(function->body);
+    gc_write_barrier(function, function->bytecode);
+  }
+  return function->bytecode;
+}
+
 void apply(Obj *function, Obj **args, int arg_count) {
-  if(function->tag == 'L') {
+  if(obj_tag(function) == 'L') {
 
     //printf("Calling function "); obj_print_cout(function); printf(" with params: "); obj_print_cout(function->params); printf("\n");
     
-    Obj *calling_env = obj_new_environment(function->env);
-    env_extend_with_args(calling_env, function, arg_count, args);
-    //printf("Lambda env: %s\n", obj_to_string(calling_env)->s);
+    Obj *calling_env = lambda_calling_env(function, args, arg_count);
+    if(error) { return; }
 
     shadow_stack_push(function);
     shadow_stack_push(calling_env);
-    eval_internal(calling_env, function->body);
+    if(bytecode_enabled) {
+      bytecode_call(function, calling_env);
+    }
+    else {
+      eval_internal(calling_env, function->body);
+    }
     shadow_stack_pop();
     shadow_stack_pop();
   }
-  else if(function->tag == 'P') {   
+  else if(obj_tag(function) == 'P') {   
     Obj *result = function->primop(args, arg_count);
     stack_push(result);
   }
-  else if(function->tag == 'F') {
-    assert(function);
-
+  else if(obj_tag(function) == 'F') {
     if(!function->funptr) {
       error = obj_new_string("Can't call foregin function, it's funptr is NULL. May be a stub function with just a signature?");
       return;
     }
-    
-    assert(function->cif);
-    assert(function->arg_types);
-    assert(function->return_type);
-     
-    void *values[arg_count];
-
-    Obj *p = function->arg_types;
-    for(int i = 0; i < arg_count; i++) {      
-      if(p && p->cdr) {
-	assert(p->car);
-	Obj *type_obj = p->car;
-
-	// Handle ref types by unwrapping them: (:ref x) -> x
-	if(type_obj->tag == 'C' && type_obj->car && type_obj->cdr && type_obj->cdr->car && obj_eq(type_obj->car, type_ref)) {
-	  type_obj = type_obj->cdr->car; // the second element of the list
-	}
-	
-	args[i]->given_to_ffi = true; // This makes the GC ignore this value when deleting internal C-data, like inside a string
-	
-	if(obj_eq(type_obj, type_int)) {
-	  assert_or_set_error(args[i]->tag == 'I', "Invalid type of arg: ", args[i]);
-	  values[i] = &args[i]->i;
+
+    // The conversions were worked out when the function was registered (see FfiPlan)
+    FfiPlan *plan = function->plan;
+    if(arg_count != plan->arg_count) {
+      set_error(arg_count > plan->arg_count ? "Too many arguments to " : "Too few arguments to ", function);
+    }
+
+    FfiValue unboxed[arg_count + 1]; // + 1 so nullary functions don't get zero length arrays
+    uint64_t scratch[plan->scratch_size / 8 + 1]; // struct args and result
+    char *scratch_next = (char*)scratch;
+    bool has_arrays = false;
+
+    for(int i = 0; i < arg_count; i++) {
+      Obj *arg = args[i];
+      switch(plan->arg_kinds[i]) {
+      case FFI_KIND_INT:
+	assert_or_set_error(obj_tag(arg) == 'I', "Invalid type of arg: ", arg);
+	unboxed[i].i = obj_int(arg);
+	break;
+      case FFI_KIND_FLOAT:
+	assert_or_set_error(obj_tag(arg) == 'V', "Invalid type of arg: ", arg);
+	unboxed[i].f = obj_float(arg);
+	break;
+      case FFI_KIND_STRING:
+	assert_or_set_error(obj_tag(arg) == 'S', "Invalid type of arg: ", arg);
+	arg->given_to_ffi = true; // This makes the GC ignore this value when deleting internal C-data, the C code might keep the string
+	unboxed[i].p = arg->s;
+	break;
+      case FFI_KIND_DOUBLE: case FFI_KIND_INT64: case FFI_KIND_CHAR:
+	if(!ffi_value_write(plan->arg_kinds[i], NULL, arg, &unboxed[i])) {
+	  stack_push(nil);
+	  return;
 	}
-	else if(obj_eq(type_obj, type_float)) {
-	  assert_or_set_error(args[i]->tag == 'V', "Invalid type of arg: ", args[i]);
-	  values[i] = &args[i]->f32;
+	break;
+      case FFI_KIND_STRUCT:
+	unboxed[i].p = scratch_next;
+	scratch_next += (plan->arg_structs[i]->type.size + 15) / 16 * 16;
+	if(!ffi_value_write(FFI_KIND_STRUCT, plan->arg_structs[i], arg, unboxed[i].p)) {
+	  stack_push(nil);
+	  return;
 	}
-	else if(obj_eq(type_obj, type_string)) {
-	  assert_or_set_error(args[i]->tag == 'S', "Invalid type of arg: ", args[i]);
-	  values[i] = &args[i]->s;
+	break;
+      case FFI_KIND_PTR: case FFI_KIND_INT_PTR: case FFI_KIND_FLOAT_PTR:
+      case FFI_KIND_DOUBLE_PTR: case FFI_KIND_INT64_PTR: case FFI_KIND_STRUCT_PTR:
+	if(obj_tag(arg) == 'N') {
+	  // Numeric vectors are passed as a pointer to their items, without copying.
+	  // They are only lent for the call, C code that keeps the pointer needs the vector to be kept alive in Lisp.
+	  assert_or_set_error(plan->arg_kinds[i] == FFI_KIND_PTR ||
+			      (plan->arg_kinds[i] == FFI_KIND_INT_PTR && arg->number_tag == 'I') ||
+			      (plan->arg_kinds[i] == FFI_KIND_FLOAT_PTR && arg->number_tag == 'V'),
+			      "Invalid type of vector for pointer arg: ", arg);
+	  unboxed[i].p = arg->numbers;
 	}
-	else if(type_obj->tag == 'C' && obj_eq(type_obj->car, obj_new_keyword("ptr"))) { // TODO: replace with a shared keyword to avoid allocs
-	  assert_or_set_error(args[i]->tag == 'Q', "Invalid type of arg: ", args[i]);
-	  values[i] = &args[i]->void_ptr;
+	else if(obj_tag(arg) == 'A') {
+	  // Copied to C memory below, when all the other args are known to be fine
+	  assert_or_set_error(ffi_pointee_kind(plan->arg_kinds[i]) >= 0, "Can't give an array for a pointer to unknown type: ", arg);
+	  has_arrays = true;
 	}
 	else {
-	  set_error("Can't call foreign function with argument of type ", p->car);
+	  assert_or_set_error(obj_tag(arg) == 'Q', "Invalid type of arg: ", arg);
+	  unboxed[i].p = arg->void_ptr;
 	}
-	p = p->cdr;
+	break;
+      default: {
+	Obj *type_obj = function->arg_types;
+	for(int j = 0; j < i; j++) {
+	  type_obj = type_obj->cdr;
+	}
+	set_error("Can't call foreign function with argument of type ", type_obj->car);
+      }
       }
-      else {
-	set_error("Too many arguments to ", function);
-      }	
     }
 
-    if(p && p->car) {
-      set_error("Too few arguments to ", function);
+    // Arrays given for pointers are copied to C memory and read back after the call, see ffi_values.h
+    void *arrays[arg_count + 1];
+    for(int i = 0; has_arrays && i < arg_count; i++) {
+      arrays[i] = NULL;
+      if(obj_tag(args[i]) == 'A') {
+	FfiStruct *s = plan->arg_structs ? plan->arg_structs[i] : NULL;
+	arrays[i] = ffi_array_write(ffi_pointee_kind(plan->arg_kinds[i]), s, args[i]);
+	if(!arrays[i]) {
+	  for(int j = 0; j < i; j++) {
+	    free(arrays[j]);
+	  }
+	  stack_push(nil);
+	  return;
+	}
+	unboxed[i].p = arrays[i];
+      }
     }
 
-    Obj *obj_result = NULL;
-    
-    if(obj_eq(function->return_type, type_string)) {
-      //printf("Returning string.\n");
-      char *c = NULL;
-      ffi_call(function->cif, function->funptr, &c, values);
-
-      if(c == NULL) {
-	//printf("c is null");
-	obj_result = obj_new_string("");
+    FfiValue result;
+    void *struct_result = scratch_next;
+    if(plan->direct && ffi_direct_enabled) {
+      plan->direct(function->funptr, unboxed, &result);
+    }
+    else {
+      void *values[arg_count + 1];
+      for(int i = 0; i < arg_count; i++) {
+	values[i] = plan->arg_kinds[i] == FFI_KIND_STRUCT ? unboxed[i].p : &unboxed[i];
       }
-      else {      
-	obj_result = obj_new_string(c);
+      // libffi widens small integer results to a full ffi_arg
+      bool widened = plan->return_kind == FFI_KIND_INT || plan->return_kind == FFI_KIND_BOOL ||
+	plan->return_kind == FFI_KIND_VOID || plan->return_kind == FFI_KIND_CHAR;
+      ffi_arg word;
+      ffi_call(&plan->cif, function->funptr,
+	       widened ? (void*)&word : plan->return_kind == FFI_KIND_STRUCT ? struct_result : (void*)&result,
+	       values);
+      if(widened) {
+	result.i = (int)word;
       }
     }
-    else if(obj_eq(function->return_type, type_int)) { 
-      //printf("Returning int.\n");
-      int result;
-      ffi_call(function->cif, function->funptr, &result, values);
-      obj_result = obj_new_int(result);
-    }
-    else if(obj_eq(function->return_type, type_bool)) { 
-      //printf("Returning bool.\n");
-      int result;
-      ffi_call(function->cif, function->funptr, &result, values);
-      obj_result = result ? lisp_true : lisp_false;
-    }
-    else if(obj_eq(function->return_type, type_float)) { 
-      //printf("Returning float.\n");
-      float result;
-      ffi_call(function->cif, function->funptr, &result, values);
-      obj_result = obj_new_float(result);
-    }
-    else if(obj_eq(function->return_type, type_void)) { 
-      //printf("Returning void.\n");
-      int result;
-      ffi_call(function->cif, function->funptr, &result, values);
-      obj_result = nil;
-    }
-    else if(function->return_type->tag == 'C' && obj_eq(function->return_type->car, type_ptr)) {
-      void *result;
-      ffi_call(function->cif, function->funptr, &result, values);
-      //printf("Creating new void* with value: %p\n", result);
-      obj_result = obj_new_ptr(result);
+
+    if(has_arrays) {
+      for(int i = 0; i < arg_count; i++) {
+	if(arrays[i]) {
+	  FfiStruct *s = plan->arg_structs ? plan->arg_structs[i] : NULL;
+	  ffi_array_read(ffi_pointee_kind(plan->arg_kinds[i]), s, args[i], arrays[i]);
+	  free(arrays[i]);
+	}
+      }
     }
-    else {
-      set_error("Returning what? ", function->return_type);
+
+    Obj *obj_result;
+    switch(plan->return_kind) {
+    case FFI_KIND_STRING:
+      obj_result = obj_new_string(result.p ? result.p : "");
+      break;
+    case FFI_KIND_INT:
+      obj_result = obj_new_int(result.i);
+      break;
+    case FFI_KIND_BOOL:
+      obj_result = result.i ? lisp_true : lisp_false;
+      break;
+    case FFI_KIND_FLOAT:
+      obj_result = obj_new_float(result.f);
+      break;
+    case FFI_KIND_DOUBLE:
+      obj_result = obj_new_double(result.d);
+      break;
+    case FFI_KIND_INT64:
+      obj_result = obj_new_int64(result.l);
+      break;
+    case FFI_KIND_CHAR:
+      obj_result = obj_new_int((char)result.i);
+      break;
+    case FFI_KIND_STRUCT:
+      obj_result = ffi_value_read(FFI_KIND_STRUCT, plan->return_struct, struct_result);
+      break;
+    case FFI_KIND_VOID:
+      obj_result = nil;
+      break;
+    default:
+      obj_result = obj_new_ptr(result.p);
+      break;
     }
 
-    assert(obj_result);
     stack_push(obj_result);
   }
-  else if(function->tag == 'K') {
+  else if(obj_tag(function) == 'K') {
     if(arg_count != 1) {
       error = obj_new_string("Args to keyword lookup must be a single arg.");
     }
-    else if(args[0]->tag != 'E') {
+    else if(obj_tag(args[0]) != 'E' && obj_tag(args[0]) != 'H') {
       error = obj_new_string("Arg 0 to keyword lookup must be a dictionary: ");
       obj_string_mut_append(error, obj_to_string(args[0])->s);
     }
     else {
-      Obj *value = env_lookup(args[0], function);
+      Obj *value = obj_tag(args[0]) == 'H' ? dict_get(args[0], function) : env_lookup(args[0], function);
       if(value) {
 	stack_push(value);
       } else {
@@ -342,35 +592,156 @@ void apply(Obj *function, Obj **args, int arg_count) {
   }
 }
 
-#define HEAD_EQ(str) (o->car->tag == 'Y' && strcmp(o->car->s, (str)) == 0)
+// Runs the body of the macro with the args of 'form', returns the expansion
+Obj *macro_expand(Obj *macro, Obj *form) {
+  shadow_stack_push(macro);
+  int count = 0;
+  for(Obj *p = form->cdr; p && p->car; p = p->cdr) {
+    count++;
+  }
+  Obj *args[count + 1]; // never zero length
+  Obj *p = form->cdr;
+  for(int i = 0; i < count; i++) {
+    args[i] = lexical_unresolve(p->car); // with plain symbols for the macro
+    shadow_stack_push(args[i]);
+    p = p->cdr;
+  }
+
+  Obj *calling_env = obj_new_environment(macro->env);
+  env_extend_with_args(calling_env, macro, count, args);
+  shadow_stack_push(calling_env);
+  eval_internal(calling_env, macro->body);
+  if(error) { return NULL; }
+  Obj *expanded = stack_pop();
+  expansion_stats.expansions++;
+  if(SHOW_MACRO_EXPANSION) {
+    printf("Expanded macro: %s\n", obj_to_string(expanded)->s);
+  }
+  shadow_stack_pop(); // calling_env
+  for(int i = 0; i < count; i++) {
+    shadow_stack_pop();
+  }
+  shadow_stack_pop(); // macro
+  return expanded;
+}
+
+Obj *macro_expansion(Obj *macro, Obj *form, Obj **code) {
+  *code = NULL;
+  Obj *expanded = macro->uncached ? NULL : expansion_get(form, macro, code);
+  if(!expanded) {
+    expanded = macro_expand(macro, form);
+    if(error) { return NULL; }
+    if(!macro->uncached) {
+      expansion_put(form, macro, expanded, NULL);
+    }
+    return expanded;
+  }
+  expansion_stats.cache_hits++;
+  if(!bytecode_enabled) {
+    *code = NULL;
+  }
+  else if(!*code) {
+    // Compiled on the second use, so the expansions of forms that are evaluated once aren't
+    *code = bytecode_compile(expanded);
+    expansion_put(form, macro, expanded, *code);
+  }
+  return expanded;
+}
+
+void apply_macro(Obj *env, Obj *macro, Obj *form) {
+  Obj *code;
+  Obj *expanded = macro_expansion(macro, form, &code);
+  if(error) { return; }
+  if(code) {
+    shadow_stack_push(code);
+    bytecode_run(code, env);
+  }
+  else {
+    shadow_stack_push(expanded);
+    eval_internal(env, expanded);
+  }
+  if(error) { return; }
+  shadow_stack_pop(); // code or expanded
+}
+
+void register_special_form(char *name, int id) {
+  Obj *symbol = obj_new_symbol(name);
+  symbol->dispatch = id;
+  special_form_symbols[id] = symbol;
+}
+
+void register_special_forms() {
+  special_form_symbols[SPECIAL_FORM_NONE] = NULL;
+  register_special_form("do", SPECIAL_FORM_DO);
+  register_special_form("let", SPECIAL_FORM_LET);
+  register_special_form("not", SPECIAL_FORM_NOT);
+  register_special_form("quote", SPECIAL_FORM_QUOTE);
+  register_special_form("while", SPECIAL_FORM_WHILE);
+  register_special_form("if", SPECIAL_FORM_IF);
+  register_special_form("match", SPECIAL_FORM_MATCH);
+  register_special_form("reset!", SPECIAL_FORM_RESET);
+  register_special_form("fn", SPECIAL_FORM_FN);
+  register_special_form("macro", SPECIAL_FORM_MACRO);
+  register_special_form("def", SPECIAL_FORM_DEF);
+  register_special_form("def?", SPECIAL_FORM_DEF_QMARK);
+  register_special_form("ref", SPECIAL_FORM_REF);
+  // Prints as 'fn' but is a different symbol, so that only the resolver can make forms with it
+  lexical_fn_symbol = obj_new_uninterned_symbol("fn");
+  lexical_fn_symbol->dispatch = SPECIAL_FORM_RESOLVED_FN;
+  special_form_symbols[SPECIAL_FORM_RESOLVED_FN] = lexical_fn_symbol;
+}
 
-void eval_list(Obj *env, Obj *o) {
+// Pushes the value of 'o', or sets 'tail' to the env and form in tail position that are left to evaluate
+void eval_list(Obj *env, Obj *o, Tail *tail) {
   assert(o);
   //printf("Evaling list %s\n", obj_to_string(o)->s);
   if(!o->car) {
     stack_push(o); // nil, empty list
+    return;
   }
-  else if(HEAD_EQ("do")) {
+
+  // Special forms are recognized by the id stored on their (interned) symbol
+  int special_form = obj_tag(o->car) == 'Y' ? o->car->dispatch : SPECIAL_FORM_NONE;
+  
+  switch(special_form) {
+  case SPECIAL_FORM_DO: {
     Obj *p = o->cdr;
     while(p && p->car) {
+      if(!p->cdr || !p->cdr->car) {
+	tail->env = env;
+	tail->form = p->car;
+	return;
+      }
       eval_internal(env, p->car);
       if(error) { return; }
+      stack_pop(); // remove result from form that is not last
       p = p->cdr;
-      if(p && p->car) {
-	stack_pop(); // remove result from form that is not last
-      }
     }
+    return;
   }
-  else if(HEAD_EQ("let")) {
+  case SPECIAL_FORM_LET: {
     Obj *let_env = obj_new_environment(env);
     shadow_stack_push(let_env);
     Obj *p = o->cdr->car;
     assert_or_set_error(o->cdr->car, "No bindings in 'let' form.", o);
+    if(obj_tag(p) == 'A') {
+      // (let [a 1 b 2] ...)
+      if(p->count % 2 != 0) {
+	set_error("Uneven nr of forms in let: ", o);
+      }
+      for(int i = 0; i < p->count; i += 2) {
+	assert_or_set_error(obj_tag(p->items[i]) == 'Y', "Must bind to symbol in let form: ", p->items[i]);
+	eval_internal(let_env, p->items[i + 1]);
+	if(error) { return; }
+	env_extend(let_env, p->items[i], stack_pop());
+      }
+      p = NULL;
+    }
     while(p && p->car) {
       if(!p->cdr) {
 	set_error("Uneven nr of forms in let: ", o);
       }
-      assert_or_set_error(p->car->tag == 'Y', "Must bind to symbol in let form: ", p->car);
+      assert_or_set_error(obj_tag(p->car) == 'Y', "Must bind to symbol in let form: ", p->car);
       eval_internal(let_env, p->cdr->car);
       if(error) { return; }
       env_extend(let_env, p->car, stack_pop());
@@ -378,10 +749,12 @@ void eval_list(Obj *env, Obj *o) {
     }
     assert_or_set_error(o->cdr->cdr->car, "No body in 'let' form.", o);
     assert_or_set_error(o->cdr->cdr->cdr->car == NULL, "Too many body forms in 'let' form (use explicit 'do').", o);
-    eval_internal(let_env, o->cdr->cdr->car);
     shadow_stack_pop(); // let_env
+    tail->env = let_env;
+    tail->form = o->cdr->cdr->car;
+    return;
   }
-  else if(HEAD_EQ("not")) {
+  case SPECIAL_FORM_NOT: {
     Obj *p = o->cdr;
     while(p) {
       if(p->car) {
@@ -395,15 +768,17 @@ void eval_list(Obj *env, Obj *o) {
       p = p->cdr;
     }
     stack_push(lisp_true);
+    return;
   }
-  else if(HEAD_EQ("quote")) {
+  case SPECIAL_FORM_QUOTE: {
     if(o->cdr == nil) {
       stack_push(nil);
     } else {
       stack_push(o->cdr->car);
     }
+    return;
   }
-  else if(HEAD_EQ("while")) {
+  case SPECIAL_FORM_WHILE: {
     eval_internal(env, o->cdr->car);
     if(error) {
       return;
@@ -417,8 +792,9 @@ void eval_list(Obj *env, Obj *o) {
       }
     }
     stack_push(nil);
+    return;
   }
-  else if(HEAD_EQ("if")) {
+  case SPECIAL_FORM_IF: {
     assert_or_set_error(o->cdr->car, "Too few body forms in 'if' form: ", o);
     assert_or_set_error(o->cdr->cdr->car, "Too few body forms in 'if' form: ", o);
     assert_or_set_error(o->cdr->cdr->cdr->car, "Too few body forms in 'if' form: ", o);
@@ -427,34 +803,36 @@ void eval_list(Obj *env, Obj *o) {
     if(error) {
       return;
     }
-    else if(is_true(stack_pop())) {
-      eval_internal(env, o->cdr->cdr->car);
-    }
-    else {
-      eval_internal(env, o->cdr->cdr->cdr->car);
-    }
+    tail->env = env;
+    tail->form = is_true(stack_pop()) ? o->cdr->cdr->car : o->cdr->cdr->cdr->car;
+    return;
   }
-  else if(HEAD_EQ("match")) {
+  case SPECIAL_FORM_MATCH: {
     eval_internal(env, o->cdr->car);
     if(error) { return; }
     Obj *value = stack_pop();
     Obj *p = o->cdr->cdr;   
-    match(env, value, p);
+    match(env, value, p, tail);
+    return;
   }
-  else if(HEAD_EQ("reset!")) {
-    assert_or_set_error(o->cdr->car->tag == 'Y', "Must use 'reset!' on a symbol.", o->cdr->car);
-    Obj *pair = env_lookup_binding(env, o->cdr->car);
-    if(!pair->car || pair->car->tag != 'Y') {
-      printf("Can't reset! binding '%s', it's '%s'\n", o->cdr->car->s, obj_to_string(pair)->s);
+  case SPECIAL_FORM_RESET: {
+    Obj *target = o->cdr->car;
+    assert_or_set_error(obj_tag(target) == 'Y' || obj_tag(target) == 'X', "Must use 'reset!' on a symbol.", target);
+    Obj *owner = NULL;
+    Obj **place = obj_tag(target) == 'X' ? lexical_place(env, target, &owner) : env_lookup_place(env, target, &owner);
+    if(!place) {
+      printf("Can't reset! binding '%s', it's not defined\n", target->s);
       stack_push(nil);
       return;
     }
     eval_internal(env, o->cdr->cdr->car);
     if(error) { return; }
-    pair->cdr = stack_pop();
-    stack_push(pair->cdr);
+    *place = stack_pop();
+    gc_write_barrier(owner, *place);
+    stack_push(*place);
+    return;
   }
-  else if(HEAD_EQ("fn")) {
+  case SPECIAL_FORM_FN: {
     assert_or_set_error(o->cdr, "Lambda form too short (no parameter list or body).", o);
     assert_or_set_error(o->cdr->car, "No parameter list in lambda.", o);
     Obj *params = o->cdr->car;
@@ -462,10 +840,25 @@ void eval_list(Obj *env, Obj *o) {
     assert_or_set_error(o->cdr->cdr->car, "No body in lambda: ", o);
     Obj *body = o->cdr->cdr->car;
     //printf("Creating lambda with env: %s\n", obj_to_string(env)->s);
-    Obj *lambda = obj_new_lambda(params, body, env, o);
+    Obj *lambda;
+    if(env == global_env) {
+      // Resolved once here, lambdas made by nested 'fn' forms reuse that (see below)
+      lambda = obj_new_lambda(params, lexical_resolve(params, body), env, o);
+      lambda->frame_size = lexical_frame_size(params);
+    }
+    else {
+      lambda = obj_new_lambda(params, body, env, o);
+    }
+    stack_push(lambda);
+    return;
+  }
+  case SPECIAL_FORM_RESOLVED_FN: {
+    Obj *lambda = obj_new_lambda(o->cdr->car, o->cdr->cdr->car, env, o);
+    lambda->frame_size = lexical_frame_size(o->cdr->car);
     stack_push(lambda);
+    return;
   }
-  else if(HEAD_EQ("macro")) {
+  case SPECIAL_FORM_MACRO: {
     assert_or_set_error(o->cdr, "Macro form too short (no parameter list or body): ", o);
     assert_or_set_error(o->cdr->car, "No parameter list in macro: ", o);
     Obj *params = o->cdr->car;
@@ -474,11 +867,12 @@ void eval_list(Obj *env, Obj *o) {
     Obj *body = o->cdr->cdr->car;
     Obj *macro = obj_new_macro(params, body, env, o);
     stack_push(macro);
+    return;
   }
-  else if(HEAD_EQ("def")) {
+  case SPECIAL_FORM_DEF: {
     assert_or_set_error(o->cdr, "Too few args to 'def': ", o);
     assert_or_set_error(o->cdr->car, "Can't assign to nil: ", o);
-    assert_or_set_error(o->cdr->car->tag == 'Y', "Can't assign to non-symbol: ", o);
+    assert_or_set_error(obj_tag(o->cdr->car) == 'Y', "Can't assign to non-symbol: ", o);
     Obj *key = o->cdr->car;
     eval_internal(env, o->cdr->cdr->car); // eval the second arg to 'def', the value to assign
     if(error) { return; } // don't define it if there was an error
@@ -486,147 +880,204 @@ void eval_list(Obj *env, Obj *o) {
     global_env_extend(key, val);
     //printf("def %s to %s\n", obj_to_string(key)->s, obj_to_string(val)->s);
     stack_push(val);
+    return;
   }
-  else if(HEAD_EQ("def?")) {
+  case SPECIAL_FORM_DEF_QMARK: {
     Obj *key = o->cdr->car;
-    if(obj_eq(nil, env_lookup_binding(env, key))) {
+    Obj *owner = NULL;
+    if(!env_lookup_place(env, key, &owner)) {
       stack_push(lisp_false);
     } else {
       stack_push(lisp_true);
     }
+    return;
   }
-  else if(HEAD_EQ("ref")) {
+  case SPECIAL_FORM_REF: {
     assert_or_set_error(o->cdr, "Too few args to 'ref': ", o);
-    eval_internal(env, o->cdr->car);
+    tail->env = env;
+    tail->form = o->cdr->car;
+    return;
+  }
+  default:
+    break;
   }
-  else {
-    shadow_stack_push(o);
-    
-    // Lambda, primop or macro   
-    eval_internal(env, o->car);
-    if(error) { return; }
-    
-    Obj *function = stack_pop();
-    assert_or_set_error(function, "Can't call NULL.", o);
-    shadow_stack_push(function);
-    
-    bool eval_args = function->tag != 'M'; // macros don't eval their args
-    Obj *p = o->cdr;
-    int count = 0;
-    
-    while(p && p->car) {
-      if(error) {
-	shadow_stack_pop();
-	return;
-      }
-      
-      if(eval_args) {
-	eval_internal(env, p->car);
-      }
-      else {
-	stack_push(p->car); // push non-evaled
-      }
-      count++;
-      p = p->cdr;
-    }
-
-    if(error) {
-      shadow_stack_pop();
-      return;
-    }
 
-    //printf("Popping args!\n");
-    Obj *args[count];
-    for(int i = 0; i < count; i++) {
-      Obj *arg = stack_pop();
-      args[count - i - 1] = arg;
-      shadow_stack_push(arg);
-    }
+  shadow_stack_push(o);
+  
+  // Lambda, primop or macro   
+  eval_internal(env, o->car);
+  if(error) { return; }
+  
+  // The function and then the args are kept on the stack, the args are given to 'apply' in place
+  int base = stack_pos - 1;
+  Obj *function = stack[base];
+  assert_or_set_error(function, "Can't call NULL.", o);
 
-    if(function->tag == 'M') {
-      Obj *calling_env = obj_new_environment(function->env);
-      env_extend_with_args(calling_env, function, count, args);
-      shadow_stack_push(calling_env);
-      eval_internal(calling_env, function->body);
+  if(obj_tag(function) == 'M') {
+    stack_pos--;
+    Obj *code;
+    Obj *expanded = macro_expansion(function, o, &code);
+    if(error) { return; }
+    shadow_stack_pop(); // o
+    if(code) {
+      // The VM does the tail calls in the code itself
+      shadow_stack_push(code);
+      bytecode_run(code, env);
       if(error) { return; }
-      Obj *expanded = stack_pop();
-      if(SHOW_MACRO_EXPANSION) {
-	printf("Expanded macro: %s\n", obj_to_string(expanded)->s);
-      }
-      shadow_stack_push(expanded);
-      eval_internal(env, expanded);
-      shadow_stack_pop(); // expanded
-      shadow_stack_pop(); // calling_env
+      shadow_stack_pop(); // code
     }
     else {
-      if(function_trace_pos > STACK_SIZE - 1) {
-	printf("Out of function trace stack.\n");
-	stack_print();
-	function_trace_print();
-	exit(1);
-      }
+      tail->env = env;
+      tail->form = expanded;
+    }
+    return;
+  }
 
-      if(LOG_FUNC_APPLICATION) {
-	printf("evaluating form %s\n", obj_to_string(o)->s);
-      }
-      
-      snprintf(function_trace[function_trace_pos], STACK_TRACE_LEN, "%s", obj_to_string(o)->s);
-      function_trace_pos++;
+  Obj *p = o->cdr;
+  int count = 0;
+  
+  while(p && p->car) {
+    eval_internal(env, p->car);
+    if(error) { return; }
+    count++;
+    p = p->cdr;
+  }
 
-      //printf("apply start: "); obj_print_cout(function); printf("\n");
-      apply(function, args, count);
-      //printf("apply end\n");
-      
-      if(!error) {
-	function_trace_pos--;
-      }
-    }
+  if(obj_tag(function) == 'L' && !bytecode_enabled) {
+    // A tail call, the body replaces this form in the loop of eval_internal
+    function_trace_pos = tail->trace_base;
+    function_trace_push(o);
+    if(error) { return; }
+    Obj *calling_env = lambda_calling_env(function, stack + base + 1, count);
+    if(error) { return; }
+    stack_pos = base;
+    tail->env = calling_env;
+    tail->form = function->body;
+  }
+  else {
+    int trace_pos = function_trace_pos; // not decremented, the trace can be turned on or off during the call
+    function_trace_push(o);
+    if(error) { return; }
 
-    if(!error) {
-      //printf("time to pop!\n");
-      for(int i = 0; i < count; i++) {
-	shadow_stack_pop();
-      }
-      shadow_stack_pop();
-      
-      Obj *oo = shadow_stack_pop(); // o
-      if(o != oo) {
-	printf("o != oo\n");
-	printf("o: %p ", o); obj_print_cout(o); printf("\n");
-	printf("oo: %p ", oo); obj_print_cout(oo); printf("\n");
-	assert(false);
-      }
-    }
+    //printf("apply start: "); obj_print_cout(function); printf("\n");
+    apply(function, stack + base + 1, count);
+    //printf("apply end\n");
+
+    if(error) { return; }
+    function_trace_pos = trace_pos;
+    stack[base] = stack[stack_pos - 1];
+    stack_pos = base + 1;
+  }
+    
+  Obj *oo = shadow_stack_pop(); // o
+  if(o != oo) {
+    printf("o != oo\n");
+    printf("o: %p ", o); obj_print_cout(o); printf("\n");
+    printf("oo: %p ", oo); obj_print_cout(oo); printf("\n");
+    assert(false);
   }
 }
 
-void eval_internal(Obj *env, Obj *o) {
-  if(error) { return; }
+typedef struct {
+  Obj *env;
+  Obj *dict;
+} DictLiteralEval;
 
-  //shadow_stack_print();
-  if(LOG_EVAL) {
-    printf("> "); obj_print_cout(o); printf("\n");
+void eval_dict_literal_entry(Obj *key, Obj *value, void *data) {
+  DictLiteralEval *literal = data;
+  eval_internal(literal->env, value);
+  dict_set(literal->dict, key, stack_pop());
+}
+
+// Everything the evaluator is working on must be reachable from the stacks here
+void gc_point() {
+  if(gc_phase != GC_PHASE_IDLE) {
+    if(obj_total > GC_HARD_LIMIT * obj_total_max) {
+      if(LOG_GC_POINTS) {
+        printf("Finishing the incremental GC in eval:\n");
+      }
+      gc(global_env);
+    }
+    else if(obj_allocs_total >= gc_next_slice) {
+      if(LOG_GC_POINTS) {
+        printf("Running incremental GC slice in eval:\n");
+      }
+      gc_step();
+    }
   }
-  if(obj_total > obj_total_max) {
+  else if(obj_total > obj_total_max) {
     //printf("obj_total = %d\n", obj_total);
     if(LOG_GC_POINTS) {
       printf("Running GC in eval:\n");
     }
-    gc(global_env);
-    obj_total_max += 1000;
-    //printf("new obj_total_max = %d\n", obj_total_max);
+    if(gc_pause_budget > 0) {
+      gc_step();
+    }
+    else {
+      gc(global_env); // sets the next 'obj_total_max'
+    }
+  }
+  else if(GC_GENERATIONAL && nursery_count >= GC_NURSERY_SIZE) {
+    if(LOG_GC_POINTS) {
+      printf("Running minor GC in eval:\n");
+    }
+    gc_minor();
   }
   else {
       //printf("%d/%d\n", obj_total, obj_total_max);
   }
+}
+
+// Forms in tail position are evaluated by the loop here instead of a recursive call, so tail calls
+// run in constant stack. The env and form of each round replace the ones of the last round on the shadow stack.
+void eval_internal(Obj *env, Obj *o) {
+  if(error || c_stack_exhausted()) { return; }
+  int shadow_base = shadow_stack_pos;
+  Tail tail = { NULL, NULL, function_trace_pos };
+
+ next:
+  //shadow_stack_print();
+  if(LOG_EVAL) {
+    printf("> "); obj_print_cout(o); printf("\n");
+  }
+  gc_point();
   
   if(!o) {
     stack_push(nil);
   }
-  else if(o->tag == 'C') {
-    eval_list(env, o);
+  else if(obj_tag(o) == 'C') {
+    tail.env = NULL;
+    eval_list(env, o, &tail);
+    if(tail.env && !error) {
+      env = tail.env;
+      o = tail.form;
+      shadow_stack_pos = shadow_base;
+      shadow_stack_push(env);
+      shadow_stack_push(o);
+      goto next;
+    }
   }
-  else if(o->tag == 'E') {
+  else if(obj_tag(o) == 'A') {
+    // Array literals are mutable, so every evaluation makes a new one
+    Obj *new_array = obj_new_array(o->count);
+    shadow_stack_push(new_array);
+    for(int i = 0; i < o->count; i++) {
+      eval_internal(env, o->items[i]);
+      obj_array_push(new_array, stack_pop());
+    }
+    stack_push(new_array);
+    shadow_stack_pop(); // new_array
+  }
+  else if(obj_tag(o) == 'H') {
+    // The keys are not evaluated, the literal itself is left as it is
+    Obj *new_dict = obj_new_dict(NULL, 0);
+    shadow_stack_push(new_dict);
+    DictLiteralEval literal = { env, new_dict };
+    dict_each(o, eval_dict_literal_entry, &literal);
+    stack_push(new_dict);
+    shadow_stack_pop(); // new_dict
+  }
+  else if(obj_tag(o) == 'E') {
     Obj *new_env = obj_copy(o);
     shadow_stack_push(new_env);
     Obj *p = new_env->bindings;
@@ -635,17 +1086,25 @@ void eval_internal(Obj *env, Obj *o) {
       eval_internal(env, pair->cdr);
       //printf("Evaling env-binding %s, setting cdr to %s.\n", obj_to_string(pair)->s, obj_to_string(stack[stack_pos - 1])->s);
       pair->cdr = stack_pop();
+      gc_write_barrier(pair, pair->cdr);
       p = p->cdr;
     }
     stack_push(new_env);
     shadow_stack_pop(); // new_env
   }
-  else if(o->tag == 'Y') {
+  else if(obj_tag(o) == 'X') {
+    Obj *result = lexical_lookup(env, o);
+    if(!result) {
+      lookup_error(o);
+      stack_push(nil);
+    } else {
+      stack_push(result);
+    }
+  }
+  else if(obj_tag(o) == 'Y') {
     Obj *result = env_lookup(env, o);
     if(!result) {
-      char buffer[256];
-      snprintf(buffer, 256, "Can't find '%s' in environment.", obj_to_string(o)->s);
-      error = obj_new_string(buffer);
+      lookup_error(o);
       stack_push(nil);
     } else {
       stack_push(result);
@@ -654,6 +1113,11 @@ void eval_internal(Obj *env, Obj *o) {
   else {
     stack_push(o);
   }
+
+  if(!error) {
+    shadow_stack_pos = shadow_base;
+    function_trace_pos = tail.trace_base;
+  }
 }
 
 Obj *eval(Obj *env, Obj *form) {
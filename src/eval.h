@@ -5,23 +5,91 @@
 
 #define LOG_GC_POINTS 0
 
-#define STACK_SIZE 512
-Obj *stack[STACK_SIZE];
+// The value stack, the shadow stack (GC roots of the evaluator) and the function trace grow
+// on demand up to 'stack_limit' entries each. Going over the limit is an error, like running out
+// of C stack is (its size is set with 'ulimit -s'). The limit can be set with the CARP_STACK_LIMIT
+// environment variable or 'set-stack-limit!', up to STACK_MAX_LIMIT.
+#define STACK_INITIAL_SIZE 512
+#define STACK_DEFAULT_LIMIT (1 << 20)
+#define STACK_MAX_LIMIT (1 << 24)
+
+int stack_limit;
+void stack_init();
+void stack_set_limit(int limit);
+
+// Sets 'error' when the C stack is almost used up
+bool c_stack_exhausted();
+
+// The stacks never move, pointers into them stay valid while they grow (until the entries are popped)
+Obj **stack;
 int stack_pos;
+int stack_size;
 
-Obj *shadow_stack[STACK_SIZE];
+Obj **shadow_stack;
 int shadow_stack_pos;
+int shadow_stack_size;
 
 void shadow_stack_push(Obj *o);
 Obj *shadow_stack_pop();
 
 void function_trace_print();
 
+enum SpecialForm {
+  SPECIAL_FORM_NONE = 0,
+  SPECIAL_FORM_DO,
+  SPECIAL_FORM_LET,
+  SPECIAL_FORM_NOT,
+  SPECIAL_FORM_QUOTE,
+  SPECIAL_FORM_WHILE,
+  SPECIAL_FORM_IF,
+  SPECIAL_FORM_MATCH,
+  SPECIAL_FORM_RESET,
+  SPECIAL_FORM_FN,
+  SPECIAL_FORM_MACRO,
+  SPECIAL_FORM_DEF,
+  SPECIAL_FORM_DEF_QMARK,
+  SPECIAL_FORM_REF,
+  SPECIAL_FORM_RESOLVED_FN, // see lexical.h
+  SPECIAL_FORM_COUNT
+};
+
+Obj *special_form_symbols[SPECIAL_FORM_COUNT];
+void register_special_forms();
+
 void stack_push(Obj *o);
 Obj *stack_pop();
 
+// 'args' can point into the value stack, see primops.h
 void apply(Obj *function, Obj **args, int arg_count);
 
+// The env or frame for a call of a lambda, sets 'error' when the nr of args is wrong
+Obj *lambda_calling_env(Obj *function, Obj **args, int arg_count);
+// Gives the frame of a finished call back to its lambda for the next call, only for frames
+// that nothing can refer to anymore (the VM knows when no closure or env was made in one)
+void lambda_release_frame(Obj *function, Obj *frame);
+Obj *lambda_bytecode(Obj *function); // compiles the body on the first call
+
+// The expansion of 'form', from the cache when it can be. 'code' is set to the bytecode
+// of the expansion when the VM should run it, otherwise to NULL.
+Obj *macro_expansion(Obj *macro, Obj *form, Obj **code);
+// Pushes the value of the expansion of 'form', expansions are cached per form (see expansion.h)
+void apply_macro(Obj *env, Obj *macro, Obj *form);
+
+bool obj_match(Obj *env, Obj *attempt, Obj *value);
+
+// The forms of the calls that are being evaluated, for the trace that is printed on errors.
+// They are only turned into text when the trace is printed. Off with the CARP_TRACE=0 environment
+// variable or (set-function-trace! false), the errors are then reported without a trace.
+bool function_trace_enabled;
+Obj **function_trace;
+int function_trace_pos;
+int function_trace_size;
+
+void function_trace_push(Obj *form); // sets 'error' when over the limit
+
+void lookup_error(Obj *o);
+void gc_point();
+
 Obj *eval(Obj *env, Obj *form);
 void eval_internal(Obj *env, Obj *o);
 void eval_text(Obj *env, char *text, bool print);
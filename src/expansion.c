@@ -0,0 +1,114 @@
+#include "expansion.h"
+
+typedef struct {
+  Obj *form; // NULL for empty slots, EXPANSION_TOMBSTONE for removed entries
+  Obj *macro;
+  Obj *expansion;
+  Obj *code;
+} Expansion;
+
+#define EXPANSION_TOMBSTONE ((Obj*)-1)
+
+Expansion *expansion_table = NULL;
+int expansion_table_size = 0;
+int expansion_table_used = 0; // includes tombstones
+int expansion_table_count = 0;
+
+unsigned int expansion_hash(Obj *form) {
+  return (unsigned int)(((uintptr_t)form >> 4) * 2654435761u);
+}
+
+Expansion *expansion_find(Obj *form) {
+  if(!expansion_table) {
+    return NULL;
+  }
+  unsigned int mask = expansion_table_size - 1;
+  unsigned int i = expansion_hash(form) & mask;
+  while(expansion_table[i].form) {
+    if(expansion_table[i].form == form) {
+      return &expansion_table[i];
+    }
+    i = (i + 1) & mask;
+  }
+  return NULL;
+}
+
+void expansion_table_grow() {
+  Expansion *old_table = expansion_table;
+  int old_size = expansion_table_size;
+  // Only grows when the live entries fill a quarter, otherwise the tombstones are just cleaned out
+  expansion_table_size = old_size == 0 ? 256 : expansion_table_count * 4 >= old_size ? old_size * 2 : old_size;
+  expansion_table = calloc(expansion_table_size, sizeof(Expansion));
+  expansion_table_used = expansion_table_count;
+  for(int i = 0; i < old_size; i++) {
+    Expansion *e = &old_table[i];
+    if(e->form && e->form != EXPANSION_TOMBSTONE) {
+      unsigned int j = expansion_hash(e->form) & (expansion_table_size - 1);
+      while(expansion_table[j].form) {
+        j = (j + 1) & (expansion_table_size - 1);
+      }
+      expansion_table[j] = *e;
+    }
+  }
+  free(old_table);
+}
+
+Obj *expansion_get(Obj *form, Obj *macro, Obj **code) {
+  if(!form->expanded) {
+    return NULL;
+  }
+  Expansion *e = expansion_find(form);
+  if(!e || e->macro != macro) {
+    return NULL;
+  }
+  *code = e->code;
+  return e->expansion;
+}
+
+void expansion_put(Obj *form, Obj *macro, Obj *expansion, Obj *code) {
+  Expansion *e = form->expanded ? expansion_find(form) : NULL;
+  if(!e) {
+    if(expansion_table_used * 2 >= expansion_table_size) {
+      expansion_table_grow();
+    }
+    unsigned int mask = expansion_table_size - 1;
+    unsigned int i = expansion_hash(form) & mask;
+    while(expansion_table[i].form && expansion_table[i].form != EXPANSION_TOMBSTONE) {
+      i = (i + 1) & mask;
+    }
+    e = &expansion_table[i];
+    if(!e->form) {
+      expansion_table_used++;
+    }
+    expansion_table_count++;
+    e->form = form;
+    form->expanded = true;
+  }
+  e->macro = macro;
+  e->expansion = expansion;
+  e->code = code;
+}
+
+void expansion_remove(Obj *form) {
+  Expansion *e = expansion_find(form);
+  assert(e);
+  e->form = EXPANSION_TOMBSTONE;
+  e->macro = e->expansion = e->code = NULL;
+  expansion_table_count--;
+  form->expanded = false;
+}
+
+int expansion_count() {
+  return expansion_table_count;
+}
+
+void expansion_push_roots(void (*push)(Obj *o)) {
+  for(int i = 0; i < expansion_table_size; i++) {
+    Expansion *e = &expansion_table[i];
+    if(e->form && e->form != EXPANSION_TOMBSTONE) {
+      push(e->macro);
+      push(e->expansion);
+      push(e->code);
+    }
+  }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "obj.h"
+
+// Macro expansions are cached per call site: the table is keyed on the identity of the form
+// that calls the macro (its cons cell) and remembers which macro made the expansion, so a
+// redefined macro (a new 'M' object) expands the form again. Expansions that are used more than
+// once are compiled to bytecode when the VM is on.
+// The keys are weak, the GC removes the entry of a form with expansion_remove() when the form is freed
+// (forms with an entry have their 'expanded' flag set). The macros, expansions and code are roots.
+// Macros that don't always give the same expansion for a form can opt out with (set-macro-cached! m false).
+
+typedef struct {
+  long expansions; // nr of times a macro body was run
+  long cache_hits;
+} ExpansionStats;
+
+ExpansionStats expansion_stats;
+
+// The cached expansion of 'form' by 'macro', or NULL. 'code' is set to its bytecode (NULL until it's compiled).
+Obj *expansion_get(Obj *form, Obj *macro, Obj **code);
+
+void expansion_put(Obj *form, Obj *macro, Obj *expansion, Obj *code);
+
+void expansion_remove(Obj *form);
+
+int expansion_count();
+
+void expansion_push_roots(void (*push)(Obj *o));
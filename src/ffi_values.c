@@ -0,0 +1,204 @@
+#include "ffi_values.h"
+#include "obj_string.h"
+#include "primops.h"
+#include "gc.h"
+
+FfiStruct **ffi_structs = NULL;
+int ffi_struct_count = 0;
+
+FfiStruct *ffi_struct_find(Obj *type_obj) {
+  if(obj_tag(type_obj) != 'K') {
+    return NULL;
+  }
+  for(int i = 0; i < ffi_struct_count; i++) {
+    if(strcmp(ffi_structs[i]->name, type_obj->s) == 0) {
+      return ffi_structs[i];
+    }
+  }
+  return NULL;
+}
+
+size_t align_up(size_t offset, size_t alignment) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+FfiStruct *ffi_struct_register(char *name, Obj *field_types) {
+  int field_count = 0;
+  for(Obj *p = field_types; p && p->car; p = p->cdr) {
+    field_count++;
+  }
+  if(field_count == 0) {
+    error = concat_c_strings("A struct needs at least one field: ", name);
+    return NULL;
+  }
+
+  FfiStruct *s = malloc(sizeof(FfiStruct));
+  s->name = strdup(name);
+  s->field_count = field_count;
+  s->field_kinds = malloc(field_count);
+  s->field_structs = malloc(sizeof(FfiStruct*) * field_count);
+  s->offsets = malloc(sizeof(size_t) * field_count);
+  s->type.elements = malloc(sizeof(ffi_type*) * (field_count + 1));
+
+  // Laid out like the C compiler does it: every field at the next multiple of its alignment
+  size_t offset = 0;
+  unsigned short alignment = 1;
+  Obj *p = field_types;
+  for(int i = 0; i < field_count; i++) {
+    ffi_type *field_type = lisp_type_to_ffi_type(p->car);
+    if(!field_type || field_type == &ffi_type_void) {
+      error = concat_c_strings("Invalid type for a field of a struct: ", obj_to_string(p->car)->s);
+      free(s->type.elements);
+      free(s->offsets);
+      free(s->field_structs);
+      free(s->field_kinds);
+      free(s->name);
+      free(s);
+      return NULL;
+    }
+    s->type.elements[i] = field_type;
+    s->field_kinds[i] = lisp_type_to_ffi_kind(p->car);
+    s->field_structs[i] = ffi_struct_find(p->car);
+    offset = align_up(offset, field_type->alignment);
+    s->offsets[i] = offset;
+    offset += field_type->size;
+    if(field_type->alignment > alignment) {
+      alignment = field_type->alignment;
+    }
+    p = p->cdr;
+  }
+  s->type.elements[field_count] = NULL;
+  s->type.size = align_up(offset, alignment);
+  s->type.alignment = alignment;
+  s->type.type = FFI_TYPE_STRUCT;
+
+  // The old struct isn't freed, the plans of foreign functions that were registered with it still use it
+  for(int i = 0; i < ffi_struct_count; i++) {
+    if(strcmp(ffi_structs[i]->name, name) == 0) {
+      ffi_structs[i] = s;
+      return s;
+    }
+  }
+  ffi_structs = realloc(ffi_structs, sizeof(FfiStruct*) * (ffi_struct_count + 1));
+  ffi_structs[ffi_struct_count++] = s;
+  return s;
+}
+
+size_t ffi_value_size(FfiKind kind, FfiStruct *s) {
+  switch(kind) {
+  case FFI_KIND_INT: return sizeof(int);
+  case FFI_KIND_FLOAT: return sizeof(float);
+  case FFI_KIND_DOUBLE: return sizeof(double);
+  case FFI_KIND_INT64: return sizeof(int64_t);
+  case FFI_KIND_CHAR: return sizeof(char);
+  case FFI_KIND_BOOL: return sizeof(bool);
+  case FFI_KIND_STRUCT: return s->type.size;
+  default: return sizeof(void*);
+  }
+}
+
+bool ffi_value_write(FfiKind kind, FfiStruct *s, Obj *value, void *dest) {
+  char tag = obj_tag(value);
+  switch(kind) {
+  case FFI_KIND_INT:
+    if(tag != 'I') { break; }
+    *(int*)dest = obj_int(value);
+    return true;
+  case FFI_KIND_FLOAT:
+    if(tag != 'V') { break; }
+    *(float*)dest = obj_float(value);
+    return true;
+  case FFI_KIND_DOUBLE:
+    // Ints and floats fit in a double without losing anything
+    if(tag != 'W' && tag != 'V' && tag != 'I') { break; }
+    *(double*)dest = tag == 'W' ? value->d : tag == 'V' ? obj_float(value) : obj_int(value);
+    return true;
+  case FFI_KIND_INT64:
+    if(tag != 'J' && tag != 'I') { break; }
+    *(int64_t*)dest = tag == 'J' ? value->l : obj_int(value);
+    return true;
+  case FFI_KIND_CHAR:
+    if(tag != 'I') { break; }
+    *(char*)dest = obj_int(value);
+    return true;
+  case FFI_KIND_BOOL:
+    *(bool*)dest = is_true(value);
+    return true;
+  case FFI_KIND_STRING:
+    if(tag != 'S') { break; }
+    value->given_to_ffi = true;
+    *(char**)dest = value->s;
+    return true;
+  case FFI_KIND_STRUCT:
+    if(tag != 'A') { break; }
+    if(value->count != s->field_count) {
+      char buffer[256];
+      snprintf(buffer, 256, "Struct %s needs %d fields, got: ", s->name, s->field_count);
+      error = concat_c_strings(buffer, obj_to_string(value)->s);
+      return false;
+    }
+    for(int i = 0; i < s->field_count; i++) {
+      if(!ffi_value_write(s->field_kinds[i], s->field_structs[i], value->items[i], (char*)dest + s->offsets[i])) {
+	return false;
+      }
+    }
+    return true;
+  default:
+    if(tag != 'Q') { break; }
+    *(void**)dest = value->void_ptr;
+    return true;
+  }
+  error = concat_c_strings("Invalid type of value for foreign function: ", obj_to_string(value)->s);
+  return false;
+}
+
+Obj *ffi_value_read(FfiKind kind, FfiStruct *s, void *src) {
+  switch(kind) {
+  case FFI_KIND_INT: return obj_new_int(*(int*)src);
+  case FFI_KIND_FLOAT: return obj_new_float(*(float*)src);
+  case FFI_KIND_DOUBLE: return obj_new_double(*(double*)src);
+  case FFI_KIND_INT64: return obj_new_int64(*(int64_t*)src);
+  case FFI_KIND_CHAR: return obj_new_int(*(char*)src);
+  case FFI_KIND_BOOL: return *(bool*)src ? lisp_true : lisp_false;
+  case FFI_KIND_STRING: return obj_new_string(*(char**)src ? *(char**)src : "");
+  case FFI_KIND_STRUCT: {
+    Obj *fields = obj_new_array(s->field_count);
+    for(int i = 0; i < s->field_count; i++) {
+      obj_array_push(fields, ffi_value_read(s->field_kinds[i], s->field_structs[i], (char*)src + s->offsets[i]));
+    }
+    return fields;
+  }
+  default: return obj_new_ptr(*(void**)src);
+  }
+}
+
+int ffi_pointee_kind(FfiKind pointer_kind) {
+  switch(pointer_kind) {
+  case FFI_KIND_INT_PTR: return FFI_KIND_INT;
+  case FFI_KIND_FLOAT_PTR: return FFI_KIND_FLOAT;
+  case FFI_KIND_DOUBLE_PTR: return FFI_KIND_DOUBLE;
+  case FFI_KIND_INT64_PTR: return FFI_KIND_INT64;
+  case FFI_KIND_STRUCT_PTR: return FFI_KIND_STRUCT;
+  default: return -1;
+  }
+}
+
+void *ffi_array_write(FfiKind kind, FfiStruct *s, Obj *array) {
+  size_t size = ffi_value_size(kind, s);
+  char *items = malloc(array->count > 0 ? array->count * size : 1);
+  for(int i = 0; i < array->count; i++) {
+    if(!ffi_value_write(kind, s, array->items[i], items + i * size)) {
+      free(items);
+      return NULL;
+    }
+  }
+  return items;
+}
+
+void ffi_array_read(FfiKind kind, FfiStruct *s, Obj *array, void *src) {
+  size_t size = ffi_value_size(kind, s);
+  for(int i = 0; i < array->count; i++) {
+    array->items[i] = ffi_value_read(kind, s, (char*)src + i * size);
+    gc_write_barrier(array, array->items[i]);
+  }
+}
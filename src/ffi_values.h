@@ -0,0 +1,45 @@
+#pragma once
+
+#include "obj.h"
+
+// Conversions between Lisp values and C memory, for the args of foreign functions that are
+// structs (by value) or pointers to arrays, see 'apply'.
+// Structs are declared with (register-struct :Vec2 '(:float :float)), after which :Vec2 and
+// (:ptr :Vec2) can be used in the types given to 'register'. A struct value is an array with
+// its fields in order, like [1.0 2.0]. Fields can be ints, floats, doubles, :i64/:u64, chars,
+// bools, strings, pointers and other structs.
+// An array given for a (:ptr ...) arg is copied to C memory for the call and its items are
+// replaced with what's in that memory afterwards, so foreign functions can fill it in.
+
+typedef struct FfiStruct {
+  char *name;
+  ffi_type type; // its 'elements' are the field types and a NULL
+  int field_count;
+  char *field_kinds; // an FfiKind per field
+  struct FfiStruct **field_structs; // for the fields that are structs
+  size_t *offsets;
+} FfiStruct;
+
+// NULL if 'type_obj' isn't the keyword of a registered struct
+FfiStruct *ffi_struct_find(Obj *type_obj);
+
+// Returns NULL and sets 'error' if a field type isn't supported.
+// Structs that are registered again are replaced for functions registered after that.
+FfiStruct *ffi_struct_register(char *name, Obj *field_types);
+
+// The bytes taken by one value of 'kind' in C memory ('s' for structs)
+size_t ffi_value_size(FfiKind kind, FfiStruct *s);
+
+// Writes 'value' to 'dest' as a C value of 'kind', returns false and sets 'error' if it has the wrong type
+bool ffi_value_write(FfiKind kind, FfiStruct *s, Obj *value, void *dest);
+
+Obj *ffi_value_read(FfiKind kind, FfiStruct *s, void *src);
+
+// The kind of the items of a pointer arg given as an array, or -1 for pointers that can't be given one
+int ffi_pointee_kind(FfiKind pointer_kind);
+
+// A malloc:ed C array with the items of 'array', NULL (with 'error' set) if one of them has the wrong type
+void *ffi_array_write(FfiKind kind, FfiStruct *s, Obj *array);
+
+// Replaces the items of 'array' with the values in 'src', the C array made by ffi_array_write()
+void ffi_array_read(FfiKind kind, FfiStruct *s, Obj *array, void *src);
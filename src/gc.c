@@ -1,92 +1,464 @@
 #include "gc.h"
+#include "env.h"
+#include "slab.h"
+#include "lexical.h"
+#include "expansion.h"
+#include <time.h>
+#include <limits.h>
 
-#define LOG_GC_KILL_COUNT 1
+#define LOG_GC_KILL_COUNT 1 // 2 to also log minor collections
 #define LOG_FREE 0
 
-void obj_mark_alive(Obj *o) {
-  if(!o || o->alive) {
-    return;
+long current_time_us() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000L + t.tv_nsec / 1000;
+}
+
+// Marking uses an explicit stack of grey objects (marked alive but children not yet scanned)
+// instead of recursion, so long lists and deep trees can't overflow the C stack.
+Obj **grey_stack = NULL;
+int grey_stack_pos = 0;
+int grey_stack_size = 0;
+
+// Generations: objects start out young and are listed in the nursery.
+// A minor collection only marks and sweeps young objects, old ones are treated as alive.
+// Old objects that get a pointer to a young object stored into them are put in the
+// remembered set by the write barrier (see gc.h) and act as extra roots for the minor collection.
+// Objects never move, survivors of a collection are promoted by setting their 'old' flag.
+Obj **nursery = NULL;
+int nursery_count = 0;
+int nursery_size = 0;
+
+Obj **remembered = NULL;
+int remembered_count = 0;
+int remembered_size = 0;
+
+bool marking_minor = false;
+
+Obj **grow_obj_array(Obj **array, int *size, int initial_size, char *name) {
+  *size = *size ? *size * 2 : initial_size;
+  array = realloc(array, sizeof(Obj*) * *size);
+  if(!array) {
+    printf("Failed to grow the %s to %d entries.\n", name, *size);
+    exit(1);
   }
+  return array;
+}
 
-  //printf("marking %p alive: ", o); obj_print_cout(o); printf("\n");
-  
+void grey_push(Obj *o) {
+  if(!o || obj_is_immediate(o) || o->alive || (marking_minor && o->old)) {
+    return;
+  }
   o->alive = true;
-  
-  if(o->tag == 'C') {
-    obj_mark_alive(o->car);
-    obj_mark_alive(o->cdr);
+  if(grey_stack_pos == grey_stack_size) {
+    grey_stack = grow_obj_array(grey_stack, &grey_stack_size, 1024, "GC mark stack");
+  }
+  grey_stack[grey_stack_pos++] = o;
+}
+
+void grey_push_children(Obj *grey) {
+  char tag = obj_tag(grey);
+  if(tag == 'C') {
+    // cdr goes first so the car is scanned before moving on down the list, that keeps the stack shallow
+    grey_push(grey->cdr);
+    grey_push(grey->car);
+  }
+  else if(tag == 'L' || tag == 'M') {
+    grey_push(grey->params);
+    grey_push(grey->body);
+    grey_push(grey->env);
+    grey_push(grey->code);
+    grey_push(grey->bytecode);
+    grey_push(grey->free_frame);
+  }
+  else if(tag == 'E') {
+    grey_push(grey->parent);
+    grey_push(grey->bindings);
+  }
+  else if(tag == 'F') {
+    grey_push(grey->arg_types);
+    grey_push(grey->return_type);
+  }
+  else if(tag == 'A') {
+    for(int i = grey->count - 1; i >= 0; i--) {
+      grey_push(grey->items[i]);
+    }
+  }
+  else if(tag == 'H') {
+    grey_push(grey->dict_root);
+  }
+  else if(tag == 'G') {
+    grey_push(grey->frame_parent);
+    grey_push(grey->frame_names);
+    for(int i = grey->frame_count - 1; i >= 0; i--) {
+      grey_push(grey->frame_slots[i]);
+    }
+  }
+  else if(tag == 'X') {
+    grey_push(grey->ref_symbol);
+    if(grey->ref_depth != REF_NAME) {
+      grey_push(grey->ref_binding); // the cache of a name is weak, see lexical.h
+    }
+  }
+  else if(tag == 'B') {
+    grey_push(grey->bc_constants);
+  }
+  else if(tag == 'R') {
+    grey_push(grey->pvec_tail);
+    grey_push(grey->pvec_root);
+  }
+  else if(tag == 'T') {
+    for(int i = grey->entry_count * 2 - 1; i >= 0; i--) {
+      grey_push(grey->entries[i]);
+    }
   }
-  else if(o->tag == 'L' || o->tag == 'M') {
-    obj_mark_alive(o->params);
-    obj_mark_alive(o->body);
-    obj_mark_alive(o->env);
-    obj_mark_alive(o->code);
+}
+
+void gc_mark_drain() {
+  while(grey_stack_pos > 0) {
+    Obj *grey = grey_stack[--grey_stack_pos];
+    //printf("marking %p alive: ", grey); obj_print_cout(grey); printf("\n");
+    grey_push_children(grey);
+  }
+}
+
+void obj_mark_alive(Obj *o) {
+  grey_push(o);
+  gc_mark_drain();
+}
+
+// Work between checks of the clock in a mark slice
+#define GC_MARK_CHECK_INTERVAL 256
+
+// The work a slice has to do before it can stop at its deadline, see GC_WORK_PER_ALLOC
+long gc_work_left;
+
+bool gc_slice_over(long deadline) {
+  return gc_work_left <= 0 && current_time_us() >= deadline;
+}
+
+// Marks until the grey stack is empty (returns true) or the slice is over
+bool gc_mark_slice(long deadline) {
+  int work = 0;
+  while(grey_stack_pos > 0) {
+    Obj *grey = grey_stack[--grey_stack_pos];
+    grey_push_children(grey);
+    gc_work_left--;
+    if(++work % GC_MARK_CHECK_INTERVAL == 0 && gc_slice_over(deadline)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void gc_track_new(Obj *o) {
+  if(gc_phase == GC_PHASE_MARK) {
+    // New objects survive the ongoing collection, they are grey since their fields can point to white objects
+    o->old = true;
+    grey_push(o);
+  }
+  else if(gc_phase == GC_PHASE_SWEEP) {
+    // Cells in slabs the sweep hasn't reached yet must not be freed by it
+    o->old = true;
+    o->alive = slab_sweep_pending(o);
+  }
+  else if(GC_GENERATIONAL) {
+    if(nursery_count == nursery_size) {
+      nursery = grow_obj_array(nursery, &nursery_size, GC_NURSERY_SIZE, "GC nursery");
+    }
+    nursery[nursery_count++] = o;
   }
-  else if(o->tag == 'E') {
-    obj_mark_alive(o->parent);
-    obj_mark_alive(o->bindings);
+}
+
+// For objects the mutator gets hold of without reading them from another object, like interned symbols
+void gc_shade(Obj *o) {
+  if(gc_phase == GC_PHASE_MARK) {
+    grey_push(o);
   }
-  else if(o->tag == 'F') {
-    obj_mark_alive(o->arg_types);
-    obj_mark_alive(o->return_type);
+  else if(gc_phase == GC_PHASE_SWEEP && slab_sweep_pending(o)) {
+    o->alive = true;
   }
 }
 
+void gc_remember(Obj *o) {
+  if(remembered_count == remembered_size) {
+    remembered = grow_obj_array(remembered, &remembered_size, 256, "GC remembered set");
+  }
+  o->remembered = true;
+  remembered[remembered_count++] = o;
+}
+
 void free_internal_data(Obj *dead) {
+  if((obj_tag(dead) == 'Y' || obj_tag(dead) == 'K') && dead != lexical_fn_symbol) { // the only uninterned symbol
+    obj_intern_remove(dead);
+  }
+  if(dead->expanded) {
+    expansion_remove(dead);
+  }
+  
   if(dead->given_to_ffi) {
     // ignore this object
   }
-  else if(dead->tag == 'F') {
-    free(dead->cif);
+  else if(obj_tag(dead) == 'F') {
+    free(dead->plan->arg_ffi_types);
+    free(dead->plan->arg_structs);
+    free(dead->plan);
+  }
+  else if(obj_tag(dead) == 'E') {
+    env_index_free(dead);
+  }
+  else if(obj_tag(dead) == 'A') {
+    free(dead->items);
+  }
+  else if(obj_tag(dead) == 'N') {
+    free(dead->numbers);
   }
-  else if(dead->tag == 'S' || dead->tag == 'Y' || dead->tag == 'K') {
+  else if(obj_tag(dead) == 'T') {
+    free(dead->entries);
+  }
+  else if(obj_tag(dead) == 'B') {
+    free(dead->bc_ops);
+  }
+  else if(obj_tag(dead) == 'S' || obj_tag(dead) == 'Y' || obj_tag(dead) == 'K') {
     free(dead->s);
   }
 }
 
-void gc_sweep() {
-  int kill_count = 0;
-  Obj **p = &obj_latest;
-  while(*p) {
-    if(!(*p)->alive) {
-      Obj *dead = *p;
+int sweep_kill_count;
+
+void free_dead_obj(Obj *o) {
+  if(LOG_FREE) {
+    printf("free ");
+    printf("%p %c ", o, obj_tag(o));
+    //obj_print_cout(o);
+    printf("\n");
+  }
+
+  free_internal_data(o);
+  gc_stats.bytes_freed_total += obj_tag(o) == 'G' ? obj_frame_size(o->frame_count) : obj_size(obj_tag(o));
+  slab_free(o);
 
-      if(LOG_FREE) {
-	printf("free ");
-	printf("%p %c ", dead, dead->tag);
-	//obj_print_cout(dead);
-	printf("\n");
-      }
+  obj_total--;
+  sweep_kill_count++;
+}
 
-      *p = dead->prev;
-      free_internal_data(dead);
-      free(dead);
-      
-      obj_total--;
-      kill_count++;
+void sweep_obj(Obj *o) {
+  gc_work_left--;
+  if(!o->alive) {
+    free_dead_obj(o);
+  }
+  else {
+    o->alive = false; // for next gc collect
+    o->old = true;
+    o->remembered = false;
+  }
+}
+
+// Only young objects can be dead after a minor mark, so there's no need to look at the whole heap
+void gc_sweep_nursery() {
+  sweep_kill_count = 0;
+  for(int i = 0; i < nursery_count; i++) {
+    Obj *o = nursery[i];
+    if(!o->alive) {
+      free_dead_obj(o);
     }
     else {
-      (*p)->alive = false; // for next gc collect
-      p = &(*p)->prev;
+      o->alive = false;
+      o->old = true;
     }
   }
-  if(LOG_GC_KILL_COUNT) {
-    printf("\e[33mGC:d %d Obj:s, %d left.\e[0m\n", kill_count, obj_total);
+  gc_stats.promoted_total += nursery_count - sweep_kill_count;
+  nursery_count = 0;
+  slab_release_empty();
+  if(LOG_GC_KILL_COUNT > 1) {
+    printf("\e[33mMinor GC:d %d Obj:s, %d left.\e[0m\n", sweep_kill_count, obj_total);
   }
 }
 
-void gc(Obj *env) {
-  obj_mark_alive(env);
+void gc_init() {
+  gc_growth = GC_DEFAULT_GROWTH;
+  char *growth = getenv("CARP_GC_GROWTH");
+  if(growth) {
+    float f = atof(growth);
+    if(f > 1.0f) {
+      gc_growth = f;
+    }
+    else {
+      printf("Ignoring CARP_GC_GROWTH=%s, it must be a number above 1.\n", growth);
+    }
+  }
+  obj_total_max = GC_MIN_HEAP;
+
+  gc_pause_budget = GC_DEFAULT_PAUSE_BUDGET;
+  char *budget = getenv("CARP_GC_BUDGET");
+  if(budget) {
+    gc_pause_budget = atol(budget);
+    if(gc_pause_budget < 0) {
+      gc_pause_budget = 0;
+    }
+  }
+  gc_phase = GC_PHASE_IDLE;
+}
+
+void gc_set_threshold() {
+  obj_total_max = (int)(obj_total * gc_growth);
+  if(obj_total_max < GC_MIN_HEAP) {
+    obj_total_max = GC_MIN_HEAP;
+  }
+}
+
+void gc_record_pause(long pause) {
+  if(pause > gc_stats.pause_max) {
+    gc_stats.pause_max = pause;
+  }
+  int bucket = 0;
+  for(long limit = 10; pause >= limit && bucket < GC_PAUSE_BUCKETS - 1; limit *= 10) {
+    bucket++;
+  }
+  gc_stats.pause_histogram[bucket]++;
+  gc_stats.recent_pauses[gc_stats.recent_pause_count++ % GC_PAUSE_SAMPLES] = pause;
+}
+
+int compare_longs(const void *a, const void *b) {
+  long x = *(const long*)a;
+  long y = *(const long*)b;
+  return (x > y) - (x < y);
+}
+
+long gc_pause_percentile(int percent) {
+  int count = gc_stats.recent_pause_count < GC_PAUSE_SAMPLES ? gc_stats.recent_pause_count : GC_PAUSE_SAMPLES;
+  if(count == 0) {
+    return 0;
+  }
+  long sorted[GC_PAUSE_SAMPLES];
+  memcpy(sorted, gc_stats.recent_pauses, sizeof(long) * count);
+  qsort(sorted, count, sizeof(long), compare_longs);
+  return sorted[(count - 1) * percent / 100];
+}
+
+void gc_push_roots(Obj *env) {
+  grey_push(env);
+  for(int i = 0; i < SPECIAL_FORM_COUNT; i++) {
+    grey_push(special_form_symbols[i]); // must keep their dispatch id
+  }
   for(int i = 0; i < stack_pos; i++) {
-    obj_mark_alive(stack[i]);
+    grey_push(stack[i]);
   }
   for(int i = 0; i < shadow_stack_pos; i++) {
-    obj_mark_alive(shadow_stack[i]);
+    grey_push(shadow_stack[i]);
   }
-  gc_sweep();
+  for(int i = 0; i < function_trace_pos; i++) {
+    grey_push(function_trace[i]);
+  }
+  expansion_push_roots(grey_push);
 }
 
-void gc_all() {
-  gc_sweep();
+void gc_cycle_begin(Obj *env) {
+  gc_phase = GC_PHASE_MARK;
+  sweep_kill_count = 0;
+  gc_stats.mark_time_last = 0;
+  gc_push_roots(env);
+}
+
+void gc_cycle_end() {
+  slab_release_empty();
+  // Everything that survived is old now, so nothing is young or remembered
+  nursery_count = 0;
+  remembered_count = 0;
+  gc_phase = GC_PHASE_IDLE;
+  gc_set_threshold();
+  gc_stats.major_count++;
+  if(LOG_GC_KILL_COUNT) {
+    printf("\e[33mGC:d %d Obj:s, %d left.\e[0m\n", sweep_kill_count, obj_total);
+  }
+}
+
+// Does work on the ongoing full collection until the slice is over, returns true when it's done
+bool gc_cycle_work(long deadline) {
+  if(gc_phase == GC_PHASE_MARK) {
+    long start = current_time_us();
+    bool marked = gc_mark_slice(deadline);
+    if(marked) {
+      // The stacks aren't covered by the write barrier so they are scanned again, all at once
+      gc_push_roots(global_env);
+      gc_mark_drain();
+      slab_sweep_begin();
+      gc_phase = GC_PHASE_SWEEP;
+    }
+    long mark_time = current_time_us() - start;
+    gc_stats.mark_time_last += mark_time;
+    gc_stats.mark_time_total += mark_time;
+    if(!marked) {
+      return false;
+    }
+  }
+  while(!slab_sweep_step(sweep_obj)) {
+    if(gc_slice_over(deadline)) {
+      return false;
+    }
+  }
+  gc_cycle_end();
+  return true;
+}
+
+// A full collection, finishes the ongoing one if there is one
+void gc(Obj *env) {
+  long start = current_time_us();
+  if(gc_phase == GC_PHASE_IDLE) {
+    gc_cycle_begin(env);
+  }
+  gc_cycle_work(LONG_MAX);
+  long pause = current_time_us() - start;
+  gc_stats.major_pause_total += pause;
+  gc_record_pause(pause);
 }
 
+// One slice of an incremental full collection, starts a new one if needed
+void gc_step() {
+  long start = current_time_us();
+  if(gc_phase == GC_PHASE_IDLE) {
+    gc_cycle_begin(global_env);
+    gc_work_left = GC_WORK_PER_ALLOC * GC_SLICE_ALLOCS;
+  }
+  else {
+    gc_work_left = GC_WORK_PER_ALLOC * (obj_allocs_total - gc_last_slice);
+  }
+  gc_cycle_work(gc_pause_budget > 0 ? start + gc_pause_budget : LONG_MAX);
+  long pause = current_time_us() - start;
+  gc_stats.major_pause_total += pause;
+  gc_record_pause(pause);
+  gc_last_slice = obj_allocs_total;
+  gc_next_slice = obj_allocs_total + GC_SLICE_ALLOCS;
+}
+
+void gc_minor() {
+  long start = current_time_us();
+  marking_minor = true;
+  for(int i = 0; i < remembered_count; i++) {
+    remembered[i]->remembered = false;
+    grey_push_children(remembered[i]);
+    gc_mark_drain();
+  }
+  remembered_count = 0;
+  gc_push_roots(global_env);
+  gc_mark_drain();
+  marking_minor = false;
+  gc_stats.mark_time_last = current_time_us() - start;
+  gc_stats.mark_time_total += gc_stats.mark_time_last;
+  gc_sweep_nursery();
+  long pause = current_time_us() - start;
+  gc_stats.minor_count++;
+  gc_stats.minor_pause_total += pause;
+  gc_record_pause(pause);
+}
+
+// Frees everything
+void gc_all() {
+  gc_phase = GC_PHASE_IDLE;
+  grey_stack_pos = 0;
+  nursery_count = 0;
+  remembered_count = 0;
+  slab_each_obj(free_dead_obj);
+  slab_release_empty();
+}
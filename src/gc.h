@@ -5,3 +5,97 @@
 
 void gc(Obj *env);
 void gc_all();
+
+void gc_minor();
+
+// Full collections run once the heap has grown to 'gc_growth' times the nr of objects
+// that survived the last one, but never before there are GC_MIN_HEAP objects.
+// The growth factor can be set with the CARP_GC_GROWTH environment variable or 'set-gc-growth!'.
+#define GC_MIN_HEAP 100000
+#define GC_DEFAULT_GROWTH 2.0f
+
+float gc_growth;
+
+void gc_init();
+
+// Generational mode: young objects are collected by frequent minor collections
+// and a full collection (gc) only runs when the heap has grown past 'obj_total_max'.
+#define GC_GENERATIONAL 1
+
+// Nr of new objects that triggers a minor collection
+#define GC_NURSERY_SIZE 20000
+
+int nursery_count;
+
+// Incremental mode: with a pause budget above 0 a full collection is done in slices of
+// 'gc_pause_budget' microseconds of marking or sweeping, one slice every GC_SLICE_ALLOCS allocations.
+// With a budget of 0 the whole collection is done at once.
+// The budget can be set with the CARP_GC_BUDGET environment variable or 'set-gc-budget!'.
+// Slices are paced by allocation, not just by time: each one also does at least GC_WORK_PER_ALLOC
+// units of work (a grey object scanned or a cell swept) for every object allocated since the last
+// one, even when that takes longer than the budget. Otherwise a program that allocates faster than
+// a small budget can collect keeps the collection from ever finishing. If the heap still gets to
+// GC_HARD_LIMIT times 'obj_total_max' the rest of the collection is done at once.
+#define GC_DEFAULT_PAUSE_BUDGET 1000
+#define GC_SLICE_ALLOCS 1000
+#define GC_WORK_PER_ALLOC 4
+#define GC_HARD_LIMIT 2
+
+typedef enum {
+  GC_PHASE_IDLE,
+  GC_PHASE_MARK,
+  GC_PHASE_SWEEP
+} GCPhase;
+
+GCPhase gc_phase;
+long gc_pause_budget;
+long gc_next_slice; // value of 'obj_allocs_total' when the next slice is due
+long gc_last_slice; // value of 'obj_allocs_total' at the end of the last slice
+
+void gc_step();
+
+void gc_track_new(Obj *o);
+void gc_remember(Obj *o);
+void gc_shade(Obj *o);
+
+// Must be used after storing 'value' into a field of an existing object 'o' (not when initializing a new one).
+// While marking, a stored white object is shaded so a black 'o' can't hide it (Dijkstra style).
+// Otherwise old objects pointing to young ones go into the remembered set.
+#define gc_write_barrier(o, value)					\
+  if((value) && !obj_is_immediate(value)) {				\
+    if(gc_phase == GC_PHASE_MARK) {					\
+      if((o)->alive && !(value)->alive) {				\
+	gc_shade(value);						\
+      }									\
+    }									\
+    else if(GC_GENERATIONAL && gc_phase == GC_PHASE_IDLE &&		\
+	    (o)->old && !(o)->remembered && !(value)->old) {		\
+      gc_remember(o);							\
+    }									\
+  }
+
+// Pauses are counted in buckets of under 10us, 100us, 1ms, 10ms, 100ms and longer
+#define GC_PAUSE_BUCKETS 6
+
+// Nr of recent pauses kept for percentiles (see 'clear-gc-pauses!')
+#define GC_PAUSE_SAMPLES 1024
+
+// Times are in microseconds
+typedef struct {
+  int minor_count;
+  int major_count;
+  long minor_pause_total;
+  long major_pause_total;
+  long pause_max;
+  int pause_histogram[GC_PAUSE_BUCKETS];
+  long recent_pauses[GC_PAUSE_SAMPLES];
+  int recent_pause_count;
+  long mark_time_total;
+  long mark_time_last;
+  long promoted_total;
+  long bytes_freed_total;
+} GCStats;
+
+GCStats gc_stats;
+
+long gc_pause_percentile(int percent);
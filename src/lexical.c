@@ -0,0 +1,487 @@
+#include "lexical.h"
+#include "env.h"
+#include "eval.h"
+#include "gc.h"
+#include "dict.h"
+
+// The names that one env binds on the way from a form up to the global env
+typedef struct Scope {
+  char kind; // 'G' = params in a frame, 'P' = params in an env, 'L' = let bindings, 'M' = match pattern
+  Obj *names; // the params, the bindings of the let or the pattern
+  struct Scope *outer;
+} Scope;
+
+int lexical_frame_size(Obj *params) {
+  if(obj_tag(params) != 'C') {
+    return -1;
+  }
+  int count = 0;
+  for(Obj *p = params; p && p->car; p = p->cdr) {
+    if(obj_tag(p->car) != 'Y' || count == FRAME_MAX_SLOTS) {
+      return -1;
+    }
+    count++;
+  }
+  return count;
+}
+
+int param_slot(Obj *params, Obj *symbol) {
+  int slot = -1;
+  int i = 0;
+  for(Obj *p = params; p && p->car; p = p->cdr) {
+    if(p->car == symbol) {
+      slot = i; // the last one wins, like in env_lookup of a frame
+    }
+    i++;
+  }
+  return slot;
+}
+
+bool let_binds(Obj *bindings, Obj *symbol) {
+  if(obj_tag(bindings) == 'A') {
+    for(int i = 0; i < bindings->count; i += 2) {
+      if(bindings->items[i] == symbol) {
+	return true;
+      }
+    }
+    return false;
+  }
+  for(Obj *p = bindings; p && p->car && p->cdr; p = p->cdr->cdr) {
+    if(p->car == symbol) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Can be true for symbols that the pattern doesn't bind in the end, that only means they are looked up by name
+bool pattern_binds(Obj *pattern, Obj *symbol) {
+  if(pattern == symbol) {
+    return true;
+  }
+  if(obj_tag(pattern) == 'C' && pattern->car != lisp_quote) {
+    for(Obj *p = pattern; p && obj_tag(p) == 'C' && p->car; p = p->cdr) {
+      if(pattern_binds(p->car, symbol)) {
+	return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool scope_binds(Scope *scope, Obj *symbol) {
+  switch(scope->kind) {
+  case 'G': case 'P': return param_slot(scope->names, symbol) >= 0;
+  case 'L': return let_binds(scope->names, symbol);
+  default: return pattern_binds(scope->names, symbol);
+  }
+}
+
+// Params in frames become (depth, slot) references, names bound in other envs are left as they are
+// and everything else is a global.
+Obj *resolve_symbol(Scope *scope, Obj *symbol) {
+  if(symbol->dispatch != SPECIAL_FORM_NONE) {
+    return symbol;
+  }
+  int depth = 0;
+  for(Scope *s = scope; s; s = s->outer) {
+    if(s->kind == 'G') {
+      int slot = param_slot(s->names, symbol);
+      if(slot >= 0) {
+	return obj_new_ref(symbol, depth, slot);
+      }
+    }
+    else if(scope_binds(s, symbol)) {
+      return symbol;
+    }
+    depth++;
+  }
+  return obj_new_ref(symbol, -1, 0);
+}
+
+Obj *resolve(Scope *scope, Obj *form);
+
+Obj *resolve_items(Scope *scope, Obj *list) {
+  Obj *first = obj_new_cons(NULL, NULL);
+  Obj *last = first;
+  for(Obj *p = list; p && obj_tag(p) == 'C' && p->car; p = p->cdr) {
+    last->car = resolve(scope, p->car);
+    last->cdr = obj_new_cons(NULL, NULL);
+    last = last->cdr;
+  }
+  return first;
+}
+
+// (fn params body)
+Obj *resolve_fn(Scope *scope, Obj *form) {
+  if(!form->cdr || !form->cdr->car || obj_tag(form->cdr->car) != 'C' || !form->cdr->cdr || !form->cdr->cdr->car) {
+    return form; // let eval report the error
+  }
+  Obj *params = form->cdr->car;
+  Scope inner = { lexical_frame_size(params) >= 0 ? 'G' : 'P', params, scope };
+  Obj *body = resolve(&inner, form->cdr->cdr->car);
+  return obj_new_cons(lexical_fn_symbol, obj_new_cons(params, obj_new_cons(body, obj_new_cons(NULL, NULL))));
+}
+
+// (let bindings body), the binding values are evaluated in the env of the let too
+Obj *resolve_let(Scope *scope, Obj *form) {
+  if(!form->cdr || !form->cdr->car || !form->cdr->cdr) {
+    return form;
+  }
+  Obj *bindings = form->cdr->car;
+  Scope inner = { 'L', bindings, scope };
+  Obj *new_bindings;
+  if(obj_tag(bindings) == 'A') {
+    if(bindings->count % 2 != 0) {
+      return form;
+    }
+    new_bindings = obj_new_array(bindings->count);
+    for(int i = 0; i < bindings->count; i += 2) {
+      obj_array_push(new_bindings, bindings->items[i]);
+      obj_array_push(new_bindings, resolve(&inner, bindings->items[i + 1]));
+    }
+  }
+  else if(obj_tag(bindings) == 'C') {
+    new_bindings = obj_new_cons(NULL, NULL);
+    Obj *last = new_bindings;
+    for(Obj *p = bindings; p && p->car; p = p->cdr->cdr) {
+      if(!p->cdr || !p->cdr->car) {
+	return form;
+      }
+      last->car = p->car;
+      last->cdr = obj_new_cons(resolve(&inner, p->cdr->car), obj_new_cons(NULL, NULL));
+      last = last->cdr->cdr;
+    }
+  }
+  else {
+    return form;
+  }
+  return obj_new_cons(form->car, obj_new_cons(new_bindings, resolve_items(&inner, form->cdr->cdr)));
+}
+
+// (match value pattern body pattern body ...), each body is evaluated in an env with the names of its pattern
+Obj *resolve_match(Scope *scope, Obj *form) {
+  if(!form->cdr || !form->cdr->car) {
+    return form;
+  }
+  Obj *first = obj_new_cons(form->car, obj_new_cons(resolve(scope, form->cdr->car), NULL));
+  Obj *last = first->cdr;
+  for(Obj *p = form->cdr->cdr; p && p->car; p = p->cdr->cdr) {
+    if(!p->cdr || !p->cdr->car) {
+      return form;
+    }
+    Scope inner = { 'M', p->car, scope };
+    last->cdr = obj_new_cons(p->car, obj_new_cons(resolve(&inner, p->cdr->car), NULL));
+    last = last->cdr->cdr;
+  }
+  last->cdr = obj_new_cons(NULL, NULL);
+  return first;
+}
+
+Obj *resolve_list(Scope *scope, Obj *form) {
+  Obj *head = form->car;
+  if(!head) {
+    return form;
+  }
+  int special_form = obj_tag(head) == 'Y' ? head->dispatch : SPECIAL_FORM_NONE;
+  switch(special_form) {
+  case SPECIAL_FORM_NONE:
+    break;
+  case SPECIAL_FORM_QUOTE:
+  case SPECIAL_FORM_MACRO:
+  case SPECIAL_FORM_DEF_QMARK:
+  case SPECIAL_FORM_RESOLVED_FN:
+    return form;
+  case SPECIAL_FORM_FN:
+    return resolve_fn(scope, form);
+  case SPECIAL_FORM_LET:
+    return resolve_let(scope, form);
+  case SPECIAL_FORM_MATCH:
+    return resolve_match(scope, form);
+  case SPECIAL_FORM_DEF:
+    if(!form->cdr || !form->cdr->car) {
+      return form;
+    }
+    return obj_new_cons(head, obj_new_cons(form->cdr->car, resolve_items(scope, form->cdr->cdr)));
+  case SPECIAL_FORM_RESET: {
+    // Only params are resolved here, 'reset!' of anything else uses the binding pair
+    if(!form->cdr || !form->cdr->car) {
+      return form;
+    }
+    Obj *target = form->cdr->car;
+    if(obj_tag(target) == 'Y') {
+      Obj *ref = resolve_symbol(scope, target);
+      if(obj_tag(ref) == 'X' && ref->ref_depth >= 0) {
+	target = ref;
+      }
+    }
+    return obj_new_cons(head, obj_new_cons(target, resolve_items(scope, form->cdr->cdr)));
+  }
+  default:
+    // All args are evaluated
+    return obj_new_cons(head, resolve_items(scope, form->cdr));
+  }
+
+  Obj *new_head = resolve(scope, head);
+  if(obj_tag(new_head) == 'X' && new_head->ref_depth < 0) {
+    Obj *value = env_lookup(global_env, head);
+    if(value && obj_tag(value) == 'M') {
+      return form; // macros get the form as it is
+    }
+  }
+  return obj_new_cons(new_head, resolve_items(scope, form->cdr));
+}
+
+typedef struct {
+  Scope *scope;
+  Obj *dict;
+} DictResolving;
+
+void resolve_dict_entry(Obj *key, Obj *value, void *data) {
+  DictResolving *resolving = data;
+  dict_set(resolving->dict, key, resolve(resolving->scope, value));
+}
+
+Obj *resolve(Scope *scope, Obj *form) {
+  if(!form) {
+    return form;
+  }
+  switch(obj_tag(form)) {
+  case 'Y':
+    return resolve_symbol(scope, form);
+  case 'C':
+    return resolve_list(scope, form);
+  case 'A': {
+    // Array and dictionary literals are evaluated item by item, see eval_internal
+    Obj *array = obj_new_array(form->count);
+    for(int i = 0; i < form->count; i++) {
+      obj_array_push(array, resolve(scope, form->items[i]));
+    }
+    return array;
+  }
+  case 'H': {
+    Obj *dict = obj_new_dict(NULL, 0);
+    DictResolving resolving = { scope, dict };
+    dict_each(form, resolve_dict_entry, &resolving);
+    return dict;
+  }
+  default:
+    return form;
+  }
+}
+
+Obj *lexical_resolve(Obj *params, Obj *body) {
+  Scope scope = { lexical_frame_size(params) >= 0 ? 'G' : 'P', params, NULL };
+  return resolve(&scope, body);
+}
+
+Obj *lexical_lookup(Obj *env, Obj *ref) {
+  if(ref->ref_depth < 0) {
+    Obj *pair = ref->ref_binding;
+    if(!pair || !pair->car) {
+      // Not looked up yet, or removed with env_remove
+      lookup_stats.global_misses++;
+      pair = env_lookup_binding(global_env, ref->ref_symbol);
+      if(!pair->car) {
+	return NULL;
+      }
+      ref->ref_binding = pair;
+      gc_write_barrier(ref, pair);
+    }
+    else {
+      lookup_stats.global_hits++;
+    }
+    return pair->cdr;
+  }
+  for(int depth = ref->ref_depth; depth > 0; depth--) {
+    env = env_parent(env);
+  }
+  assert(obj_tag(env) == 'G');
+  return env->frame_slots[ref->ref_index];
+}
+
+// The env 'hops' envs up from 'env', NULL when 'symbol' might be bound in one of the envs on the way
+Obj *env_up_without(Obj *env, int hops, Obj *symbol) {
+  for(; env && hops > 0; hops--) {
+    if(env->tag == 'G') {
+      Obj *p = env->frame_names;
+      for(int i = 0; i < env->frame_count; i++, p = p->cdr) {
+	if(p->car == symbol) {
+	  return NULL;
+	}
+      }
+      env = env->frame_parent;
+    }
+    else {
+      if((env->key_bits & env_key_bit(symbol)) && env_find_pair(env, symbol)) {
+	return NULL;
+      }
+      env = env->parent;
+    }
+  }
+  return env;
+}
+
+Obj *lexical_lookup_name(Obj *env, Obj *ref) {
+  Obj *symbol = ref->ref_symbol;
+  Obj *found = ref->ref_owner ? env_up_without(env, ref->ref_hops, symbol) : NULL;
+  if(found) {
+    switch(ref->ref_owner) {
+    case 'g':
+      if(found == global_env && found->shape == ref->ref_shape) {
+	lookup_stats.name_hits++;
+	return ref->ref_binding->cdr;
+      }
+      break;
+    case 'E':
+      if(found->tag == 'E' && found->shape == ref->ref_shape) {
+	lookup_stats.name_hits++;
+	Obj *p = found->bindings;
+	for(int i = 0; i < ref->ref_index; i++) {
+	  p = p->cdr;
+	}
+	return p->car->cdr;
+      }
+      break;
+    case 'G':
+      if(found->tag == 'G' && frame_find_slot(found, symbol) == ref->ref_index) {
+	lookup_stats.name_hits++;
+	return found->frame_slots[ref->ref_index];
+      }
+      break;
+    }
+  }
+
+  lookup_stats.name_misses++;
+  ref->ref_owner = 0;
+  for(int hops = 0; env; env = env_parent(env), hops++) {
+    if(obj_tag(env) == 'G') {
+      int slot = frame_find_slot(env, symbol);
+      if(slot >= 0) {
+	ref->ref_owner = 'G';
+	ref->ref_hops = hops;
+	ref->ref_index = slot;
+	return env->frame_slots[slot];
+      }
+      continue;
+    }
+    Obj *pair = env_find_pair(env, symbol);
+    if(!pair) {
+      continue;
+    }
+    if(env == global_env) {
+      ref->ref_owner = 'g';
+      ref->ref_binding = pair;
+    }
+    else if(!env->index) {
+      // Envs with an index get a new shape for each binding, so the place isn't worth remembering
+      int place = 0;
+      for(Obj *p = env->bindings; p->car != pair; p = p->cdr) {
+	place++;
+      }
+      ref->ref_owner = 'E';
+      ref->ref_index = place;
+    }
+    ref->ref_hops = hops;
+    ref->ref_shape = env->shape;
+    return pair->cdr;
+  }
+  return NULL;
+}
+
+Obj **lexical_place(Obj *env, Obj *ref, Obj **owner) {
+  assert(ref->ref_depth >= 0);
+  for(int depth = ref->ref_depth; depth > 0; depth--) {
+    env = env_parent(env);
+  }
+  assert(obj_tag(env) == 'G');
+  *owner = env;
+  return &env->frame_slots[ref->ref_index];
+}
+
+void find_resolved_entry(Obj *key, Obj *value, void *data);
+
+bool is_resolved(Obj *form) {
+  if(!form || obj_is_immediate(form)) {
+    return false;
+  }
+  switch(obj_tag(form)) {
+  case 'X':
+    return true;
+  case 'Y':
+    return form == lexical_fn_symbol;
+  case 'C':
+    for(Obj *p = form; p && obj_tag(p) == 'C' && p->car; p = p->cdr) {
+      if(is_resolved(p->car)) {
+	return true;
+      }
+    }
+    return false;
+  case 'A':
+    for(int i = 0; i < form->count; i++) {
+      if(is_resolved(form->items[i])) {
+	return true;
+      }
+    }
+    return false;
+  case 'H': {
+    bool found = false;
+    dict_each(form, find_resolved_entry, &found);
+    return found;
+  }
+  default:
+    return false;
+  }
+}
+
+void find_resolved_entry(Obj *key, Obj *value, void *data) {
+  if(is_resolved(value)) {
+    *(bool*)data = true;
+  }
+}
+
+void unresolve_entry(Obj *key, Obj *value, void *data);
+
+Obj *unresolve(Obj *form) {
+  if(!form || obj_is_immediate(form)) {
+    return form;
+  }
+  switch(obj_tag(form)) {
+  case 'X':
+    return form->ref_symbol;
+  case 'Y':
+    return form == lexical_fn_symbol ? special_form_symbols[SPECIAL_FORM_FN] : form;
+  case 'C': {
+    Obj *first = obj_new_cons(NULL, NULL);
+    Obj *last = first;
+    for(Obj *p = form; p && obj_tag(p) == 'C' && p->car; p = p->cdr) {
+      last->car = unresolve(p->car);
+      last->cdr = obj_new_cons(NULL, NULL);
+      last = last->cdr;
+    }
+    return first;
+  }
+  case 'A': {
+    Obj *array = obj_new_array(form->count);
+    for(int i = 0; i < form->count; i++) {
+      obj_array_push(array, unresolve(form->items[i]));
+    }
+    return array;
+  }
+  case 'H': {
+    Obj *dict = obj_new_dict(NULL, 0);
+    dict_each(form, unresolve_entry, dict);
+    return dict;
+  }
+  default:
+    return form;
+  }
+}
+
+void unresolve_entry(Obj *key, Obj *value, void *data) {
+  dict_set(data, key, unresolve(value));
+}
+
+Obj *lexical_unresolve(Obj *form) {
+  return is_resolved(form) ? unresolve(form) : form;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "obj.h"
+
+// Lexical addressing of lambda bodies.
+// When a 'fn' form is evaluated in the global env its body is copied, with the references to params
+// replaced by 'X' objects that know the (depth, index) of their frame slot and the references to globals
+// replaced by 'X' objects that cache the binding pair. Calls of such lambdas get a frame ('G') with
+// the args in a flat array, instead of an environment with a binding pair for each arg.
+// Nested 'fn' forms are resolved together with the outer one and get 'lexical_fn_symbol' as their head.
+// Forms that are given to macros are left as they are, since macros can do anything with the symbols.
+
+Obj *lexical_fn_symbol;
+
+// The nr of slots the frame of a lambda with these params gets, -1 when it should get an environment
+int lexical_frame_size(Obj *params);
+
+// Resolves the body of a lambda with 'params' that is created in the global env
+Obj *lexical_resolve(Obj *params, Obj *body);
+
+// The value of a reference, NULL when it is a global that isn't defined
+Obj *lexical_lookup(Obj *env, Obj *ref);
+
+// The references to globals are the inline caches of their call sites. The symbols that the VM
+// looks up by name get one too, a ref with REF_NAME depth that remembers how many envs up its last
+// lookup found the name, and where: in a frame slot, at a place in the bindings of an env with some
+// shape, or in the global env (see env.h). It's used again for any env with the same things around
+// it, like the env of the next run of the same 'let', as long as the envs on the way don't have the
+// name. The global binding pair isn't a GC root, it's only used while the global env keeps its shape.
+#define REF_NAME -2
+
+typedef struct {
+  long global_hits;
+  long global_misses;
+  long name_hits;
+  long name_misses;
+} LookupStats;
+
+LookupStats lookup_stats;
+
+// The value of a name, NULL when it isn't defined in 'env'
+Obj *lexical_lookup_name(Obj *env, Obj *ref);
+
+// The frame slot of a reference to a param, 'owner' is set to the frame
+Obj **lexical_place(Obj *env, Obj *ref, Obj **owner);
+
+// A copy of a resolved form with the plain symbols back, or the form itself when nothing in it was resolved
+Obj *lexical_unresolve(Obj *form);
@@ -1,11 +1,15 @@
 #include "repl.h"
 #include "eval.h"
+#include "gc.h"
+#include "bytecode.h"
+#include "direct_call.h"
 #include "../shared/shared.h"
 
 int main() {
-  obj_total_max = 100000;
-  stack_pos = 0;
-  shadow_stack_pos = 0;
+  gc_init();
+  bytecode_init();
+  direct_call_init();
+  stack_init();
   env_new_global();
   eval_text(global_env, "(load-lisp (str (getenv \"CARP_DIR\") \"lisp/boot.carp\"))", false);
   pop_stacks_to_zero();
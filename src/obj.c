@@ -1,26 +1,71 @@
 #include "obj.h"
 #include "obj_string.h"
 #include "env.h"
+#include "slab.h"
+#include "gc.h"
+#include "dict.h"
+#include "pvec.h"
+#include <stddef.h>
 
 #define LOG_ALLOCS 0
 
-Obj *obj_latest = NULL;
 int obj_total = 0;
+long obj_allocs_total = 0;
 
-Obj *obj_new(char tag) {  
-  Obj *o = malloc(sizeof(Obj));
-  o->prev = obj_latest;
+#define OBJ_SIZE(last_member) (offsetof(Obj, last_member) + sizeof(((Obj*)0)->last_member))
+
+// The size of a cell with the given tag, so that small objects like cons cells and numbers take 16-24 bytes
+size_t obj_size(char tag) {
+  switch(tag) {
+  case 'C': return OBJ_SIZE(cdr);
+  case 'S': case 'Y': case 'K': return OBJ_SIZE(dispatch);
+  case 'L': case 'M': return OBJ_SIZE(uncached);
+  case 'E': return OBJ_SIZE(key_bits);
+  case 'P': return OBJ_SIZE(primop);
+  case 'F': return OBJ_SIZE(return_type);
+  case 'D': return OBJ_SIZE(dylib);
+  case 'Q': return OBJ_SIZE(void_ptr);
+  case 'W': return OBJ_SIZE(d);
+  case 'J': return OBJ_SIZE(l);
+  case 'A': return OBJ_SIZE(capacity);
+  case 'N': return OBJ_SIZE(number_tag);
+  case 'H': return OBJ_SIZE(dict_count);
+  case 'T': return OBJ_SIZE(entry_count);
+  case 'R': return OBJ_SIZE(pvec_shift);
+  case 'G': return obj_frame_size(FRAME_MAX_SLOTS);
+  case 'X': return OBJ_SIZE(ref_shape);
+  case 'B': return OBJ_SIZE(bc_constants);
+  default:
+    return sizeof(Obj);
+  }
+}
+
+// Frames are allocated with just the slots that are used
+size_t obj_frame_size(int slot_count) {
+  return offsetof(Obj, frame_slots) + sizeof(Obj*) * slot_count;
+}
+
+Obj *obj_new_sized(char tag, size_t size) {
+  Obj *o = slab_alloc(size);
   o->alive = false;
   o->given_to_ffi = false;
+  o->old = false;
+  o->remembered = false;
+  o->expanded = false;
   o->tag = tag;
-  obj_latest = o;
+  gc_track_new(o);
   obj_total++;
+  obj_allocs_total++;
   if(LOG_ALLOCS) {
-    printf("alloc %p %c\n", o, o->tag);
+    printf("alloc %p %c\n", o, obj_tag(o));
   }
   return o;
 }
 
+Obj *obj_new(char tag) {
+  return obj_new_sized(tag, obj_size(tag));
+}
+
 Obj *obj_new_cons(Obj *car, Obj *cdr) {
   Obj *o = obj_new('C');
   o->car = car;
@@ -29,14 +74,24 @@ Obj *obj_new_cons(Obj *car, Obj *cdr) {
 }
 
 Obj *obj_new_int(int i) {
-  Obj *o = obj_new('I');
-  o->i = i;
-  return o;
+  return (Obj*)(((uintptr_t)(uint32_t)i << 32) | OBJ_IMMEDIATE_INT);
 }
 
 Obj *obj_new_float(float x) {
-  Obj *o = obj_new('V');
-  o->f32 = x;
+  union { float f; uint32_t bits; } u;
+  u.f = x;
+  return (Obj*)(((uintptr_t)u.bits << 32) | OBJ_IMMEDIATE_FLOAT);
+}
+
+Obj *obj_new_double(double x) {
+  Obj *o = obj_new('W');
+  o->d = x;
+  return o;
+}
+
+Obj *obj_new_int64(int64_t x) {
+  Obj *o = obj_new('J');
+  o->l = x;
   return o;
 }
 
@@ -46,16 +101,103 @@ Obj *obj_new_string(char *s) {
   return o;
 }
 
+// Symbols and keywords are interned so that there is only ever one Obj per name.
+// The table is weak, the GC removes dead entries with obj_intern_remove() when sweeping.
+Obj **intern_table = NULL;
+int intern_table_size = 0;
+int intern_table_count = 0; // includes tombstones
+#define INTERN_TOMBSTONE ((Obj*)-1)
+
+unsigned int intern_hash(char tag, const char *s) {
+  unsigned int h = 2166136261u ^ (unsigned char)tag;
+  while(*s) {
+    h = (h ^ (unsigned char)*s++) * 16777619u;
+  }
+  return h;
+}
+
+void intern_table_grow() {
+  Obj **old_table = intern_table;
+  int old_size = intern_table_size;
+  intern_table_size = old_size ? old_size * 2 : 1024;
+  intern_table = calloc(intern_table_size, sizeof(Obj*));
+  intern_table_count = 0;
+  for(int i = 0; i < old_size; i++) {
+    Obj *o = old_table[i];
+    if(o && o != INTERN_TOMBSTONE) {
+      unsigned int j = intern_hash(obj_tag(o), o->s) & (intern_table_size - 1);
+      while(intern_table[j]) {
+        j = (j + 1) & (intern_table_size - 1);
+      }
+      intern_table[j] = o;
+      intern_table_count++;
+    }
+  }
+  free(old_table);
+}
+
+Obj *obj_intern(char tag, char *s) {
+  if(intern_table_count * 2 >= intern_table_size) {
+    intern_table_grow();
+  }
+  unsigned int mask = intern_table_size - 1;
+  unsigned int i = intern_hash(tag, s) & mask;
+  int free_slot = -1;
+  while(intern_table[i]) {
+    Obj *o = intern_table[i];
+    if(o == INTERN_TOMBSTONE) {
+      if(free_slot < 0) {
+        free_slot = i;
+      }
+    }
+    else if(obj_tag(o) == tag && strcmp(o->s, s) == 0) {
+      gc_shade(o); // the table is weak, an incremental collection might not have reached it yet
+      return o;
+    }
+    i = (i + 1) & mask;
+  }
+  Obj *o = obj_new(tag);
+  o->s = strdup(s);
+  o->dispatch = 0;
+  if(free_slot >= 0) {
+    intern_table[free_slot] = o;
+  }
+  else {
+    intern_table[i] = o;
+    intern_table_count++;
+  }
+  return o;
+}
+
+void obj_intern_remove(Obj *o) {
+  assert(obj_tag(o) == 'Y' || obj_tag(o) == 'K');
+  unsigned int mask = intern_table_size - 1;
+  unsigned int i = intern_hash(obj_tag(o), o->s) & mask;
+  while(intern_table[i]) {
+    if(intern_table[i] == o) {
+      intern_table[i] = INTERN_TOMBSTONE;
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+  printf("Failed to find %s in intern table.\n", o->s);
+  assert(false);
+}
+
 Obj *obj_new_symbol(char *s) {
+  return obj_intern('Y', s);
+}
+
+// Never the same object as a symbol from the reader, must be kept alive as long as the program runs
+Obj *obj_new_uninterned_symbol(char *s) {
   Obj *o = obj_new('Y');
   o->s = strdup(s);
+  o->dispatch = 0;
   return o;
 }
 
 Obj *obj_new_keyword(char *s) {
-  Obj *o = obj_new('K');
-  o->s = strdup(s);
-  return o;
+  return obj_intern('K', s);
 }
 
 Obj *obj_new_primop(Primop p) {
@@ -66,7 +208,7 @@ Obj *obj_new_primop(Primop p) {
 
 Obj *obj_new_dylib(void *dylib) {
   Obj *o = obj_new('D');
-  o->primop = dylib;
+  o->dylib = dylib;
   return o;
 }
 
@@ -76,13 +218,13 @@ Obj *obj_new_ptr(void *ptr) {
   return o;
 }
 
-Obj *obj_new_ffi(ffi_cif* cif, VoidFn funptr, Obj *arg_types, Obj *return_type_obj) {
-  assert(cif);
+Obj *obj_new_ffi(FfiPlan *plan, VoidFn funptr, Obj *arg_types, Obj *return_type_obj) {
+  assert(plan);
   assert(arg_types);
-  assert(arg_types->tag == 'C');
+  assert(obj_tag(arg_types) == 'C');
   assert(return_type_obj);
   Obj *o = obj_new('F');
-  o->cif = cif;
+  o->plan = plan;
   o->funptr = funptr;
   o->arg_types = arg_types;
   o->return_type = return_type_obj;
@@ -91,30 +233,38 @@ Obj *obj_new_ffi(ffi_cif* cif, VoidFn funptr, Obj *arg_types, Obj *return_type_o
 
 Obj *obj_new_lambda(Obj *params, Obj *body, Obj *env, Obj *code) {
   assert(params);
-  assert(params->tag == 'C');
+  assert(obj_tag(params) == 'C');
   assert(body);
   assert(env);
-  assert(env->tag == 'E');
+  assert(obj_tag(env) == 'E' || obj_tag(env) == 'G');
   assert(code);
   Obj *o = obj_new('L');
   o->params = params;
   o->body = body;
   o->env = env;
   o->code = code;
+  o->bytecode = NULL;
+  o->frame_size = -1;
+  o->free_frame = NULL;
+  o->uncached = false;
   return o;
 }
 
 Obj *obj_new_macro(Obj *params, Obj *body, Obj *env, Obj *code) {
   assert(params);
-  assert(params->tag == 'C');
+  assert(obj_tag(params) == 'C');
   assert(body);
   assert(env);
-  assert(env->tag == 'E');
+  assert(obj_tag(env) == 'E' || obj_tag(env) == 'G');
   Obj *o = obj_new('M');
   o->params = params;
   o->body = body;
   o->env = env;
   o->code = code;
+  o->bytecode = NULL;
+  o->frame_size = -1;
+  o->free_frame = NULL;
+  o->uncached = false;
   return o;
 }
 
@@ -123,12 +273,104 @@ Obj *obj_new_environment(Obj *parent) {
   Obj *o = obj_new('E');
   o->parent = parent;
   o->bindings = NULL;
+  o->index = NULL;
+  o->shape = 0;
+  o->key_bits = 0;
+  return o;
+}
+
+Obj *obj_new_array(int capacity) {
+  Obj *o = obj_new('A');
+  o->count = 0;
+  o->capacity = capacity > 0 ? capacity : 4;
+  o->items = malloc(sizeof(Obj*) * o->capacity);
+  return o;
+}
+
+// The items are zeroed
+Obj *obj_new_numbers(char number_tag, int count) {
+  assert(number_tag == 'I' || number_tag == 'V');
+  Obj *o = obj_new('N');
+  o->number_tag = number_tag;
+  o->number_count = count;
+  o->numbers = calloc(count > 0 ? count : 1, 4);
+  return o;
+}
+
+Obj *obj_new_dict(Obj *root, int count) {
+  Obj *o = obj_new('H');
+  o->dict_root = root;
+  o->dict_count = count;
+  return o;
+}
+
+// The entries are set to NULL, there's room for 'entry_count' key/value pairs
+Obj *obj_new_dict_node(unsigned int bitmap, int entry_count) {
+  Obj *o = obj_new('T');
+  o->bitmap = bitmap;
+  o->entry_count = entry_count;
+  o->entries = calloc(entry_count > 0 ? entry_count * 2 : 1, sizeof(Obj*));
+  return o;
+}
+
+Obj *obj_new_pvec(Obj *root, Obj *tail, int count, int shift) {
+  Obj *o = obj_new('R');
+  o->pvec_root = root;
+  o->pvec_tail = tail;
+  o->pvec_count = count;
+  o->pvec_shift = shift;
+  return o;
+}
+
+// The slots are not initialized
+Obj *obj_new_frame(Obj *parent, Obj *names, int count) {
+  assert(count >= 0 && count <= FRAME_MAX_SLOTS);
+  Obj *o = obj_new_sized('G', obj_frame_size(count));
+  o->frame_parent = parent;
+  o->frame_names = names;
+  o->frame_count = count;
+  return o;
+}
+
+Obj *obj_new_ref(Obj *symbol, int depth, int index) {
+  Obj *o = obj_new('X');
+  o->ref_symbol = symbol;
+  o->ref_binding = NULL;
+  o->ref_depth = depth;
+  o->ref_index = index;
+  o->ref_hops = 0;
+  o->ref_owner = 0;
+  o->ref_shape = 0;
   return o;
 }
 
+// Takes ownership of 'ops'
+Obj *obj_new_bytecode(int *ops, int count, Obj *constants) {
+  Obj *o = obj_new('B');
+  o->bc_ops = ops;
+  o->bc_count = count;
+  o->bc_constants = constants;
+  return o;
+}
+
+// Amortised O(1), the items are reallocated to twice the size when full
+void obj_array_push(Obj *array, Obj *o) {
+  assert(obj_tag(array) == 'A');
+  if(array->count == array->capacity) {
+    array->capacity *= 2;
+    array->items = realloc(array->items, sizeof(Obj*) * array->capacity);
+  }
+  array->items[array->count++] = o;
+  gc_write_barrier(array, o);
+}
+
+void copy_dict_entry(Obj *key, Obj *value, void *data) {
+  dict_set((Obj*)data, key, obj_copy(value));
+}
+
 Obj *obj_copy(Obj *o) {
   assert(o);
-  if(o->tag == 'C') {
+  if(obj_tag(o) == 'C') {
     //printf("Making a copy of the list: %s\n", obj_to_string(o)->s);
     Obj *list = obj_new_cons(NULL, NULL);
     Obj *prev = list;
@@ -147,47 +389,68 @@ Obj *obj_copy(Obj *o) {
     }
     return list;
   }
-  else if(o->tag == 'E') {
+  else if(obj_tag(o) == 'A') {
+    Obj *array = obj_new_array(o->count);
+    for(int i = 0; i < o->count; i++) {
+      obj_array_push(array, obj_copy(o->items[i]));
+    }
+    return array;
+  }
+  else if(obj_tag(o) == 'H') {
+    // The trie nodes are never changed but the values in them can be (nested dicts, arrays...),
+    // so the trie is rebuilt with copies of them. Values that can't change are shared by obj_copy().
+    Obj *dict = obj_new_dict(NULL, 0);
+    dict_each(o, copy_dict_entry, dict);
+    return dict;
+  }
+  else if(obj_tag(o) == 'R' || obj_tag(o) == 'X' || obj_tag(o) == 'B') {
+    return o; // can't be changed
+  }
+  else if(obj_tag(o) == 'N') {
+    Obj *numbers = obj_new_numbers(o->number_tag, o->number_count);
+    memcpy(numbers->numbers, o->numbers, o->number_count * 4);
+    return numbers;
+  }
+  else if(obj_tag(o) == 'E') {
     //printf("Making a copy of the env: %s\n", obj_to_string(o)->s);
     Obj *new_env = obj_new_environment(o->parent);
     new_env->bindings = obj_copy(o->bindings);
+    new_env->shape = o->shape;
+    new_env->key_bits = o->key_bits;
     return new_env;
   }
-  else if(o->tag == 'Q') {
+  else if(obj_tag(o) == 'Q') {
     return obj_new_ptr(o->void_ptr);
   }
-  else if(o->tag == 'I') {
-    return obj_new_int(o->i);
+  else if(obj_tag(o) == 'I' || obj_tag(o) == 'V') {
+    return o; // immediate
   }
-  else if(o->tag == 'V') {
-    return obj_new_float(o->f32);
+  else if(obj_tag(o) == 'W' || obj_tag(o) == 'J') {
+    return o; // never changed
   }
-  else if(o->tag == 'S') {
+  else if(obj_tag(o) == 'S') {
     return obj_new_string(strdup(o->s));
   }
-  else if(o->tag == 'Y') {
-    return obj_new_symbol(strdup(o->s));
-  }
-  else if(o->tag == 'K') {
-    return obj_new_keyword(strdup(o->s));
+  else if(obj_tag(o) == 'Y' || obj_tag(o) == 'K') {
+    return o; // interned
   }
-  else if(o->tag == 'P') {
+  else if(obj_tag(o) == 'P') {
     return obj_new_primop(o->primop);
   }
-  else if(o->tag == 'D') {
+  else if(obj_tag(o) == 'D') {
     return obj_new_dylib(o->dylib);
   }
-  else if(o->tag == 'F') {
-    return obj_new_ffi(o->cif, o->funptr, obj_copy(o->arg_types), obj_copy(o->return_type));
+  else if(obj_tag(o) == 'F') {
+    return o; // a copy would free the plan a second time
   }
-  else if(o->tag == 'L') {
+  else if(obj_tag(o) == 'L') {
     return o;
   }
-  else if(o->tag == 'M') {
+  else if(obj_tag(o) == 'M') {
     return o;
   }
   else {
-    printf("obj_copy() can't handle type tag %c (%d).\n", o->tag, o->tag);
+    printf("obj_copy() can't handle type tag %c (%d).\n", obj_tag(o), obj_tag(o));
     assert(false);
   }
 }
@@ -215,22 +478,31 @@ bool obj_eq(Obj *a, Obj *b) {
   else if(a == NULL || b == NULL) {
     return false;
   }
-  else if(a->tag != b->tag) {
+  else if(obj_tag(a) != obj_tag(b)) {
     return false;
   }
-  else if(a->tag == 'S' || a->tag == 'Y' || a->tag == 'K') {
+  else if(obj_tag(a) == 'Y' || obj_tag(a) == 'K') {
+    return false; // interned, so a != b means different names
+  }
+  else if(obj_tag(a) == 'S') {
     return (strcmp(a->s, b->s) == 0);
   }
-  else if(a->tag == 'Q') {
+  else if(obj_tag(a) == 'Q') {
     return a->void_ptr == b->void_ptr;
   }
-  else if(a->tag == 'I') {
-    return a->i == b->i;
+  else if(obj_tag(a) == 'I') {
+    return obj_int(a) == obj_int(b);
+  }
+  else if(obj_tag(a) == 'V') {
+    return obj_float(a) == obj_float(b);
   }
-  else if(a->tag == 'V') {
-    return a->f32 == b->f32;
+  else if(obj_tag(a) == 'W') {
+    return a->d == b->d;
   }
-  else if(a->tag == 'C') {
+  else if(obj_tag(a) == 'J') {
+    return a->l == b->l;
+  }
+  else if(obj_tag(a) == 'C') {
     Obj *pa = a;
     Obj *pb = b;
     while(1) {
@@ -254,7 +526,48 @@ bool obj_eq(Obj *a, Obj *b) {
       }
     }
   }
-  else if(a->tag == 'E') {
+  else if(obj_tag(a) == 'A') {
+    if(a->count != b->count) {
+      return false;
+    }
+    for(int i = 0; i < a->count; i++) {
+      if(!obj_eq(a->items[i], b->items[i])) {
+	return false;
+      }
+    }
+    return true;
+  }
+  else if(obj_tag(a) == 'H') {
+    if(a->dict_count != b->dict_count) {
+      return false;
+    }
+    Obj *keys = dict_keys(a);
+    for(Obj *p = keys; p && p->car; p = p->cdr) {
+      Obj *value = dict_get(b, p->car);
+      if(!value || !obj_eq(dict_get(a, p->car), value)) {
+	return false;
+      }
+    }
+    return true;
+  }
+  else if(obj_tag(a) == 'X') {
+    return a->ref_symbol == b->ref_symbol && a->ref_depth == b->ref_depth && a->ref_index == b->ref_index;
+  }
+  else if(obj_tag(a) == 'R') {
+    if(a->pvec_count != b->pvec_count) {
+      return false;
+    }
+    for(int i = 0; i < a->pvec_count; i++) {
+      if(!obj_eq(pvec_nth(a, i), pvec_nth(b, i))) {
+	return false;
+      }
+    }
+    return true;
+  }
+  else if(obj_tag(a) == 'N') {
+    return a->number_tag == b->number_tag && a->number_count == b->number_count && memcmp(a->numbers, b->numbers, a->number_count * 4) == 0;
+  }
+  else if(obj_tag(a) == 'E') {
     if(!obj_eq(a->parent, b->parent)) { return false; }
     //printf("WARNING! Can't reliably compare dicts.\n");
 
@@ -320,7 +633,7 @@ bool obj_eq(Obj *a, Obj *b) {
 
 bool is_true(Obj *o) {
   //printf("is_true? %s\n", obj_to_string(o)->s);
-  if(o == lisp_false || (o->tag == 'Y' && strcmp(o->s, "false") == 0)) {
+  if(o == lisp_false) {
     return false;
   }
   else {
@@ -332,60 +645,107 @@ void obj_print_cout(Obj *o) {
   if(!o) {
     printf("NULL");
   }
-  else if(o->tag == 'C') {
+  else if(obj_tag(o) == 'C') {
     printf("(");
     Obj *p = o;
-    while(p && p->car && p->tag == 'C') {
+    while(p && p->car && obj_tag(p) == 'C') {
       obj_print_cout(p->car);
-      if(p->cdr && p->cdr->tag == 'C' && p->cdr->cdr) {
+      if(p->cdr && obj_tag(p->cdr) == 'C' && p->cdr->cdr) {
     	printf(" ");
       }
       p = p->cdr;
     }
     printf(")");
   }
-  else if(o->tag == 'E') {
+  else if(obj_tag(o) == 'A') {
+    printf("[");
+    for(int i = 0; i < o->count; i++) {
+      obj_print_cout(o->items[i]);
+      if(i < o->count - 1) {
+	printf(" ");
+      }
+    }
+    printf("]");
+  }
+  else if(obj_tag(o) == 'H') {
     printf("{ ... }");
   }
-  else if(o->tag == 'Q') {
+  else if(obj_tag(o) == 'X') {
+    obj_print_cout(o->ref_symbol);
+  }
+  else if(obj_tag(o) == 'G') {
+    printf("{ ... }");
+  }
+  else if(obj_tag(o) == 'B') {
+    printf("<bytecode>");
+  }
+  else if(obj_tag(o) == 'R') {
+    printf("(pvec");
+    for(int i = 0; i < o->pvec_count; i++) {
+      printf(" ");
+      obj_print_cout(pvec_nth(o, i));
+    }
+    printf(")");
+  }
+  else if(obj_tag(o) == 'N') {
+    printf(o->number_tag == 'I' ? "(int-vec" : "(float-vec");
+    for(int i = 0; i < o->number_count; i++) {
+      if(o->number_tag == 'I') {
+	printf(" %d", ((int*)o->numbers)[i]);
+      } else {
+	printf(" %f", ((float*)o->numbers)[i]);
+      }
+    }
+    printf(")");
+  }
+  else if(obj_tag(o) == 'E') {
+    printf("{ ... }");
+  }
+  else if(obj_tag(o) == 'Q') {
     printf("%p", o->void_ptr);
   }
-  else if(o->tag == 'I') {
-    printf("%d", o->i);
+  else if(obj_tag(o) == 'I') {
+    printf("%d", obj_int(o));
+  }
+  else if(obj_tag(o) == 'V') {
+    printf("%f", obj_float(o));
+  }
+  else if(obj_tag(o) == 'W') {
+    printf("%s", obj_to_string(o)->s);
   }
-  else if(o->tag == 'V') {
-    printf("%f", o->f32);
+  else if(obj_tag(o) == 'J') {
+    printf("%" PRId64, o->l);
   }
-  else if(o->tag == 'S') {
+  else if(obj_tag(o) == 'S') {
     printf("\"%s\"", o->s);
   }
-  else if(o->tag == 'Y') {
+  else if(obj_tag(o) == 'Y') {
     printf("%s", o->s);
   }
-  else if(o->tag == 'K') {
+  else if(obj_tag(o) == 'K') {
     printf(":%s", o->s);
   }
-  else if(o->tag == 'P') {
+  else if(obj_tag(o) == 'P') {
     printf("<primop:%p>", o->primop);
   }
-  else if(o->tag == 'D') {
+  else if(obj_tag(o) == 'D') {
     printf("<dylib:%p>", o->dylib);
   }
-  else if(o->tag == 'F') {
+  else if(obj_tag(o) == 'F') {
     printf("<foreign>");
   }
-  else if(o->tag == 'L') {
+  else if(obj_tag(o) == 'L') {
     printf("(fn ");
     obj_print_cout(o->params);
     printf(" ");
     obj_print_cout(o->body);
     printf(")");
   }
-  else if(o->tag == 'M') {
+  else if(obj_tag(o) == 'M') {
     printf("%p", o);
   }
   else {
-    printf("obj_print_cout() can't handle type tag %c (%d).\n", o->tag, o->tag);
+    printf("obj_print_cout() can't handle type tag %c (%d).\n", obj_tag(o), obj_tag(o));
     assert(false);
   }
 }
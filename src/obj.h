@@ -6,13 +6,61 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <assert.h>
 
 typedef void (*VoidFn)(void);
 
+// How each arg and the result of a foreign function are converted, worked out once by register_ffi_internal
+typedef enum {
+  FFI_KIND_INT,
+  FFI_KIND_FLOAT,
+  FFI_KIND_STRING,
+  FFI_KIND_BOOL,
+  FFI_KIND_VOID,
+  FFI_KIND_PTR, // a 'Q' or any numeric vector
+  FFI_KIND_INT_PTR, // a 'Q', an int vector or an array
+  FFI_KIND_FLOAT_PTR, // a 'Q', a float vector or an array
+  FFI_KIND_DOUBLE,
+  FFI_KIND_INT64, // :i64 and :u64
+  FFI_KIND_CHAR,
+  FFI_KIND_STRUCT, // an array with the fields, see ffi_values.h
+  FFI_KIND_DOUBLE_PTR, // a 'Q' or an array
+  FFI_KIND_INT64_PTR, // a 'Q' or an array
+  FFI_KIND_STRUCT_PTR, // a 'Q' or an array of structs
+} FfiKind;
+
+// An unboxed arg or result of a foreign function
+typedef union {
+  int i;
+  float f;
+  void *p;
+  double d;
+  int64_t l;
+  char c;
+} FfiValue;
+
+struct FfiStruct;
+
+// Calls a function pointer as its C type, see direct_call.h
+typedef void (*FfiDirect)(VoidFn f, FfiValue *args, FfiValue *result);
+
+typedef struct {
+  ffi_cif cif;
+  ffi_type **arg_ffi_types; // malloc:ed, used by the cif
+  FfiDirect direct; // NULL when the calls go through libffi
+  struct FfiStruct **arg_structs; // malloc:ed, the struct of the args that are or point to one, NULL when there are none
+  struct FfiStruct *return_struct;
+  int scratch_size; // bytes that 'apply' needs for the struct args and result
+  int arg_count;
+  char return_kind;
+  char arg_kinds[]; // an FfiKind per arg
+} FfiPlan;
+
 /* Type tags
    C = Cons cell
-   I = Integer
+   I = Integer (immediate, see below)
    S = String
    K = Keyword (:keyword)
    Y = Symbol
@@ -22,74 +70,188 @@ typedef void (*VoidFn)(void);
    M = Macro
    F = libffi function
    D = Dylib
-   V = Float
-   W = Double (not implemented yet)
-   A = Array (not implemented yet)
+   V = Float (immediate, see below)
+   W = Double
+   J = 64 bit integer (:i64, also used for :u64)
+   A = Array (growable, contiguous items)
+   N = Numeric vector (unboxed ints or floats, see vec_ops.h)
+   H = Dictionary (persistent hash map, see dict.h)
+   T = Trie node of a dictionary (never seen from Lisp)
+   R = Persistent vector (see pvec.h)
+   G = Call frame of a lambda with a resolved body (see lexical.h)
+   X = Resolved variable reference in a lambda body (see lexical.h)
+   B = Bytecode of a lambda body (see bytecode.h)
    Q = Void pointer
 */
 
+// Lambdas with more params than this get a normal environment for their calls
+#define FRAME_MAX_SLOTS 8
+
 typedef struct Obj {
+  // Header, cells are allocated with just enough room for the header and the payload of their tag (see obj_size)
+  char tag; // Type tag (see table above), 0 for free cells
+  char alive; // GC mark
+  char given_to_ffi;
+  char old; // survived a collection, see gc.c
+  char remembered; // old object in the GC remembered set
+  char expanded; // call site of a macro with a cached expansion, see expansion.h
   union {
     // Cons cells
     struct {
       struct Obj *car;
       struct Obj *cdr;      
     };
-    // Integers
-    int i;
     // Strings, symbols and keywords
-    char *s;
+    struct {
+      char *s;
+      int dispatch; // special form id of symbols (see eval.h)
+    };
     // Lambdas / Macros
     struct {
       struct Obj *params;
       struct Obj *body;
       struct Obj *env;
       struct Obj *code;
+      struct Obj *bytecode; // 'B', compiled on the first call
+      int frame_size; // nr of slots in the frame of a call, -1 when calls get an environment
+      struct Obj *free_frame; // the frame of a finished call that nothing kept, reused by the next call
+      char uncached; // macros whose expansions must not be cached, see expansion.h
     };
     // Environment
     struct {
       struct Obj *parent;
       struct Obj *bindings;
+      struct EnvIndex *index; // hash index for big environments, see env.c
+      long shape; // the keys of the bindings, see env.h
+      uint64_t key_bits; // a bit for each key (see env_key_bit), to rule out keys without a lookup
     };
     // Primitive C function pointer f(arglist, argcount)
     struct Obj* (*primop)(struct Obj**, int);
     // Libffi function
     struct {
-      ffi_cif *cif;
+      FfiPlan *plan; // malloc:ed
       VoidFn funptr;
       struct Obj *arg_types;
       struct Obj *return_type;
     };
+    // Array
+    struct {
+      struct Obj **items; // malloc:ed, 'capacity' slots of which the first 'count' are used
+      int count;
+      int capacity;
+    };
+    // Numeric vector
+    struct {
+      void *numbers; // int32 or float32 items
+      int number_count;
+      char number_tag; // 'I' or 'V', the tag the items have when boxed
+    };
+    // Dictionary
+    struct {
+      struct Obj *dict_root; // a 'T' node, NULL when empty
+      int dict_count;
+    };
+    // Dictionary trie node
+    struct {
+      struct Obj **entries; // malloc:ed key/value pairs, a NULL key means the value is a child node
+      unsigned int bitmap; // the hash slices that have an entry, 0 for collision nodes
+      int entry_count;
+    };
+    // Persistent vector
+    struct {
+      struct Obj *pvec_root; // 'A' nodes
+      struct Obj *pvec_tail; // 'A' with the last items
+      int pvec_count;
+      int pvec_shift; // bits of the index used below the root
+    };
+    // Call frame
+    struct {
+      struct Obj *frame_parent; // the env of the lambda
+      struct Obj *frame_names; // the params of the lambda, for lookups by name
+      int frame_count;
+      struct Obj *frame_slots[FRAME_MAX_SLOTS]; // the cell only has room for 'frame_count' slots
+    };
+    // Resolved variable reference
+    struct {
+      struct Obj *ref_symbol;
+      struct Obj *ref_binding; // for globals, the binding pair in the global env once it's been looked up
+      int ref_depth; // nr of envs to go up to get to the frame, -1 for globals, REF_NAME for names (see lexical.h)
+      int ref_index; // slot in the frame, for names also the place of the binding in an env
+      int ref_hops; // for names, the nr of envs that were passed to find it
+      char ref_owner; // for names, what the cached lookup found: 'G' frame slot, 'E' binding in an env, 'g' global, 0 nothing
+      long ref_shape; // for names, the shape of the env where it was found
+    };
+    // Bytecode
+    struct {
+      int *bc_ops; // malloc:ed instructions and their operands
+      int bc_count;
+      struct Obj *bc_constants; // 'A' with the objects that the operands refer to
+    };
+    // Double
+    double d;
+    // 64 bit integer
+    int64_t l;
     // Dylib
     void *dylib;
     // Void pointer
     void *void_ptr;
-    // Float
-    float f32;
   };
-  // GC
-  struct Obj *prev;
-  char alive;
-  char given_to_ffi;
-  // Type tag (see table above)
-  char tag;
 } Obj;
 
+/* Ints and floats are never allocated, they are stored in the Obj pointer itself.
+   The low bits of the pointer tell them apart from real (8 byte aligned) objects:
+     ...01 = int, ...10 = float
+   The 32 bits of the value are kept in the upper half of the pointer.
+   Always use obj_tag(), obj_int() and obj_float() on objects that might be immediates. */
+
+#if UINTPTR_MAX < 0xFFFFFFFFFFFFFFFF
+#error "Immediate ints and floats require 64 bit pointers."
+#endif
+
+#define OBJ_IMMEDIATE_MASK 3
+#define OBJ_IMMEDIATE_INT 1
+#define OBJ_IMMEDIATE_FLOAT 2
+
+// These are macros so they stay cheap in unoptimized builds, don't pass them expressions with side effects
+#define obj_is_immediate(o) (((uintptr_t)(o) & OBJ_IMMEDIATE_MASK) != 0)
+#define obj_tag(o) (obj_is_immediate(o) ? (((uintptr_t)(o) & OBJ_IMMEDIATE_INT) ? 'I' : 'V') : (o)->tag)
+#define obj_int(o) ((int)(uint32_t)((uintptr_t)(o) >> 32))
+#define obj_float(o) (((union { uint32_t bits; float f; }){ .bits = (uint32_t)((uintptr_t)(o) >> 32) }).f)
+
 typedef Obj* (*Primop)(Obj**, int);
 
+size_t obj_size(char tag);
+size_t obj_frame_size(int slot_count);
+
 Obj *obj_new_cons(Obj *car, Obj *cdr);
 Obj *obj_new_int(int i);
 Obj *obj_new_float(float x);
+Obj *obj_new_double(double x);
+Obj *obj_new_int64(int64_t x);
 Obj *obj_new_string(char *s);
 Obj *obj_new_symbol(char *s);
+Obj *obj_new_uninterned_symbol(char *s);
 Obj *obj_new_keyword(char *s);
 Obj *obj_new_primop(Primop p);
 Obj *obj_new_dylib(void *dylib);
 Obj *obj_new_ptr(void *ptr);
-Obj *obj_new_ffi(ffi_cif* cif, VoidFn funptr, Obj *arg_types, Obj *return_type_obj);
+Obj *obj_new_ffi(FfiPlan *plan, VoidFn funptr, Obj *arg_types, Obj *return_type_obj);
 Obj *obj_new_lambda(Obj *params, Obj *body, Obj *env, Obj *code);
 Obj *obj_new_macro(Obj *params, Obj *body, Obj *env, Obj *code);
 Obj *obj_new_environment(Obj *parent);
+Obj *obj_new_array(int capacity);
+Obj *obj_new_numbers(char number_tag, int count);
+Obj *obj_new_dict(Obj *root, int count);
+Obj *obj_new_dict_node(unsigned int bitmap, int entry_count);
+Obj *obj_new_pvec(Obj *root, Obj *tail, int count, int shift);
+Obj *obj_new_frame(Obj *parent, Obj *names, int count);
+Obj *obj_new_ref(Obj *symbol, int depth, int index);
+Obj *obj_new_bytecode(int *ops, int count, Obj *constants);
+
+void obj_array_push(Obj *array, Obj *o);
+
+void obj_intern_remove(Obj *o);
+unsigned int intern_hash(char tag, const char *s);
 
 Obj *obj_copy(Obj *o);
 
@@ -101,8 +263,8 @@ bool is_true(Obj *o);
 
 void obj_print_cout(Obj *o);
 
-Obj *obj_latest;
 int obj_total;
+long obj_allocs_total; // nr of objects allocated since start
 int obj_total_max;
 
 Obj *global_env;
@@ -119,15 +281,24 @@ Obj *type_int;
 Obj *type_bool;
 Obj *type_string;
 Obj *type_list;
+Obj *type_array;
+Obj *type_int_vec;
+Obj *type_float_vec;
 Obj *type_lambda;
 Obj *type_primop;
 Obj *type_foreign;
 Obj *type_env;
+Obj *type_dict;
+Obj *type_pvec;
 Obj *type_keyword;
 Obj *type_symbol;
 Obj *type_macro;
 Obj *type_void;
 Obj *type_float;
+Obj *type_double;
+Obj *type_i64;
+Obj *type_u64;
+Obj *type_char;
 Obj *type_ptr;
 Obj *type_ref;
 
@@ -1,10 +1,12 @@
 #include "obj_string.h"
+#include "dict.h"
+#include "pvec.h"
 
 bool setting_print_lambda_body = true;
 
 void obj_string_mut_append(Obj *string_obj, const char *s2) {
   assert(string_obj);
-  assert(string_obj->tag == 'S');
+  assert(obj_tag(string_obj) == 'S');
   int string_obj_len = strlen(string_obj->s);
   int s2_len = strlen(s2);
   int total_length = (string_obj_len + s2_len);
@@ -26,23 +28,44 @@ void add_indentation(Obj *total, int indent) {
   }
 }
 
+void obj_to_string_internal(Obj *total, const Obj *o, bool prn, int indent);
+
+typedef struct {
+  Obj *total;
+  int x;
+  bool first;
+} DictPrinting;
+
+void dict_entry_to_string(Obj *key, Obj *value, void *data) {
+  DictPrinting *printing = data;
+  if(!printing->first) {
+    obj_string_mut_append(printing->total, ", \n");
+    add_indentation(printing->total, printing->x);
+  }
+  printing->first = false;
+  char *key_s = obj_to_string(key)->s;
+  obj_string_mut_append(printing->total, key_s);
+  obj_string_mut_append(printing->total, " ");
+  obj_to_string_internal(printing->total, value, true, printing->x + strlen(key_s) + 1);
+}
+
 void obj_to_string_internal(Obj *total, const Obj *o, bool prn, int indent) {
   assert(o);
   int x = indent;
-  if(o->tag == 'C') {
+  if(obj_tag(o) == 'C') {
     obj_string_mut_append(total, "(");
     x++;
     int save_x = x;
     const Obj *p = o;
     while(p && p->car) {
       obj_to_string_internal(total, p->car, true, x);
-      if(p->cdr && p->cdr->tag != 'C') {
+      if(p->cdr && obj_tag(p->cdr) != 'C') {
       	obj_string_mut_append(total, " . ");
       	obj_to_string_internal(total, o->cdr, true, x);
       	break;
       }
       else if(p->cdr && p->cdr->car) {
-	if(/* p->car->tag == 'C' ||  */p->car->tag == 'E') {
+	if(/* obj_tag(p->car) == 'C' ||  */obj_tag(p->car) == 'E' || obj_tag(p->car) == 'H') {
 	  obj_string_mut_append(total, "\n");
 	  x = save_x;
 	  add_indentation(total, x);
@@ -57,7 +80,70 @@ void obj_to_string_internal(Obj *total, const Obj *o, bool prn, int indent) {
     obj_string_mut_append(total, ")");
     x++;
   }
-  else if(o->tag == 'E') {
+  else if(obj_tag(o) == 'A') {
+    obj_string_mut_append(total, "[");
+    for(int i = 0; i < o->count; i++) {
+      obj_to_string_internal(total, o->items[i], true, x + 1);
+      if(i < o->count - 1) {
+	obj_string_mut_append(total, " ");
+      }
+    }
+    obj_string_mut_append(total, "]");
+  }
+  else if(obj_tag(o) == 'N') {
+    // Prints as the call that makes it
+    obj_string_mut_append(total, o->number_tag == 'I' ? "(int-vec" : "(float-vec");
+    for(int i = 0; i < o->number_count; i++) {
+      static char temp[64];
+      if(o->number_tag == 'I') {
+	snprintf(temp, 64, " %d", ((int*)o->numbers)[i]);
+      } else {
+	snprintf(temp, 64, " %f", ((float*)o->numbers)[i]);
+      }
+      obj_string_mut_append(total, temp);
+    }
+    obj_string_mut_append(total, ")");
+  }
+  else if(obj_tag(o) == 'R') {
+    // Prints as the call that makes it
+    obj_string_mut_append(total, "(pvec");
+    for(int i = 0; i < o->pvec_count; i++) {
+      obj_string_mut_append(total, " ");
+      obj_to_string_internal(total, pvec_nth((Obj*)o, i), true, x + 1);
+    }
+    obj_string_mut_append(total, ")");
+  }
+  else if(obj_tag(o) == 'H') {
+    obj_string_mut_append(total, "{");
+    DictPrinting printing = { total, x + 1, true };
+    dict_each((Obj*)o, dict_entry_to_string, &printing);
+    obj_string_mut_append(total, "}");
+  }
+  else if(obj_tag(o) == 'X') {
+    obj_to_string_internal(total, o->ref_symbol, prn, x);
+  }
+  else if(obj_tag(o) == 'B') {
+    obj_string_mut_append(total, "<bytecode>");
+  }
+  else if(obj_tag(o) == 'G') {
+    // Just the slots, like the bindings of an env
+    obj_string_mut_append(total, "{");
+    x++;
+    Obj *p = o->frame_names;
+    for(int i = 0; i < o->frame_count; i++) {
+      char *key_s = obj_to_string(p->car)->s;
+      obj_string_mut_append(total, key_s);
+      obj_string_mut_append(total, " ");
+      obj_to_string_internal(total, o->frame_slots[i], true, x + strlen(key_s) + 1);
+      if(i < o->frame_count - 1) {
+	obj_string_mut_append(total, ", \n");
+	add_indentation(total, x);
+      }
+      p = p->cdr;
+    }
+    obj_string_mut_append(total, "}");
+  }
+  else if(obj_tag(o) == 'E') {
     obj_string_mut_append(total, "{");
     x++;
     Obj *p = o->bindings;
@@ -79,17 +165,30 @@ void obj_to_string_internal(Obj *total, const Obj *o, bool prn, int indent) {
       obj_string_mut_append(total, parent_printout->s);
     }
   }
-  else if(o->tag == 'I') {
+  else if(obj_tag(o) == 'I') {
+    static char temp[64];
+    snprintf(temp, 64, "%d", obj_int(o));
+    obj_string_mut_append(total, temp);
+  }
+  else if(obj_tag(o) == 'V') {
     static char temp[64];
-    snprintf(temp, 64, "%d", o->i);
+    snprintf(temp, 64, "%f", obj_float(o));
+    obj_string_mut_append(total, temp);
+  }
+  else if(obj_tag(o) == 'W') {
+    static char temp[64];
+    snprintf(temp, 64, "%.15g", o->d);
+    if(strspn(temp, "-0123456789") == strlen(temp)) {
+      strcat(temp, ".0"); // so it doesn't look like an int
+    }
     obj_string_mut_append(total, temp);
   }
-  else if(o->tag == 'V') {
+  else if(obj_tag(o) == 'J') {
     static char temp[64];
-    snprintf(temp, 64, "%f", o->f32);
+    snprintf(temp, 64, "%" PRId64, o->l);
     obj_string_mut_append(total, temp);
   }
-  else if(o->tag == 'S') {
+  else if(obj_tag(o) == 'S') {
     if(prn) {
       obj_string_mut_append(total, "\"");
     }
@@ -98,42 +197,42 @@ void obj_to_string_internal(Obj *total, const Obj *o, bool prn, int indent) {
       obj_string_mut_append(total, "\"");
     }
   }
-  else if(o->tag == 'Y') {
+  else if(obj_tag(o) == 'Y') {
     obj_string_mut_append(total, o->s);
   }
-  else if(o->tag == 'K') {
+  else if(obj_tag(o) == 'K') {
     obj_string_mut_append(total, ":");
     obj_string_mut_append(total, o->s);
   }
-  else if(o->tag == 'P') {
+  else if(obj_tag(o) == 'P') {
     obj_string_mut_append(total, "<primop:");
     static char temp[256];
     snprintf(temp, 256, "%p", o->primop);
     obj_string_mut_append(total, temp);
     obj_string_mut_append(total, ">");
   }
-  else if(o->tag == 'D') {
+  else if(obj_tag(o) == 'D') {
     obj_string_mut_append(total, "<dylib:");
     static char temp[256];
     snprintf(temp, 256, "%p", o->primop);
     obj_string_mut_append(total, temp);
     obj_string_mut_append(total, ">");
   }
-  else if(o->tag == 'Q') {
+  else if(obj_tag(o) == 'Q') {
     obj_string_mut_append(total, "<ptr:");
     static char temp[256];
     snprintf(temp, 256, "%p", o->primop);
     obj_string_mut_append(total, temp);
     obj_string_mut_append(total, ">");
   }
-  else if(o->tag == 'F') {
+  else if(obj_tag(o) == 'F') {
     obj_string_mut_append(total, "<ffi:");
     static char temp[256];
     snprintf(temp, 256, "%p", o->funptr);
     obj_string_mut_append(total, temp);
     obj_string_mut_append(total, ">");
   }
-  else if(o->tag == 'L') {
+  else if(obj_tag(o) == 'L') {
     if(setting_print_lambda_body) {
       obj_string_mut_append(total, "(fn");
       obj_string_mut_append(total, " ");
@@ -146,7 +245,7 @@ void obj_to_string_internal(Obj *total, const Obj *o, bool prn, int indent) {
       obj_string_mut_append(total, "<lambda>");
     }
   }
-  else if(o->tag == 'M') {
+  else if(obj_tag(o) == 'M') {
     if(setting_print_lambda_body) {
       obj_string_mut_append(total, "(macro");
       obj_string_mut_append(total, " ");
@@ -160,7 +259,7 @@ void obj_to_string_internal(Obj *total, const Obj *o, bool prn, int indent) {
     }
   }
   else {
-    printf("obj_to_string() can't handle type tag %c (%d).\n", o->tag, o->tag);
+    printf("obj_to_string() can't handle type tag %c (%d).\n", obj_tag(o), obj_tag(o));
     assert(false);
   }
 }
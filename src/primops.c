@@ -8,6 +8,16 @@
 #include "env.h"
 #include "eval.h"
 #include "reader.h"
+#include "slab.h"
+#include "gc.h"
+#include "bytecode.h"
+#include "direct_call.h"
+#include "expansion.h"
+#include "lexical.h"
+#include "vec_ops.h"
+#include "dict.h"
+#include "pvec.h"
+#include "ffi_values.h"
 
 Obj *open_file(const char *filename) {
   assert(filename);
@@ -50,40 +60,62 @@ Obj *save_file(const char *filename, const char *contents) {
 
 Obj *p_open_file(Obj** args, int arg_count) {
   if(arg_count != 1) { return nil; }
-  if(args[0]->tag != 'S') { return nil; }
+  if(obj_tag(args[0]) != 'S') { return nil; }
   return open_file(args[0]->s);
 }
 
 Obj *p_save_file(Obj** args, int arg_count) {
   if(arg_count != 2) { return nil; }
-  if(args[0]->tag != 'S') { return nil; }
-  if(args[1]->tag != 'S') { return nil; }
+  if(obj_tag(args[0]) != 'S') { return nil; }
+  if(obj_tag(args[1]) != 'S') { return nil; }
   return save_file(args[0]->s, args[1]->s);
 }
 
 Obj *p_add(Obj** args, int arg_count) {
-  if(arg_count == 0 || args[0]->tag == 'I') {
+  if(arg_count == 0 || obj_tag(args[0]) == 'I') {
     int sum = 0;
     for(int i = 0; i < arg_count; i++) {
-      if(args[i]->tag != 'I') {
+      if(obj_tag(args[i]) != 'I') {
 	printf("Args to add must be integers.\n");
 	return nil;
       }
-      sum += args[i]->i;
+      sum += obj_int(args[i]);
     }
     return obj_new_int(sum);
   }
-  else if(args[0]->tag == 'V') {
+  else if(obj_tag(args[0]) == 'V') {
     float sum = 0;
     for(int i = 0; i < arg_count; i++) {
-      if(args[i]->tag != 'V') {
+      if(obj_tag(args[i]) != 'V') {
 	printf("Args to add must be floats.\n");
 	return nil;
       }
-      sum += args[i]->f32;
+      sum += obj_float(args[i]);
     }
     return obj_new_float(sum);
   }
+  else if(obj_tag(args[0]) == 'W') {
+    double sum = 0;
+    for(int i = 0; i < arg_count; i++) {
+      if(obj_tag(args[i]) != 'W') {
+	printf("Args to add must be doubles.\n");
+	return nil;
+      }
+      sum += args[i]->d;
+    }
+    return obj_new_double(sum);
+  }
+  else if(obj_tag(args[0]) == 'J') {
+    int64_t sum = 0;
+    for(int i = 0; i < arg_count; i++) {
+      if(obj_tag(args[i]) != 'J') {
+	printf("Args to add must be 64 bit integers.\n");
+	return nil;
+      }
+      sum += args[i]->l;
+    }
+    return obj_new_int64(sum);
+  }
   else {
     error = obj_new_string("Can't add non-numbers together.");
     return nil;
@@ -91,24 +123,46 @@ Obj *p_add(Obj** args, int arg_count) {
 }
 
 Obj *p_sub(Obj** args, int arg_count) {
-  if(arg_count == 0 || args[0]->tag == 'I') {
-    if(arg_count == 1) { return obj_new_int(-args[0]->i); }
-    int sum = args[0]->i;
+  if(arg_count == 0 || obj_tag(args[0]) == 'I') {
+    if(arg_count == 1) { return obj_new_int(-obj_int(args[0])); }
+    int sum = obj_int(args[0]);
     for(int i = 1; i < arg_count; i++) {
-      sum -= args[i]->i;
+      sum -= obj_int(args[i]);
     }
     return obj_new_int(sum);
   }
-  else if(args[0]->tag == 'V') {
+  else if(obj_tag(args[0]) == 'V') {
     if(arg_count == 1) {
-      return obj_new_int(-args[0]->f32);
+      return obj_new_int(-obj_float(args[0]));
     }
-    float sum = args[0]->f32;
+    float sum = obj_float(args[0]);
     for(int i = 1; i < arg_count; i++) {
-      sum -= args[i]->f32;
+      sum -= obj_float(args[i]);
     }
     return obj_new_float(sum);
   }
+  else if(obj_tag(args[0]) == 'W') {
+    if(arg_count == 1) {
+      return obj_new_double(-args[0]->d);
+    }
+    double sum = args[0]->d;
+    for(int i = 1; i < arg_count; i++) {
+      if(obj_tag(args[i]) != 'W') { set_error_and_return("Can't subtract a double with ", args[i]); }
+      sum -= args[i]->d;
+    }
+    return obj_new_double(sum);
+  }
+  else if(obj_tag(args[0]) == 'J') {
+    if(arg_count == 1) {
+      return obj_new_int64(-args[0]->l);
+    }
+    int64_t sum = args[0]->l;
+    for(int i = 1; i < arg_count; i++) {
+      if(obj_tag(args[i]) != 'J') { set_error_and_return("Can't subtract a 64 bit integer with ", args[i]); }
+      sum -= args[i]->l;
+    }
+    return obj_new_int64(sum);
+  }
   else {
     error = obj_new_string("Can't subtract non-numbers.");
     return nil;
@@ -120,20 +174,36 @@ Obj *p_mul(Obj** args, int arg_count) {
     return obj_new_int(1);
   }
   
-  if(args[0]->tag == 'I') {
-    int prod = args[0]->i;
+  if(obj_tag(args[0]) == 'I') {
+    int prod = obj_int(args[0]);
     for(int i = 1; i < arg_count; i++) {
-      prod *= args[i]->i;
+      prod *= obj_int(args[i]);
     }
     return obj_new_int(prod);
   }
-  else if(args[0]->tag == 'V') {
-    float prod = args[0]->f32;
+  else if(obj_tag(args[0]) == 'V') {
+    float prod = obj_float(args[0]);
     for(int i = 1; i < arg_count; i++) {
-      prod *= args[i]->f32;
+      prod *= obj_float(args[i]);
     }
     return obj_new_float(prod);
   }
+  else if(obj_tag(args[0]) == 'W') {
+    double prod = args[0]->d;
+    for(int i = 1; i < arg_count; i++) {
+      if(obj_tag(args[i]) != 'W') { set_error_and_return("Can't multiply a double with ", args[i]); }
+      prod *= args[i]->d;
+    }
+    return obj_new_double(prod);
+  }
+  else if(obj_tag(args[0]) == 'J') {
+    int64_t prod = args[0]->l;
+    for(int i = 1; i < arg_count; i++) {
+      if(obj_tag(args[i]) != 'J') { set_error_and_return("Can't multiply a 64 bit integer with ", args[i]); }
+      prod *= args[i]->l;
+    }
+    return obj_new_int64(prod);
+  }
   else {
     error = obj_new_string("Can't multiply non-numbers.");
     return nil;
@@ -145,20 +215,36 @@ Obj *p_div(Obj** args, int arg_count) {
     return obj_new_int(1);
   }
   
-  if(args[0]->tag == 'I') {
-    int prod = args[0]->i;
+  if(obj_tag(args[0]) == 'I') {
+    int prod = obj_int(args[0]);
     for(int i = 1; i < arg_count; i++) {
-      prod /= args[i]->i;
+      prod /= obj_int(args[i]);
     }
     return obj_new_int(prod);
   }
-  else if(args[0]->tag == 'V') {
-    float prod = args[0]->f32;
+  else if(obj_tag(args[0]) == 'V') {
+    float prod = obj_float(args[0]);
     for(int i = 1; i < arg_count; i++) {
-      prod /= args[i]->f32;
+      prod /= obj_float(args[i]);
     }
     return obj_new_float(prod);
   }
+  else if(obj_tag(args[0]) == 'W') {
+    double prod = args[0]->d;
+    for(int i = 1; i < arg_count; i++) {
+      if(obj_tag(args[i]) != 'W') { set_error_and_return("Can't divide a double with ", args[i]); }
+      prod /= args[i]->d;
+    }
+    return obj_new_double(prod);
+  }
+  else if(obj_tag(args[0]) == 'J') {
+    int64_t prod = args[0]->l;
+    for(int i = 1; i < arg_count; i++) {
+      if(obj_tag(args[i]) != 'J') { set_error_and_return("Can't divide a 64 bit integer with ", args[i]); }
+      prod /= args[i]->l;
+    }
+    return obj_new_int64(prod);
+  }
   else {
     error = obj_new_string("Can't divide non-numbers.");
     return nil;
@@ -169,9 +255,9 @@ Obj *p_mod(Obj** args, int arg_count) {
   if(arg_count == 0) {
     return obj_new_int(1);
   }
-  int prod = args[0]->i;
+  int prod = obj_int(args[0]);
   for(int i = 1; i < arg_count; i++) {
-    prod %= args[i]->i;
+    prod %= obj_int(args[i]);
   }
   return obj_new_int(prod);
 }
@@ -202,9 +288,255 @@ Obj *p_list(Obj** args, int arg_count) {
     }
     prev = new;
   }
+  if(!first) {
+    return obj_new_cons(NULL, NULL);
+  }
   return first;
 }
 
+Obj *p_array(Obj** args, int arg_count) {
+  Obj *array = obj_new_array(arg_count);
+  for(int i = 0; i < arg_count; i++) {
+    obj_array_push(array, args[i]);
+  }
+  return array;
+}
+
+// Adds an item at the end of the array (mutating it), returns the array
+Obj *p_array_push_bang(Obj** args, int arg_count) {
+  if(arg_count != 2) { error = obj_new_string("Wrong argument count to 'array-push!'"); return nil; }
+  if(obj_tag(args[0]) != 'A') { set_error_and_return("'array-push!' requires arg 0 to be an array: ", args[0]); }
+  obj_array_push(args[0], args[1]);
+  return args[0];
+}
+
+Obj *p_pvec(Obj** args, int arg_count) {
+  return pvec_from_items(args, arg_count);
+}
+
+// Returns a new pvec with the item added at the end
+Obj *p_pvec_push(Obj** args, int arg_count) {
+  if(arg_count != 2) { error = obj_new_string("Wrong argument count to 'pvec-push'"); return nil; }
+  if(obj_tag(args[0]) != 'R') { set_error_and_return("'pvec-push' requires arg 0 to be a pvec: ", args[0]); }
+  return pvec_push(args[0], args[1]);
+}
+
+Obj *p_list_to_pvec(Obj** args, int arg_count) {
+  if(arg_count != 1) { error = obj_new_string("Wrong argument count to 'list-to-pvec'"); return nil; }
+  if(obj_tag(args[0]) == 'A') {
+    return pvec_from_items(args[0]->items, args[0]->count);
+  }
+  if(obj_tag(args[0]) != 'C') { set_error_and_return("'list-to-pvec' requires arg 0 to be a list or array: ", args[0]); }
+  return pvec_from_list(args[0]);
+}
+
+Obj *p_pvec_to_list(Obj** args, int arg_count) {
+  if(arg_count != 1) { error = obj_new_string("Wrong argument count to 'pvec-to-list'"); return nil; }
+  if(obj_tag(args[0]) != 'R') { set_error_and_return("'pvec-to-list' requires arg 0 to be a pvec: ", args[0]); }
+  return pvec_to_list(args[0]);
+}
+
+Obj *array_index_error(char *name, Obj *array, Obj *index) {
+  error = obj_new_string("Index ");
+  obj_string_mut_append(error, obj_to_string(index)->s);
+  obj_string_mut_append(error, " out of bounds in '");
+  obj_string_mut_append(error, name);
+  obj_string_mut_append(error, "' on ");
+  obj_string_mut_append(error, obj_to_string(array)->s);
+  return nil;
+}
+
+// Numeric vectors
+
+Obj *numbers_get(Obj *v, int i) {
+  if(v->number_tag == 'I') {
+    return obj_new_int(((int*)v->numbers)[i]);
+  } else {
+    return obj_new_float(((float*)v->numbers)[i]);
+  }
+}
+
+// Ints are accepted in float vectors, returns false if 'x' has the wrong type
+bool numbers_set(Obj *v, int i, Obj *x) {
+  if(v->number_tag == 'I' && obj_tag(x) == 'I') {
+    ((int*)v->numbers)[i] = obj_int(x);
+  }
+  else if(v->number_tag == 'V' && obj_tag(x) == 'V') {
+    ((float*)v->numbers)[i] = obj_float(x);
+  }
+  else if(v->number_tag == 'V' && obj_tag(x) == 'I') {
+    ((float*)v->numbers)[i] = (float)obj_int(x);
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+Obj *numbers_from_args(char *name, char number_tag, Obj** args, int arg_count) {
+  Obj *v = obj_new_numbers(number_tag, arg_count);
+  for(int i = 0; i < arg_count; i++) {
+    if(!numbers_set(v, i, args[i])) {
+      error = obj_new_string("Wrong type of item for '");
+      obj_string_mut_append(error, name);
+      obj_string_mut_append(error, "': ");
+      obj_string_mut_append(error, obj_to_string(args[i])->s);
+      return nil;
+    }
+  }
+  return v;
+}
+
+Obj *p_int_vec(Obj** args, int arg_count) {
+  return numbers_from_args("int-vec", 'I', args, arg_count);
+}
+
+Obj *p_float_vec(Obj** args, int arg_count) {
+  return numbers_from_args("float-vec", 'V', args, arg_count);
+}
+
+// Checks that arg 0 is a numeric vector and that arg 1 (when 'other_must_match') is one with the same type and length
+bool numbers_check_args(char *name, Obj** args, int arg_count, int expected_count, bool other_must_match) {
+  if(arg_count != expected_count) {
+    error = obj_new_string("Wrong argument count to '");
+    obj_string_mut_append(error, name);
+    obj_string_mut_append(error, "'");
+    return false;
+  }
+  if(obj_tag(args[0]) != 'N') {
+    error = obj_new_string("'");
+    obj_string_mut_append(error, name);
+    obj_string_mut_append(error, "' requires arg 0 to be an int-vec or float-vec: ");
+    obj_string_mut_append(error, obj_to_string(args[0])->s);
+    return false;
+  }
+  if(other_must_match && (obj_tag(args[1]) != 'N' ||
+			  args[1]->number_tag != args[0]->number_tag ||
+			  args[1]->number_count != args[0]->number_count)) {
+    error = obj_new_string("'");
+    obj_string_mut_append(error, name);
+    obj_string_mut_append(error, "' requires arg 1 to be a vector of the same type and length as arg 0: ");
+    obj_string_mut_append(error, obj_to_string(args[1])->s);
+    return false;
+  }
+  return true;
+}
+
+// vec+ and vec*, the second arg is either a vector or a number that is used for every item
+Obj *numbers_binary_op(char *name, Obj** args, int arg_count,
+		       void (*int_op)(int*, const int*, const int*, int),
+		       void (*float_op)(float*, const float*, const float*, int),
+		       void (*int_scalar_op)(int*, const int*, int, int),
+		       void (*float_scalar_op)(float*, const float*, float, int)) {
+  bool scalar = arg_count == 2 && (obj_tag(args[1]) == 'I' || obj_tag(args[1]) == 'V');
+  if(!numbers_check_args(name, args, arg_count, 2, !scalar)) {
+    return nil;
+  }
+  Obj *a = args[0];
+  Obj *out = obj_new_numbers(a->number_tag, a->number_count);
+  if(a->number_tag == 'I') {
+    if(!scalar) {
+      int_op(out->numbers, a->numbers, args[1]->numbers, a->number_count);
+    } else if(obj_tag(args[1]) == 'I') {
+      int_scalar_op(out->numbers, a->numbers, obj_int(args[1]), a->number_count);
+    } else {
+      set_error_and_return("Can't use a float with an int-vec: ", args[1]);
+    }
+  }
+  else {
+    if(!scalar) {
+      float_op(out->numbers, a->numbers, args[1]->numbers, a->number_count);
+    } else {
+      float k = obj_tag(args[1]) == 'I' ? (float)obj_int(args[1]) : obj_float(args[1]);
+      float_scalar_op(out->numbers, a->numbers, k, a->number_count);
+    }
+  }
+  return out;
+}
+
+Obj *p_vec_add(Obj** args, int arg_count) {
+  return numbers_binary_op("vec+", args, arg_count, vec_add_ints, vec_add_floats, vec_add_int_scalar, vec_add_float_scalar);
+}
+
+Obj *p_vec_mul(Obj** args, int arg_count) {
+  return numbers_binary_op("vec*", args, arg_count, vec_mul_ints, vec_mul_floats, vec_mul_int_scalar, vec_mul_float_scalar);
+}
+
+Obj *p_vec_dot(Obj** args, int arg_count) {
+  if(!numbers_check_args("vec-dot", args, arg_count, 2, true)) {
+    return nil;
+  }
+  if(args[0]->number_tag == 'I') {
+    return obj_new_int(vec_dot_ints(args[0]->numbers, args[1]->numbers, args[0]->number_count));
+  } else {
+    return obj_new_float(vec_dot_floats(args[0]->numbers, args[1]->numbers, args[0]->number_count));
+  }
+}
+
+Obj *p_vec_sum(Obj** args, int arg_count) {
+  if(!numbers_check_args("vec-sum", args, arg_count, 1, false)) {
+    return nil;
+  }
+  if(args[0]->number_tag == 'I') {
+    return obj_new_int(vec_sum_ints(args[0]->numbers, args[0]->number_count));
+  } else {
+    return obj_new_float(vec_sum_floats(args[0]->numbers, args[0]->number_count));
+  }
+}
+
+// True if 'f' is a foreign function taking and returning a single number of the kind 'number_kind'
+bool is_unary_foreign_fn(Obj *f, FfiKind number_kind) {
+  return obj_tag(f) == 'F' && f->funptr &&
+    f->plan->arg_count == 1 && f->plan->arg_kinds[0] == number_kind && f->plan->return_kind == number_kind;
+}
+
+// Builtins like sqrtf are called directly on the raw items, other functions go through 'apply'
+Obj *p_vec_map(Obj** args, int arg_count) {
+  if(arg_count != 2) { error = obj_new_string("Wrong argument count to 'vec-map'"); return nil; }
+  Obj *f = args[0];
+  Obj *shifted[1] = { args[1] };
+  if(!numbers_check_args("vec-map", shifted, 1, 1, false)) {
+    return nil;
+  }
+  Obj *a = args[1];
+  int n = a->number_count;
+  Obj *out = obj_new_numbers(a->number_tag, n);
+  if(a->number_tag == 'V' && is_unary_foreign_fn(f, FFI_KIND_FLOAT)) {
+    float (*fn)(float) = (float (*)(float))f->funptr;
+    float *src = a->numbers;
+    float *dst = out->numbers;
+    for(int i = 0; i < n; i++) {
+      dst[i] = fn(src[i]);
+    }
+  }
+  else if(a->number_tag == 'I' && is_unary_foreign_fn(f, FFI_KIND_INT)) {
+    int (*fn)(int) = (int (*)(int))f->funptr;
+    int *src = a->numbers;
+    int *dst = out->numbers;
+    for(int i = 0; i < n; i++) {
+      dst[i] = fn(src[i]);
+    }
+  }
+  else {
+    shadow_stack_push(out);
+    for(int i = 0; i < n && i < a->number_count; i++) {
+      Obj *arg[1] = { numbers_get(a, i) };
+      apply(f, arg, 1);
+      Obj *result = stack_pop();
+      if(error) {
+	break;
+      }
+      if(!numbers_set(out, i, result)) {
+	error = obj_new_string("'vec-map' got a result of the wrong type for the vector: ");
+	obj_string_mut_append(error, obj_to_string(result)->s);
+	break;
+      }
+    }
+    shadow_stack_pop(); // out
+  }
+  return out;
+}
+
 Obj *p_str(Obj** args, int arg_count) {
   Obj *s = obj_new_string("");
   for(int i = 0; i < arg_count; i++) {
@@ -218,11 +550,11 @@ Obj *p_str_append_bang(Obj** args, int arg_count) {
     error = obj_new_string("'str-append!' takes exactly two arguments");
     return nil;
   }
-  if(args[0]->tag != 'S') {
+  if(obj_tag(args[0]) != 'S') {
     error = obj_new_string("'str-append!' arg0 invalid");
     return nil;
   }
-  if(args[1]->tag != 'S') {
+  if(obj_tag(args[1]) != 'S') {
     error = obj_new_string("'str-append!' arg1 invalid");
     return nil;
   }
@@ -315,16 +647,16 @@ Obj *p_str_replace(Obj** args, int arg_count) {
     error = obj_new_string("'str-replace' takes exactly three arguments");
     return nil;
   }
-  if(args[0]->tag != 'S') {
+  if(obj_tag(args[0]) != 'S') {
     error = obj_new_string("'str-replace' arg0 invalid: ");
     obj_string_mut_append(error, obj_to_string(args[0])->s);
     return nil;
   }
-  if(args[1]->tag != 'S') {
+  if(obj_tag(args[1]) != 'S') {
     error = obj_new_string("'str-replace' arg1 invalid");
     return nil;
   }
-  if(args[2]->tag != 'S') {
+  if(obj_tag(args[2]) != 'S') {
     error = obj_new_string("'str-replace' arg2 invalid");
     return nil;
   }
@@ -376,15 +708,15 @@ Obj *p_println(Obj** args, int arg_count) {
 
 Obj *p_system(Obj** args, int arg_count) {
   if(arg_count != 1) { printf("Wrong argument count to 'system'\n"); return nil; }
-  if(args[0]->tag != 'S') { printf("'system' takes a string as its argument\n"); return nil; }
+  if(obj_tag(args[0]) != 'S') { printf("'system' takes a string as its argument\n"); return nil; }
   system(args[0]->s);
   return obj_new_keyword("done");
 }
 
 Obj *p_get(Obj** args, int arg_count) {
   if(arg_count != 2) { printf("Wrong argument count to 'get'\n"); return nil; }
-  if(args[0]->tag == 'E') {
-    Obj *o = env_lookup(args[0], args[1]);
+  if(obj_tag(args[0]) == 'E' || obj_tag(args[0]) == 'H') {
+    Obj *o = obj_tag(args[0]) == 'H' ? dict_get(args[0], args[1]) : env_lookup(args[0], args[1]);
     if(o) {
       return o;
     } else {
@@ -397,13 +729,13 @@ Obj *p_get(Obj** args, int arg_count) {
       return nil;
     }
   }
-  else if(args[0]->tag == 'C') {
-    if(args[1]->tag != 'I') {
+  else if(obj_tag(args[0]) == 'C') {
+    if(obj_tag(args[1]) != 'I') {
       error = obj_new_string("get requires arg 1 to be an integer\n");
       return nil;
     }
     int i = 0;
-    int n = args[1]->i;
+    int n = obj_int(args[1]);
     Obj *p = args[0];
     while(p && p->car) {
       if(i == n) {
@@ -418,8 +750,30 @@ Obj *p_get(Obj** args, int arg_count) {
     obj_string_mut_append(error, obj_to_string(args[0])->s);
     return nil;
   }
+  else if(obj_tag(args[0]) == 'A') {
+    if(obj_tag(args[1]) != 'I') {
+      error = obj_new_string("get requires arg 1 to be an integer\n");
+      return nil;
+    }
+    int n = obj_int(args[1]);
+    if(n < 0 || n >= args[0]->count) {
+      return array_index_error("get", args[0], args[1]);
+    }
+    return args[0]->items[n];
+  }
+  else if(obj_tag(args[0]) == 'R') {
+    if(obj_tag(args[1]) != 'I') {
+      error = obj_new_string("get requires arg 1 to be an integer\n");
+      return nil;
+    }
+    int n = obj_int(args[1]);
+    if(n < 0 || n >= args[0]->pvec_count) {
+      return array_index_error("get", args[0], args[1]);
+    }
+    return pvec_nth(args[0], n);
+  }
   else {
-    error = obj_new_string("'get' requires arg 0 to be a dictionary or list: ");
+    error = obj_new_string("'get' requires arg 0 to be a dictionary, list or array: ");
     obj_string_mut_append(error, obj_to_string(args[0])->s);
     return nil;
   }
@@ -427,18 +781,18 @@ Obj *p_get(Obj** args, int arg_count) {
 
 Obj *p_get_maybe(Obj** args, int arg_count) {
   if(arg_count != 2) { printf("Wrong argument count to 'get-maybe'\n"); return nil; }
-  if(args[0]->tag == 'E') {
-    Obj *o = env_lookup(args[0], args[1]);
+  if(obj_tag(args[0]) == 'E' || obj_tag(args[0]) == 'H') {
+    Obj *o = obj_tag(args[0]) == 'H' ? dict_get(args[0], args[1]) : env_lookup(args[0], args[1]);
     if(o) {
       return o;
     } else {
       return nil;
     }
   }
-  else if(args[0]->tag == 'C') {
-    if(args[1]->tag != 'I') { printf("get-maybe requires arg 1 to be an integer\n"); return nil; }
+  else if(obj_tag(args[0]) == 'C') {
+    if(obj_tag(args[1]) != 'I') { printf("get-maybe requires arg 1 to be an integer\n"); return nil; }
     int i = 0;
-    int n = args[1]->i;
+    int n = obj_int(args[1]);
     Obj *p = args[0];
     while(p && p->car) {
       if(i == n) {
@@ -449,38 +803,58 @@ Obj *p_get_maybe(Obj** args, int arg_count) {
     }
     return nil;
   }
+  else if(obj_tag(args[0]) == 'A') {
+    if(obj_tag(args[1]) != 'I') { printf("get-maybe requires arg 1 to be an integer\n"); return nil; }
+    int n = obj_int(args[1]);
+    if(n < 0 || n >= args[0]->count) {
+      return nil;
+    }
+    return args[0]->items[n];
+  }
+  else if(obj_tag(args[0]) == 'R') {
+    if(obj_tag(args[1]) != 'I') { printf("get-maybe requires arg 1 to be an integer\n"); return nil; }
+    int n = obj_int(args[1]);
+    if(n < 0 || n >= args[0]->pvec_count) {
+      return nil;
+    }
+    return pvec_nth(args[0], n);
+  }
   else {
-    printf("'get-maybe' requires arg 0 to be a dictionary or list: %s\n", obj_to_string(args[0])->s);
+    printf("'get-maybe' requires arg 0 to be a dictionary, list or array: %s\n", obj_to_string(args[0])->s);
     return nil;
   }
 }
 
 Obj *p_dict_set_bang(Obj** args, int arg_count) {
   if(arg_count != 3) { printf("Wrong argument count to 'dict-set!'\n"); return nil; }
-  if(args[0]->tag == 'E') {
+  if(obj_tag(args[0]) == 'H') {
+    dict_set(args[0], args[1], args[2]);
+    return args[0];
+  }
+  else if(obj_tag(args[0]) == 'E') {
     Obj *pair = env_lookup_binding(args[0], args[1]);
     if(pair && pair->car && pair->cdr) {
       pair->cdr = args[2];
+      gc_write_barrier(pair, args[2]);
     }
     else {
       //printf("Pair not found, will add new key.\n");
-      Obj *new_pair = obj_new_cons(args[1], args[2]);
-      Obj *new_cons = obj_new_cons(new_pair, args[0]->bindings);
-      args[0]->bindings = new_cons;
+      env_extend(args[0], args[1], args[2]);
     }
     return args[0];
   }
-  else if(args[0]->tag == 'C') {
-    if(args[1]->tag != 'I') {
+  else if(obj_tag(args[0]) == 'C') {
+    if(obj_tag(args[1]) != 'I') {
       error = obj_new_string("dict-set! requires arg 1 to be an integer\n");
       return nil;
     }
     int i = 0;
-    int n = args[1]->i;
+    int n = obj_int(args[1]);
     Obj *p = args[0];
     while(p && p->car) {
       if(i == n) {
 	p->car = args[2];
+	gc_write_barrier(p, args[2]);
 	return nil;
       }
       p = p->cdr;
@@ -492,44 +866,88 @@ Obj *p_dict_set_bang(Obj** args, int arg_count) {
     obj_string_mut_append(error, obj_to_string(args[0])->s);
     return nil;
   }
+  else if(obj_tag(args[0]) == 'A') {
+    if(obj_tag(args[1]) != 'I') {
+      error = obj_new_string("dict-set! requires arg 1 to be an integer\n");
+      return nil;
+    }
+    int n = obj_int(args[1]);
+    if(n < 0 || n >= args[0]->count) {
+      return array_index_error("dict-set!", args[0], args[1]);
+    }
+    args[0]->items[n] = args[2];
+    gc_write_barrier(args[0], args[2]);
+    return nil;
+  }
+  else if(obj_tag(args[0]) == 'N') {
+    if(obj_tag(args[1]) != 'I') {
+      error = obj_new_string("dict-set! requires arg 1 to be an integer\n");
+      return nil;
+    }
+    int n = obj_int(args[1]);
+    if(n < 0 || n >= args[0]->number_count) {
+      return array_index_error("dict-set!", args[0], args[1]);
+    }
+    if(!numbers_set(args[0], n, args[2])) {
+      set_error_and_return("Wrong type of item for the vector in 'dict-set!': ", args[2]);
+    }
+    return nil;
+  }
+  else if(obj_tag(args[0]) == 'R') {
+    set_error_and_return("Can't change a pvec with 'dict-set!', use 'assoc': ", args[0]);
+  }
   else {
     printf("'dict-set!' requires arg 0 to be a dictionary: %s\n", obj_to_string(args[0])->s);
     return nil;
   }
 }
 
+// O(log n) on dictionaries and persistent vectors, that share all but the changed path with the old one.
+// Other things (lists, arrays and envs) are copied and then changed with 'dict-set!'.
+Obj *p_assoc(Obj** args, int arg_count) {
+  if(arg_count != 3) { error = obj_new_string("Wrong argument count to 'assoc'"); return nil; }
+  if(obj_tag(args[0]) == 'H') {
+    return dict_assoc(args[0], args[1], args[2]);
+  }
+  if(obj_tag(args[0]) == 'R') {
+    if(obj_tag(args[1]) != 'I') { set_error_and_return("'assoc' on a pvec requires arg 1 to be an integer: ", args[1]); }
+    int n = obj_int(args[1]);
+    if(n < 0 || n > args[0]->pvec_count) {
+      return array_index_error("assoc", args[0], args[1]);
+    }
+    return pvec_assoc(args[0], n, args[2]);
+  }
+  Obj *copy = obj_copy(args[0]);
+  Obj *set_args[3] = { copy, args[1], args[2] };
+  p_dict_set_bang(set_args, 3);
+  return copy;
+}
+
+Obj *p_dissoc(Obj** args, int arg_count) {
+  if(arg_count != 2) { error = obj_new_string("Wrong argument count to 'dissoc'"); return nil; }
+  if(obj_tag(args[0]) != 'H') { set_error_and_return("'dissoc' requires arg 0 to be a dictionary: ", args[0]); }
+  return dict_dissoc(args[0], args[1]);
+}
+
 Obj *p_dict_remove_bang(Obj** args, int arg_count) {
   if(arg_count != 2) { printf("Wrong argument count to 'dict-remove!'\n"); return nil; }
-  if(args[0]->tag != 'E') {
+  if(obj_tag(args[0]) == 'H') {
+    dict_remove(args[0], args[1]);
+    return args[0];
+  }
+  if(obj_tag(args[0]) != 'E') {
     printf("'dict-remove!' requires arg 0 to be a dictionary: %s\n", obj_to_string(args[0])->s);
     return nil;
   }
 
-  Obj *prev = NULL;
-  Obj *p = args[0]->bindings;
-  while(p && p->car) {
-    Obj *pair = p->car;
-    if(obj_eq(pair->car, args[1])) {
-      if(prev) {
-	prev->cdr = p->cdr;
-      }
-      else {
-	args[0]->bindings = p->cdr;
-      }
-      break;
-    }
-    else {
-      prev = p;
-      p = p->cdr;
-    }
-  }
+  env_remove(args[0], args[1]);
   
   return args[0];
 }
 
 Obj *p_first(Obj** args, int arg_count) {
   if(arg_count != 1) { printf("Wrong argument count to 'first'\n"); return nil; }
-  if(args[0]->tag != 'C') { printf("'first' requires arg 0 to be a list: %s\n", obj_to_string(args[0])->s); return nil; }
+  if(obj_tag(args[0]) != 'C') { printf("'first' requires arg 0 to be a list: %s\n", obj_to_string(args[0])->s); return nil; }
   if(args[0]->car == NULL) {
     printf("Can't take first element of empty list.\n");
     return nil;
@@ -539,7 +957,7 @@ Obj *p_first(Obj** args, int arg_count) {
 
 Obj *p_rest(Obj** args, int arg_count) {
   if(arg_count != 1) { printf("Wrong argument count to 'rest'\n"); return nil; }
-  if(args[0]->tag != 'C') {
+  if(obj_tag(args[0]) != 'C') {
     char buffer[512];
     snprintf(buffer, 512, "'rest' requires arg 0 to be a list: %s\n", obj_to_string(args[0])->s);
     error = obj_new_string(strdup(buffer));
@@ -554,7 +972,7 @@ Obj *p_rest(Obj** args, int arg_count) {
 
 Obj *p_cons(Obj** args, int arg_count) {
   if(arg_count != 2) { printf("Wrong argument count to 'cons'\n"); return nil; }
-  if(args[1]->tag != 'C') {
+  if(obj_tag(args[1]) != 'C') {
     char buffer[512];
     snprintf(buffer, 512, "'cons' requires arg 1 to be a list: %s\n", obj_to_string(args[0])->s);
     error = obj_new_string(strdup(buffer));
@@ -566,7 +984,7 @@ Obj *p_cons(Obj** args, int arg_count) {
 
 Obj *p_cons_last(Obj** args, int arg_count) {
   if(arg_count != 2) { printf("Wrong argument count to 'cons'\n"); return nil; }
-  if(args[0]->tag != 'C') { printf("'rest' requires arg 0 to be a list: %s\n", obj_to_string(args[1])->s); return nil; }
+  if(obj_tag(args[0]) != 'C') { printf("'rest' requires arg 0 to be a list: %s\n", obj_to_string(args[1])->s); return nil; }
   Obj *new_list = obj_copy(args[0]);
   Obj *p = new_list;
   while(p && p->cdr) { p = p->cdr; }
@@ -583,17 +1001,17 @@ Obj *p_concat(Obj** args, int arg_count) {
   }
   
   for(int i = 0; i < arg_count; i++) {
-    if(args[0]->tag != 'C') { error = obj_new_string("'concat' requires all args to be lists\n"); return nil; }
+    if(obj_tag(args[0]) != 'C') { error = obj_new_string("'concat' requires all args to be lists\n"); return nil; }
   }
 
   int i = 0;
   Obj *new = obj_copy(args[i]);
 
   while(!new->car) {
-    new = args[++i];
-    if(i >= arg_count) {
+    if(++i >= arg_count) {
       return nil;
     }
+    new = args[i];
   }
   
   Obj *last = new;
@@ -609,6 +1027,7 @@ Obj *p_concat(Obj** args, int arg_count) {
       Obj *o = args[i];
       if(o->car) {
 	last->cdr = obj_copy(o);
+	gc_write_barrier(last, last->cdr); // 'last' can be in one of the args when the first ones are empty
       }
     }
   }
@@ -617,10 +1036,31 @@ Obj *p_concat(Obj** args, int arg_count) {
 
 Obj *p_nth(Obj** args, int arg_count) {
   if(arg_count != 2) { printf("Wrong argument count to 'nth'\n"); return nil; }
-  if(args[0]->tag != 'C') { printf("'nth' requires arg 0 to be a list\n"); return nil; }
-  if(args[1]->tag != 'I') { printf("'nth' requires arg 1 to be an integer\n"); return nil; }
+  if(obj_tag(args[1]) != 'I') { printf("'nth' requires arg 1 to be an integer\n"); return nil; }
+  if(obj_tag(args[0]) == 'A') {
+    int n = obj_int(args[1]);
+    if(n < 0 || n >= args[0]->count) {
+      return array_index_error("nth", args[0], args[1]);
+    }
+    return args[0]->items[n];
+  }
+  if(obj_tag(args[0]) == 'N') {
+    int n = obj_int(args[1]);
+    if(n < 0 || n >= args[0]->number_count) {
+      return array_index_error("nth", args[0], args[1]);
+    }
+    return numbers_get(args[0], n);
+  }
+  if(obj_tag(args[0]) == 'R') {
+    int n = obj_int(args[1]);
+    if(n < 0 || n >= args[0]->pvec_count) {
+      return array_index_error("nth", args[0], args[1]);
+    }
+    return pvec_nth(args[0], n);
+  }
+  if(obj_tag(args[0]) != 'C') { printf("'nth' requires arg 0 to be a list or array\n"); return nil; }
   int i = 0;
-  int n = args[1]->i;
+  int n = obj_int(args[1]);
   Obj *p = args[0];
   while(p && p->car) {
     if(i == n) {
@@ -635,7 +1075,19 @@ Obj *p_nth(Obj** args, int arg_count) {
 
 Obj *p_count(Obj** args, int arg_count) {
   if(arg_count != 1) { printf("Wrong argument count to 'count'\n"); return nil; }
-  if(args[0]->tag != 'C') { printf("'count' requires arg 0 to be a list: %s\n", obj_to_string(args[0])->s); return nil; }
+  if(obj_tag(args[0]) == 'A') {
+    return obj_new_int(args[0]->count);
+  }
+  if(obj_tag(args[0]) == 'N') {
+    return obj_new_int(args[0]->number_count);
+  }
+  if(obj_tag(args[0]) == 'H') {
+    return obj_new_int(args[0]->dict_count);
+  }
+  if(obj_tag(args[0]) == 'R') {
+    return obj_new_int(args[0]->pvec_count);
+  }
+  if(obj_tag(args[0]) != 'C') { printf("'count' requires arg 0 to be a list or array: %s\n", obj_to_string(args[0])->s); return nil; }
   int i = 0;
   Obj *p = args[0];
   while(p && p->car) {
@@ -646,14 +1098,27 @@ Obj *p_count(Obj** args, int arg_count) {
 }
 
 bool is_callable(Obj *obj) {
-  return obj->tag == 'P' || obj->tag != 'L' || obj->tag != 'F';
+  return obj_tag(obj) == 'P' || obj_tag(obj) != 'L' || obj_tag(obj) != 'F';
 }
 
 Obj *p_map(Obj** args, int arg_count) {
   //printf("map start\n");
   if(arg_count != 2) { printf("Wrong argument count to 'map'\n"); return nil; }
   if(!is_callable(args[0])) { printf("'map' requires arg 0 to be a function or lambda: %s\n", obj_to_string(args[0])->s); return nil; }
-  if(args[1]->tag != 'C') { printf("'map' requires arg 1 to be a list\n"); return nil; }
+  if(obj_tag(args[1]) == 'A') {
+    Obj *f = args[0];
+    Obj *a = args[1];
+    Obj *array = obj_new_array(a->count);
+    shadow_stack_push(array);
+    for(int i = 0; i < a->count; i++) {
+      Obj *arg[1] = { a->items[i] };
+      apply(f, arg, 1);
+      obj_array_push(array, stack_pop());
+    }
+    shadow_stack_pop(); // array
+    return array;
+  }
+  if(obj_tag(args[1]) != 'C') { printf("'map' requires arg 1 to be a list or array\n"); return nil; }
   Obj *f = args[0];
   Obj *p = args[1];
   Obj *list = obj_new_cons(NULL, NULL);
@@ -664,10 +1129,12 @@ Obj *p_map(Obj** args, int arg_count) {
     Obj *arg[1] = { p->car };
     apply(f, arg, 1);
     prev->car = stack_pop();
+    gc_write_barrier(prev, prev->car);
     Obj *new = obj_new_cons(NULL, NULL);
     shadow_stack_push(new);
     shadow_count++;
     prev->cdr = new;
+    gc_write_barrier(prev, new);
     prev = new;
     p = p->cdr;
   }
@@ -682,8 +1149,8 @@ Obj *p_map(Obj** args, int arg_count) {
 Obj *p_map2(Obj** args, int arg_count) {
   if(arg_count != 3) { printf("Wrong argument count to 'map2'\n"); return nil; }
   if(!is_callable(args[0])) { printf("'map2' requires arg 0 to be a function or lambda: %s\n", obj_to_string(args[0])->s); return nil; }
-  if(args[1]->tag != 'C') { printf("'map2' requires arg 1 to be a list\n"); return nil; }
-  if(args[2]->tag != 'C') {
+  if(obj_tag(args[1]) != 'C') { printf("'map2' requires arg 1 to be a list\n"); return nil; }
+  if(obj_tag(args[2]) != 'C') {
     error = obj_new_string("'map2' requires arg 2 to be a list: ");
     obj_string_mut_append(error, obj_to_string(args[2])->s);
     return nil;
@@ -699,10 +1166,12 @@ Obj *p_map2(Obj** args, int arg_count) {
     Obj *argz[2] = { p->car, p2->car };
     apply(f, argz, 2);
     prev->car = stack_pop();
+    gc_write_barrier(prev, prev->car);
     Obj *new = obj_new_cons(NULL, NULL);
     shadow_stack_push(new);
     shadow_count++;
     prev->cdr = new;
+    gc_write_barrier(prev, new);
     prev = new;
     p = p->cdr;
     p2 = p2->cdr;
@@ -716,7 +1185,10 @@ Obj *p_map2(Obj** args, int arg_count) {
 
 Obj *p_keys(Obj** args, int arg_count) {
   if(arg_count != 1) { printf("Wrong argument count to 'keys'\n"); return nil; }
-  if(args[0]->tag != 'E') { printf("'keys' requires arg 0 to be a dictionary.\n"); return nil; }
+  if(obj_tag(args[0]) == 'H') {
+    return dict_keys(args[0]);
+  }
+  if(obj_tag(args[0]) != 'E') { printf("'keys' requires arg 0 to be a dictionary.\n"); return nil; }
   Obj *p = args[0]->bindings;
   Obj *list = obj_new_cons(NULL, NULL);
   Obj *prev = list; 
@@ -732,7 +1204,10 @@ Obj *p_keys(Obj** args, int arg_count) {
 
 Obj *p_values(Obj** args, int arg_count) {
   if(arg_count != 1) { printf("Wrong argument count to 'values'\n"); return nil; }
-  if(args[0]->tag != 'E') { printf("'values' requires arg 0 to be a dictionary.\n"); return nil; }
+  if(obj_tag(args[0]) == 'H') {
+    return dict_values(args[0]);
+  }
+  if(obj_tag(args[0]) != 'E') { printf("'values' requires arg 0 to be a dictionary.\n"); return nil; }
   Obj *p = args[0]->bindings;
   Obj *list = obj_new_cons(NULL, NULL);
   Obj *prev = list; 
@@ -748,7 +1223,7 @@ Obj *p_values(Obj** args, int arg_count) {
 
 Obj *p_signature(Obj** args, int arg_count) {
   if(arg_count != 1) { error = obj_new_string("Wrong argument count to 'signature'"); return nil; }
-  if(args[0]->tag != 'F') { error = obj_new_string("'signature' requires arg 0 to be a foreign function."); return nil; }
+  if(obj_tag(args[0]) != 'F') { error = obj_new_string("'signature' requires arg 0 to be a foreign function."); return nil; }
   Obj *a = obj_copy(args[0]->arg_types);
   Obj *b = args[0]->return_type;
   Obj *sig = obj_list(obj_new_keyword("arrow"), a, b);
@@ -757,7 +1232,7 @@ Obj *p_signature(Obj** args, int arg_count) {
 
 Obj *p_null_predicate(Obj** args, int arg_count) {
   if(arg_count != 1) { error = obj_new_string("Wrong argument count to 'null?'"); return nil; }
-  if(args[0]->tag != 'Q') { error = obj_new_string("Argument to 'null?' must be void pointer."); return nil; }
+  if(obj_tag(args[0]) != 'Q') { error = obj_new_string("Argument to 'null?' must be void pointer."); return nil; }
   if(args[0]->void_ptr == NULL) {
     return lisp_true;
   } else {
@@ -777,7 +1252,23 @@ Obj *p_and(Obj** args, int arg_count) {
 Obj *p_filter(Obj** args, int arg_count) {
   if(arg_count != 2) { printf("Wrong argument count to 'filter'\n"); return nil; }
   if(!is_callable(args[0])) { printf("'filter' requires arg 0 to be a function or lambda: %s\n", obj_to_string(args[0])->s); return nil; }
-  if(args[1]->tag != 'C') { printf("'filter' requires arg 1 to be a list\n"); return nil; }
+  if(obj_tag(args[1]) == 'A') {
+    Obj *f = args[0];
+    Obj *a = args[1];
+    Obj *array = obj_new_array(0);
+    shadow_stack_push(array);
+    for(int i = 0; i < a->count; i++) {
+      Obj *item = a->items[i];
+      Obj *arg[1] = { item };
+      apply(f, arg, 1);
+      if(is_true(stack_pop())) {
+	obj_array_push(array, item);
+      }
+    }
+    shadow_stack_pop(); // array
+    return array;
+  }
+  if(obj_tag(args[1]) != 'C') { printf("'filter' requires arg 1 to be a list or array\n"); return nil; }
   Obj *f = args[0];
   Obj *p = args[1];
   Obj *list = obj_new_cons(NULL, NULL);
@@ -794,6 +1285,8 @@ Obj *p_filter(Obj** args, int arg_count) {
       shadow_count++;
       prev->car = p->car;
       prev->cdr = new;
+      gc_write_barrier(prev, new);
+      gc_write_barrier(prev, p->car);
       prev = new;
     }
     p = p->cdr;
@@ -807,10 +1300,19 @@ Obj *p_filter(Obj** args, int arg_count) {
 
 Obj *p_reduce(Obj** args, int arg_count) {
   if(arg_count != 3) { printf("Wrong argument count to 'reduce'\n"); return nil; }
-  if(!is_callable(args[0])) { printf("'reduce' requires arg 0 to be a function or lambda: %s (%c)\n", obj_to_string(args[0])->s, args[0]->tag); return nil; }
-  if(args[2]->tag != 'C') { printf("'reduce' requires arg 2 to be a list\n"); return nil; }
+  if(!is_callable(args[0])) { printf("'reduce' requires arg 0 to be a function or lambda: %s (%c)\n", obj_to_string(args[0])->s, obj_tag(args[0])); return nil; }
   Obj *f = args[0];
   Obj *total = args[1];
+  if(obj_tag(args[2]) == 'A') {
+    Obj *a = args[2];
+    for(int i = 0; i < a->count; i++) {
+      Obj *args[2] = { total, a->items[i] };
+      apply(f, args, 2);
+      total = stack_pop();
+    }
+    return total;
+  }
+  if(obj_tag(args[2]) != 'C') { printf("'reduce' requires arg 2 to be a list or array\n"); return nil; }
   Obj *p = args[2]; 
   while(p && p->car) {
     Obj *args[2] = { total, p->car };
@@ -823,12 +1325,20 @@ Obj *p_reduce(Obj** args, int arg_count) {
 
 Obj *p_apply(Obj** args, int arg_count) {
   if(arg_count != 2) { printf("'apply' takes two arguments.\n"); return nil; }
-  if(args[0]->tag != 'P' && args[0]->tag != 'L') {
-    printf("'apply' requires arg 0 to be a function or lambda: %s (%c)\n", obj_to_string(args[0])->s, args[0]->tag);
+  if(obj_tag(args[0]) != 'P' && obj_tag(args[0]) != 'L') {
+    printf("'apply' requires arg 0 to be a function or lambda: %s (%c)\n", obj_to_string(args[0])->s, obj_tag(args[0]));
     return nil;
   }
-  if(args[1]->tag != 'C') {
-    printf("'apply' requires arg 1 to be a list: %s (%c)\n", obj_to_string(args[0])->s, args[0]->tag);
+  if(obj_tag(args[1]) == 'A') {
+    // Copied since the function could push to the array, which reallocates its items
+    int apply_arg_count = args[1]->count;
+    Obj *apply_args[apply_arg_count + 1]; // never zero length
+    memcpy(apply_args, args[1]->items, sizeof(Obj*) * apply_arg_count);
+    apply(args[0], apply_args, apply_arg_count);
+    return stack_pop();
+  }
+  if(obj_tag(args[1]) != 'C') {
+    printf("'apply' requires arg 1 to be a list or array: %s (%c)\n", obj_to_string(args[0])->s, obj_tag(args[0]));
     return nil;
   }
   Obj *p = args[1];
@@ -837,7 +1347,7 @@ Obj *p_apply(Obj** args, int arg_count) {
     apply_arg_count++;
     p = p->cdr;
   }
-  Obj *apply_args[apply_arg_count];
+  Obj *apply_args[apply_arg_count + 1]; // never zero length
   Obj *q = args[1];
   for(int i = 0; i < apply_arg_count; i++) {
     apply_args[i] = q->car;
@@ -849,41 +1359,59 @@ Obj *p_apply(Obj** args, int arg_count) {
 
 Obj *p_type(Obj** args, int arg_count) {
   if(arg_count != 1) { printf("'type' takes one argument.\n"); return nil; }
-  if(args[0]->tag == 'S') {
+  if(obj_tag(args[0]) == 'S') {
     return type_string;
   }
-  else if(args[0]->tag == 'I') {
+  else if(obj_tag(args[0]) == 'I') {
     return type_int;
   }
-  else if(args[0]->tag == 'V') {
+  else if(obj_tag(args[0]) == 'V') {
     return type_float;
   }
-  else if(args[0]->tag == 'C') {
+  else if(obj_tag(args[0]) == 'W') {
+    return type_double;
+  }
+  else if(obj_tag(args[0]) == 'J') {
+    return type_i64;
+  }
+  else if(obj_tag(args[0]) == 'C') {
     return type_list;
   }
-  else if(args[0]->tag == 'L') {
+  else if(obj_tag(args[0]) == 'A') {
+    return type_array;
+  }
+  else if(obj_tag(args[0]) == 'N') {
+    return args[0]->number_tag == 'I' ? type_int_vec : type_float_vec;
+  }
+  else if(obj_tag(args[0]) == 'L') {
     return type_lambda;
   }
-  else if(args[0]->tag == 'P') {
+  else if(obj_tag(args[0]) == 'P') {
     return type_primop;
   }
-  else if(args[0]->tag == 'F') {
+  else if(obj_tag(args[0]) == 'F') {
     return type_foreign;
   }
-  else if(args[0]->tag == 'E') {
+  else if(obj_tag(args[0]) == 'E') {
     return type_env;
   }
-  else if(args[0]->tag == 'Y') {
+  else if(obj_tag(args[0]) == 'H') {
+    return type_dict;
+  }
+  else if(obj_tag(args[0]) == 'R') {
+    return type_pvec;
+  }
+  else if(obj_tag(args[0]) == 'Y') {
     return type_symbol;
   }
-  else if(args[0]->tag == 'K') {
+  else if(obj_tag(args[0]) == 'K') {
     return type_keyword;
   }
-  else if(args[0]->tag == 'Q') {
+  else if(obj_tag(args[0]) == 'Q') {
     return type_ptr;
   }
   else {
-    printf("Unknown type tag: %c\n", args[0]->tag);
+    printf("Unknown type tag: %c\n", obj_tag(args[0]));
     //error = obj_new_string("Unknown type.");
     return nil;
   }
@@ -891,19 +1419,37 @@ Obj *p_type(Obj** args, int arg_count) {
 
 Obj *p_lt(Obj** args, int arg_count) {
   if(arg_count == 0) { return lisp_true; }
-  if(args[0]->tag == 'I') {
-    int smallest = args[0]->i;
+  if(obj_tag(args[0]) == 'I') {
+    int smallest = obj_int(args[0]);
+    for(int i = 1; i < arg_count; i++) {
+      if(smallest >= obj_int(args[i])) { return lisp_false; }
+      smallest = obj_int(args[i]);
+    }
+    return lisp_true;
+  }
+  else if(obj_tag(args[0]) == 'V') {
+    float smallest = obj_float(args[0]);
     for(int i = 1; i < arg_count; i++) {
-      if(smallest >= args[i]->i) { return lisp_false; }
-      smallest = args[i]->i;
+      if(smallest >= obj_float(args[i])) { return lisp_false; }
+      smallest = obj_float(args[i]);
     }
     return lisp_true;
   }
-  else if(args[0]->tag == 'V') {
-    float smallest = args[0]->f32;
+  else if(obj_tag(args[0]) == 'W') {
+    double smallest = args[0]->d;
     for(int i = 1; i < arg_count; i++) {
-      if(smallest >= args[i]->f32) { return lisp_false; }
-      smallest = args[i]->f32;
+      if(obj_tag(args[i]) != 'W') { set_error_and_return("Can't compare a double with ", args[i]); }
+      if(smallest >= args[i]->d) { return lisp_false; }
+      smallest = args[i]->d;
+    }
+    return lisp_true;
+  }
+  else if(obj_tag(args[0]) == 'J') {
+    int64_t smallest = args[0]->l;
+    for(int i = 1; i < arg_count; i++) {
+      if(obj_tag(args[i]) != 'J') { set_error_and_return("Can't compare a 64 bit integer with ", args[i]); }
+      if(smallest >= args[i]->l) { return lisp_false; }
+      smallest = args[i]->l;
     }
     return lisp_true;
   }
@@ -930,7 +1476,7 @@ Obj *p_name(Obj** args, int arg_count) {
     error = obj_new_string("Wrong arg count to 'name'.");
     return nil;
   }
-  if(args[0]->tag != 'S' && args[0]->tag != 'Y' && args[0]->tag != 'K') {
+  if(obj_tag(args[0]) != 'S' && obj_tag(args[0]) != 'Y' && obj_tag(args[0]) != 'K') {
     Obj *s = obj_new_string("Argument to 'name' must be string, keyword or symbol: ");
     obj_string_mut_append(s, obj_to_string(args[0])->s);
     error = s;
@@ -944,7 +1490,7 @@ Obj *p_symbol(Obj** args, int arg_count) {
     error = obj_new_string("Wrong arg count to 'symbol'.");
     return nil;
   }
-  if(args[0]->tag != 'S') {
+  if(obj_tag(args[0]) != 'S') {
     Obj *s = obj_new_string("Argument to 'symbol' must be string: ");
     obj_string_mut_append(s, obj_to_string(args[0])->s);
     error = s;
@@ -959,6 +1505,149 @@ Obj *p_error(Obj** args, int arg_count) {
   return nil;
 }
 
+Obj *p_alloc_stats(Obj** args, int arg_count) {
+  if(arg_count != 0) { error = obj_new_string("Wrong argument count to 'alloc-stats'"); return nil; }
+  SlabStats stats = slab_stats();
+  Obj *dict = obj_new_dict(NULL, 0);
+  dict_set(dict, obj_new_keyword("allocs"), obj_new_int(obj_allocs_total));
+  dict_set(dict, obj_new_keyword("slabs"), obj_new_int(stats.slabs));
+  dict_set(dict, obj_new_keyword("bytes"), obj_new_int(stats.bytes));
+  dict_set(dict, obj_new_keyword("cells"), obj_new_int(stats.cells));
+  dict_set(dict, obj_new_keyword("live-cells"), obj_new_int(stats.live_cells));
+  dict_set(dict, obj_new_keyword("free-cells"), obj_new_int(stats.free_cells));
+  float fragmentation = stats.cells ? (float)stats.free_cells / stats.cells : 0.0f;
+  dict_set(dict, obj_new_keyword("fragmentation"), obj_new_float(fragmentation));
+  return dict;
+}
+
+Obj *p_gc_stats(Obj** args, int arg_count) {
+  if(arg_count != 0) { error = obj_new_string("Wrong argument count to 'gc-stats'"); return nil; }
+  Obj *histogram = obj_new_cons(NULL, NULL);
+  for(int i = GC_PAUSE_BUCKETS - 1; i >= 0; i--) {
+    histogram = obj_new_cons(obj_new_int(gc_stats.pause_histogram[i]), histogram);
+  }
+  Obj *dict = obj_new_dict(NULL, 0);
+  dict_set(dict, obj_new_keyword("minor-count"), obj_new_int(gc_stats.minor_count));
+  dict_set(dict, obj_new_keyword("major-count"), obj_new_int(gc_stats.major_count));
+  dict_set(dict, obj_new_keyword("minor-pause-us"), obj_new_int64(gc_stats.minor_pause_total));
+  dict_set(dict, obj_new_keyword("major-pause-us"), obj_new_int64(gc_stats.major_pause_total));
+  dict_set(dict, obj_new_keyword("max-pause-us"), obj_new_int(gc_stats.pause_max));
+  dict_set(dict, obj_new_keyword("pause-histogram"), histogram);
+  dict_set(dict, obj_new_keyword("mark-us"), obj_new_int64(gc_stats.mark_time_total));
+  dict_set(dict, obj_new_keyword("last-mark-us"), obj_new_int(gc_stats.mark_time_last));
+  dict_set(dict, obj_new_keyword("promoted"), obj_new_int64(gc_stats.promoted_total));
+  dict_set(dict, obj_new_keyword("collections"), obj_new_int(gc_stats.minor_count + gc_stats.major_count));
+  dict_set(dict, obj_new_keyword("pause-us"), obj_new_int64(gc_stats.minor_pause_total + gc_stats.major_pause_total));
+  dict_set(dict, obj_new_keyword("bytes-freed"), obj_new_int64(gc_stats.bytes_freed_total));
+  dict_set(dict, obj_new_keyword("threshold"), obj_new_int(obj_total_max));
+  dict_set(dict, obj_new_keyword("min-heap"), obj_new_int(GC_MIN_HEAP));
+  dict_set(dict, obj_new_keyword("growth"), obj_new_float(gc_growth));
+  dict_set(dict, obj_new_keyword("budget-us"), obj_new_int(gc_pause_budget));
+  dict_set(dict, obj_new_keyword("p99-pause-us"), obj_new_int(gc_pause_percentile(99)));
+  dict_set(dict, obj_new_keyword("recent-max-pause-us"), obj_new_int(gc_pause_percentile(100)));
+  return dict;
+}
+
+Obj *p_clear_gc_pauses_bang(Obj** args, int arg_count) {
+  if(arg_count != 0) { error = obj_new_string("Wrong argument count to 'clear-gc-pauses!'"); return nil; }
+  gc_stats.recent_pause_count = 0;
+  return nil;
+}
+
+Obj *p_set_gc_budget_bang(Obj** args, int arg_count) {
+  if(arg_count != 1) { error = obj_new_string("Wrong argument count to 'set-gc-budget!'"); return nil; }
+  if(obj_tag(args[0]) != 'I' || obj_int(args[0]) < 0) {
+    error = obj_new_string("'set-gc-budget!' requires a number of microseconds (0 for no incremental collection)");
+    return nil;
+  }
+  gc_pause_budget = obj_int(args[0]);
+  return nil;
+}
+
+Obj *p_set_stack_limit_bang(Obj** args, int arg_count) {
+  if(arg_count != 1) { error = obj_new_string("Wrong argument count to 'set-stack-limit!'"); return nil; }
+  if(obj_tag(args[0]) != 'I' || obj_int(args[0]) < STACK_INITIAL_SIZE || obj_int(args[0]) > STACK_MAX_LIMIT) {
+    error = obj_new_string("'set-stack-limit!' requires a number of entries (at least 512, at most 16777216)");
+    return nil;
+  }
+  stack_set_limit(obj_int(args[0]));
+  return nil;
+}
+
+Obj *p_set_function_trace_bang(Obj** args, int arg_count) {
+  if(arg_count != 1) { error = obj_new_string("Wrong argument count to 'set-function-trace!'"); return nil; }
+  function_trace_enabled = is_true(args[0]);
+  return nil;
+}
+
+Obj *p_set_bytecode_bang(Obj** args, int arg_count) {
+  if(arg_count != 1) { error = obj_new_string("Wrong argument count to 'set-bytecode!'"); return nil; }
+  bytecode_enabled = is_true(args[0]);
+  return nil;
+}
+
+Obj *p_set_ffi_direct_bang(Obj** args, int arg_count) {
+  if(arg_count != 1) { error = obj_new_string("Wrong argument count to 'set-ffi-direct!'"); return nil; }
+  ffi_direct_enabled = is_true(args[0]);
+  return nil;
+}
+
+Obj *p_macro_stats(Obj** args, int arg_count) {
+  if(arg_count != 0) { error = obj_new_string("Wrong argument count to 'macro-stats'"); return nil; }
+  Obj *dict = obj_new_dict(NULL, 0);
+  dict_set(dict, obj_new_keyword("expansions"), obj_new_int(expansion_stats.expansions));
+  dict_set(dict, obj_new_keyword("cache-hits"), obj_new_int(expansion_stats.cache_hits));
+  dict_set(dict, obj_new_keyword("cached-forms"), obj_new_int(expansion_count()));
+  return dict;
+}
+
+Obj *p_lookup_stats(Obj** args, int arg_count) {
+  if(arg_count != 0) { error = obj_new_string("Wrong argument count to 'lookup-stats'"); return nil; }
+  Obj *dict = obj_new_dict(NULL, 0);
+  dict_set(dict, obj_new_keyword("global-hits"), obj_new_int64(lookup_stats.global_hits));
+  dict_set(dict, obj_new_keyword("global-misses"), obj_new_int64(lookup_stats.global_misses));
+  dict_set(dict, obj_new_keyword("name-hits"), obj_new_int64(lookup_stats.name_hits));
+  dict_set(dict, obj_new_keyword("name-misses"), obj_new_int64(lookup_stats.name_misses));
+  return dict;
+}
+
+// For macros that can expand the same form in different ways, e.g. with a new object each time
+Obj *p_set_macro_cached_bang(Obj** args, int arg_count) {
+  if(arg_count != 2) { error = obj_new_string("Wrong argument count to 'set-macro-cached!'"); return nil; }
+  if(obj_tag(args[0]) != 'M') {
+    set_error_and_return("First argument to 'set-macro-cached!' must be a macro: ", args[0]);
+  }
+  args[0]->uncached = !is_true(args[1]);
+  return nil;
+}
+
+Obj *p_set_gc_growth_bang(Obj** args, int arg_count) {
+  if(arg_count != 1) { error = obj_new_string("Wrong argument count to 'set-gc-growth!'"); return nil; }
+  float growth;
+  if(obj_tag(args[0]) == 'V') {
+    growth = obj_float(args[0]);
+  }
+  else if(obj_tag(args[0]) == 'I') {
+    growth = obj_int(args[0]);
+  }
+  else {
+    error = obj_new_string("'set-gc-growth!' requires a number");
+    return nil;
+  }
+  if(growth <= 1.0f) {
+    error = obj_new_string("The GC growth factor must be above 1");
+    return nil;
+  }
+  gc_growth = growth;
+  return nil;
+}
+
+Obj *p_gc(Obj** args, int arg_count) {
+  if(arg_count != 0) { error = obj_new_string("Wrong argument count to 'gc'"); return nil; }
+  gc(global_env);
+  return nil;
+}
+
 Obj *p_env(Obj** args, int arg_count) {
   return global_env;
 }
@@ -966,7 +1655,7 @@ Obj *p_env(Obj** args, int arg_count) {
 Obj *p_load_lisp(Obj** args, int arg_count) {
   Obj *file_string = open_file(args[0]->s);
   shadow_stack_push(file_string);
-  if(file_string->tag == 'S') {
+  if(obj_tag(file_string) == 'S') {
     Obj *forms = read_string(global_env, file_string->s);
     shadow_stack_push(forms);
     Obj *form = forms;
@@ -999,8 +1688,8 @@ Obj *p_load_dylib(Obj** args, int arg_count) {
 
 Obj *p_unload_dylib(Obj** args, int arg_count) {
   //assert_or_return_nil(arg_count == 1, "'unload-dylib' must take one argument.");
-  //assert_or_return_nil(args[0]->tag, "'unload-dylib' must take dylib as argument.", args[0]);
-  if (!(args[0]->tag == 'D')) {
+  //assert_or_return_nil(obj_tag(args[0]), "'unload-dylib' must take dylib as argument.", args[0]);
+  if (!(obj_tag(args[0]) == 'D')) {
     set_error_and_return("unload-dylib takes a dylib as argument: ", args[0]);
     return nil;
   }
@@ -1021,7 +1710,7 @@ Obj *p_unload_dylib(Obj** args, int arg_count) {
 
 Obj *p_read(Obj** args, int arg_count) {
   //assert_or_return_nil(args[0], "No argument to 'read'.", args[0]);
-  //assert_or_return_nil(args[0]->tag == 'S', "'read' must take a string as an argument.", args[0]);
+  //assert_or_return_nil(obj_tag(args[0]) == 'S', "'read' must take a string as an argument.", args[0]);
   Obj *forms = read_string(global_env, args[0]->s);
   return forms->car;
 }
@@ -1039,7 +1728,7 @@ Obj *p_eval(Obj** args, int arg_count) {
 }
 
 Obj *p_code(Obj** args, int arg_count) {  
-  if(args[0]->tag != 'L' && args[0]->tag != 'M') {
+  if(obj_tag(args[0]) != 'L' && obj_tag(args[0]) != 'M') {
     set_error_and_return("'code' must take lambda/macro as argument: ", args[0]);
   }
   if(!args[0]->code) {
@@ -1052,7 +1741,7 @@ Obj *p_code(Obj** args, int arg_count) {
 ffi_type *lisp_type_to_ffi_type(Obj *type_obj) {
   
   // Is it a ref type? (borrowed)
-  if(type_obj->tag == 'C' && type_obj->car && type_obj->cdr && type_obj->cdr->car && obj_eq(type_obj->car, type_ref)) {
+  if(obj_tag(type_obj) == 'C' && type_obj->car && type_obj->cdr && type_obj->cdr->car && obj_eq(type_obj->car, type_ref)) {
     type_obj = type_obj->cdr->car; // the second element of the list
     //printf("Found ref type, inner type is: %s\n", obj_to_string(type_obj)->s);
   }
@@ -1061,20 +1750,35 @@ ffi_type *lisp_type_to_ffi_type(Obj *type_obj) {
     return &ffi_type_pointer;
   }
   else if(obj_eq(type_obj, type_int)) {
-    return &ffi_type_uint;
+    return &ffi_type_sint;
   }
   else if(obj_eq(type_obj, type_float)) {
     return &ffi_type_float;
   }
+  else if(obj_eq(type_obj, type_double)) {
+    return &ffi_type_double;
+  }
+  else if(obj_eq(type_obj, type_i64)) {
+    return &ffi_type_sint64;
+  }
+  else if(obj_eq(type_obj, type_u64)) {
+    return &ffi_type_uint64;
+  }
+  else if(obj_eq(type_obj, type_char)) {
+    return &ffi_type_schar;
+  }
   else if(obj_eq(type_obj, type_void)) {
-    return &ffi_type_uint;
+    return &ffi_type_void;
   }
   else if(obj_eq(type_obj, type_bool)) {
-    return &ffi_type_uint;
+    return &ffi_type_uint8;
   }
-  else if(type_obj->tag == 'C' && obj_eq(type_obj->car, type_ptr)) {
+  else if(obj_tag(type_obj) == 'C' && obj_eq(type_obj->car, type_ptr)) {
     return &ffi_type_pointer;
   }
+  else if(ffi_struct_find(type_obj)) {
+    return &ffi_struct_find(type_obj)->type;
+  }
   else {
     error = obj_new_string("Unhandled return type for foreign function: ");
     obj_string_mut_append(error, obj_to_string(type_obj)->s);
@@ -1082,6 +1786,70 @@ ffi_type *lisp_type_to_ffi_type(Obj *type_obj) {
   }
 }
 
+// For types that lisp_type_to_ffi_type() accepts
+FfiKind lisp_type_to_ffi_kind(Obj *type_obj) {
+  if(obj_tag(type_obj) == 'C' && type_obj->car && type_obj->cdr && type_obj->cdr->car && obj_eq(type_obj->car, type_ref)) {
+    type_obj = type_obj->cdr->car;
+  }
+  if(obj_eq(type_obj, type_string)) {
+    return FFI_KIND_STRING;
+  }
+  else if(obj_eq(type_obj, type_int)) {
+    return FFI_KIND_INT;
+  }
+  else if(obj_eq(type_obj, type_float)) {
+    return FFI_KIND_FLOAT;
+  }
+  else if(obj_eq(type_obj, type_void)) {
+    return FFI_KIND_VOID;
+  }
+  else if(obj_eq(type_obj, type_bool)) {
+    return FFI_KIND_BOOL;
+  }
+  else if(obj_eq(type_obj, type_double)) {
+    return FFI_KIND_DOUBLE;
+  }
+  else if(obj_eq(type_obj, type_i64) || obj_eq(type_obj, type_u64)) {
+    return FFI_KIND_INT64;
+  }
+  else if(obj_eq(type_obj, type_char)) {
+    return FFI_KIND_CHAR;
+  }
+  else if(obj_tag(type_obj) != 'C') {
+    return FFI_KIND_STRUCT;
+  }
+  else {
+    Obj *pointee = type_obj->cdr ? type_obj->cdr->car : NULL;
+    if(!pointee) {
+      return FFI_KIND_PTR;
+    }
+    else if(obj_eq(pointee, type_int)) {
+      return FFI_KIND_INT_PTR;
+    }
+    else if(obj_eq(pointee, type_float)) {
+      return FFI_KIND_FLOAT_PTR;
+    }
+    else if(obj_eq(pointee, type_double)) {
+      return FFI_KIND_DOUBLE_PTR;
+    }
+    else if(obj_eq(pointee, type_i64) || obj_eq(pointee, type_u64)) {
+      return FFI_KIND_INT64_PTR;
+    }
+    else if(ffi_struct_find(pointee)) {
+      return FFI_KIND_STRUCT_PTR;
+    }
+    return FFI_KIND_PTR;
+  }
+}
+
+// The struct of a struct type or a pointer to one, for types that lisp_type_to_ffi_type() accepts
+FfiStruct *lisp_type_to_ffi_struct(Obj *type_obj) {
+  while(obj_tag(type_obj) == 'C' && type_obj->car && type_obj->cdr && type_obj->cdr->car) {
+    type_obj = type_obj->cdr->car; // (:ref x) or (:ptr x)
+  }
+  return ffi_struct_find(type_obj);
+}
+
 char *lispify(char *name) {
   char *s0 = str_replace(name, "_", "-");
   char *s1 = str_replace(s0, "BANG", "!");
@@ -1106,7 +1874,12 @@ Obj *register_ffi_internal(char *name, VoidFn funptr, Obj *args, Obj *return_typ
   }
   //printf("Arg count for %s: %d\n", name, arg_count);
   
-  ffi_type **arg_types_c_array = malloc(sizeof(ffi_type) * (arg_count + 1));
+  ffi_type **arg_types_c_array = malloc(sizeof(ffi_type*) * (arg_count + 1));
+  FfiPlan *plan = malloc(sizeof(FfiPlan) + arg_count);
+  plan->arg_ffi_types = arg_types_c_array;
+  plan->arg_structs = NULL;
+  plan->scratch_size = 0;
+  plan->arg_count = arg_count;
 
   p = args;
   for(int i = 0; i < arg_count; i++) {
@@ -1115,9 +1888,22 @@ Obj *register_ffi_internal(char *name, VoidFn funptr, Obj *args, Obj *return_typ
       char buffer[512];
       snprintf(buffer, 512, "Arg %d for function %s has invalid type: %s\n", i, name, obj_to_string(p->car)->s);
       error = obj_new_string(strdup(buffer));
+      free(arg_types_c_array);
+      free(plan->arg_structs);
+      free(plan);
       return nil;
     }
     arg_types_c_array[i] = arg_type;
+    plan->arg_kinds[i] = lisp_type_to_ffi_kind(p->car);
+    if(plan->arg_kinds[i] == FFI_KIND_STRUCT || plan->arg_kinds[i] == FFI_KIND_STRUCT_PTR) {
+      if(!plan->arg_structs) {
+	plan->arg_structs = calloc(arg_count, sizeof(FfiStruct*));
+      }
+      plan->arg_structs[i] = lisp_type_to_ffi_struct(p->car);
+      if(plan->arg_kinds[i] == FFI_KIND_STRUCT) {
+	plan->scratch_size += (arg_type->size + 15) / 16 * 16;
+      }
+    }
     p = p->cdr;
   }
   arg_types_c_array[arg_count] = NULL; // ends with a NULL so we don't need to store arg_count
@@ -1125,11 +1911,21 @@ Obj *register_ffi_internal(char *name, VoidFn funptr, Obj *args, Obj *return_typ
   ffi_type *return_type = lisp_type_to_ffi_type(return_type_obj);
 
   if(!return_type) {
+    free(arg_types_c_array);
+    free(plan->arg_structs);
+    free(plan);
     return nil;
   }
+  plan->return_kind = lisp_type_to_ffi_kind(return_type_obj);
+  plan->return_struct = plan->return_kind == FFI_KIND_STRUCT ? lisp_type_to_ffi_struct(return_type_obj) : NULL;
+  if(plan->return_struct) {
+    // libffi writes at least a full ffi_arg
+    size_t size = return_type->size > sizeof(ffi_arg) ? return_type->size : sizeof(ffi_arg);
+    plan->scratch_size += (size + 15) / 16 * 16;
+  }
+  plan->direct = direct_call_find(plan);
 
-  ffi_cif *cif = malloc(sizeof(ffi_cif));
-  int init_result = ffi_prep_cif(cif,
+  int init_result = ffi_prep_cif(&plan->cif,
 				 FFI_DEFAULT_ABI,
 				 arg_count,
 				 return_type,
@@ -1137,17 +1933,21 @@ Obj *register_ffi_internal(char *name, VoidFn funptr, Obj *args, Obj *return_typ
   
   if (init_result != FFI_OK) {
     printf("Registration of foreign function %s failed.\n", name);
+    free(arg_types_c_array);
+    free(plan->arg_structs);
+    free(plan);
     return nil;
   }
 
   //printf("Registration of '%s' OK.\n", name);
   
-  Obj *ffi = obj_new_ffi(cif, funptr, args, return_type_obj);
+  Obj *ffi = obj_new_ffi(plan, funptr, args, return_type_obj);
 
   char *lispified_name = lispify(name);
   //printf("Registering %s\n", lispified_name);
   
   global_env_extend(obj_new_symbol(lispified_name), ffi);
+  free(lispified_name); // the symbol is interned with its own copy of the name
 
   return ffi;
 }
@@ -1173,16 +1973,17 @@ Obj *register_ffi_variable_internal(char *name, void *varptr, Obj *var_type_obj)
   char *lispified_name = lispify(name);
   //printf("Registering variable %s\n", lispified_name);  
   global_env_extend(obj_new_symbol(lispified_name), new_variable_value);
+  free(lispified_name); // the symbol is interned with its own copy of the name
 
   return new_variable_value;
 }
 
 // (register <dylib> <function-name> <arg-types> <return-type>)
 Obj *p_register(Obj** args, int arg_count) {
-  if(arg_count != 4 || args[0]->tag != 'D' || args[1]->tag != 'S' || args[2]->tag != 'C') {
+  if(arg_count != 4 || obj_tag(args[0]) != 'D' || obj_tag(args[1]) != 'S' || obj_tag(args[2]) != 'C') {
     printf("Args to register must be: (handle, function-name, argument-types, return-type)");
     printf("Arg count: %d\n", arg_count);
-    printf("Args %c %c %c %c\n", args[0]->tag, args[1]->tag, args[2]->tag, args[3]->tag);
+    printf("Args %c %c %c %c\n", obj_tag(args[0]), obj_tag(args[1]), obj_tag(args[2]), obj_tag(args[3]));
     return nil;
   }
   void *handle = args[0]->dylib;
@@ -1199,10 +2000,10 @@ Obj *p_register(Obj** args, int arg_count) {
 }
 
 Obj *p_register_variable(Obj** args, int arg_count) {
-  if(arg_count != 3 || args[0]->tag != 'D' || args[1]->tag != 'S') {
+  if(arg_count != 3 || obj_tag(args[0]) != 'D' || obj_tag(args[1]) != 'S') {
     printf("Args to register-variable must be: (handle, variable-name, type)");
     printf("Arg count: %d\n", arg_count);
-    printf("Args %c %c %c\n", args[0]->tag, args[1]->tag, args[2]->tag);
+    printf("Args %c %c %c\n", obj_tag(args[0]), obj_tag(args[1]), obj_tag(args[2]));
     return nil;
   }
   
@@ -1220,10 +2021,10 @@ Obj *p_register_variable(Obj** args, int arg_count) {
 }
 
 Obj *p_register_builtin(Obj** args, int arg_count) {
-  if(arg_count != 3 || args[0]->tag != 'S' || args[1]->tag != 'C') {
+  if(arg_count != 3 || obj_tag(args[0]) != 'S' || obj_tag(args[1]) != 'C') {
     printf("Args to register-builtin must be: (function-name, argument-types, return-type)\n");
     printf("Arg count: %d\n", arg_count);
-    printf("Args %c %c %c\n", args[0]->tag, args[1]->tag, args[2]->tag);
+    printf("Args %c %c %c\n", obj_tag(args[0]), obj_tag(args[1]), obj_tag(args[2]));
     return nil;
   }
   char *name = args[0]->s;
@@ -1237,3 +2038,15 @@ Obj *p_register_builtin(Obj** args, int arg_count) {
   return register_ffi_internal(name, f, args[1], args[2]);
 }
 
+
+// (register-struct :Vec2 '(:float :float)), see ffi_values.h
+Obj *p_register_struct(Obj** args, int arg_count) {
+  if(arg_count != 2 || obj_tag(args[0]) != 'K' || obj_tag(args[1]) != 'C') {
+    error = obj_new_string("Args to register-struct must be: (struct-name-keyword, field-types)");
+    return nil;
+  }
+  if(!ffi_struct_register(args[0]->s, args[1])) {
+    return nil;
+  }
+  return args[0];
+}
@@ -5,6 +5,9 @@
 #define define(name, value) env_extend(global_env, obj_new_symbol(name), value);
 #define register_primop(name, primop) env_extend(global_env, obj_new_symbol(name), obj_new_primop(primop));
 
+// The args of a primop are read in place from the value stack (they stay there as GC roots while it runs).
+// The stack never moves, so they can still be read after the primop has called 'apply' or 'eval_internal'.
+
 Obj *p_open_file(Obj** args, int arg_count);
 Obj *p_save_file(Obj** args, int arg_count);
 Obj *p_add(Obj** args, int arg_count);
@@ -14,6 +17,19 @@ Obj *p_div(Obj** args, int arg_count);
 Obj *p_mod(Obj** args, int arg_count);
 Obj *p_eq(Obj** args, int arg_count);
 Obj *p_list(Obj** args, int arg_count);
+Obj *p_array(Obj** args, int arg_count);
+Obj *p_array_push_bang(Obj** args, int arg_count);
+Obj *p_pvec(Obj** args, int arg_count);
+Obj *p_pvec_push(Obj** args, int arg_count);
+Obj *p_list_to_pvec(Obj** args, int arg_count);
+Obj *p_pvec_to_list(Obj** args, int arg_count);
+Obj *p_int_vec(Obj** args, int arg_count);
+Obj *p_float_vec(Obj** args, int arg_count);
+Obj *p_vec_add(Obj** args, int arg_count);
+Obj *p_vec_mul(Obj** args, int arg_count);
+Obj *p_vec_dot(Obj** args, int arg_count);
+Obj *p_vec_sum(Obj** args, int arg_count);
+Obj *p_vec_map(Obj** args, int arg_count);
 Obj *p_str(Obj** args, int arg_count);
 Obj *p_str_append_bang(Obj** args, int arg_count);
 Obj *p_str_replace(Obj** args, int arg_count);
@@ -26,6 +42,8 @@ Obj *p_get(Obj** args, int arg_count);
 Obj *p_get_maybe(Obj** args, int arg_count);
 Obj *p_dict_set_bang(Obj** args, int arg_count);
 Obj *p_dict_remove_bang(Obj** args, int arg_count);
+Obj *p_assoc(Obj** args, int arg_count);
+Obj *p_dissoc(Obj** args, int arg_count);
 Obj *p_rest(Obj** args, int arg_count);
 Obj *p_cons(Obj** args, int arg_count);
 Obj *p_cons_last(Obj** args, int arg_count);
@@ -37,6 +55,7 @@ Obj *p_map2(Obj** args, int arg_count);
 Obj *p_register(Obj** args, int arg_count);
 Obj *p_register_variable(Obj** args, int arg_count);
 Obj *p_register_builtin(Obj** args, int arg_count);
+Obj *p_register_struct(Obj** args, int arg_count);
 Obj *p_first(Obj** args, int arg_count);
 Obj *p_filter(Obj** args, int arg_count);
 Obj *p_reduce(Obj** args, int arg_count);
@@ -44,6 +63,19 @@ Obj *p_apply(Obj** args, int arg_count);
 Obj *p_type(Obj** args, int arg_count);
 Obj *p_lt(Obj** args, int arg_count);
 Obj *p_env(Obj** args, int arg_count);
+Obj *p_alloc_stats(Obj** args, int arg_count);
+Obj *p_gc(Obj** args, int arg_count);
+Obj *p_gc_stats(Obj** args, int arg_count);
+Obj *p_set_gc_growth_bang(Obj** args, int arg_count);
+Obj *p_set_gc_budget_bang(Obj** args, int arg_count);
+Obj *p_set_stack_limit_bang(Obj** args, int arg_count);
+Obj *p_set_function_trace_bang(Obj** args, int arg_count);
+Obj *p_set_bytecode_bang(Obj** args, int arg_count);
+Obj *p_set_ffi_direct_bang(Obj** args, int arg_count);
+Obj *p_macro_stats(Obj** args, int arg_count);
+Obj *p_lookup_stats(Obj** args, int arg_count);
+Obj *p_set_macro_cached_bang(Obj** args, int arg_count);
+Obj *p_clear_gc_pauses_bang(Obj** args, int arg_count);
 Obj *p_load_lisp(Obj** args, int arg_count);
 Obj *p_load_dylib(Obj** args, int arg_count);
 Obj *p_unload_dylib(Obj** args, int arg_count);
@@ -61,3 +93,7 @@ Obj *p_eval(Obj** args, int arg_count);
 Obj *p_and(Obj** args, int arg_count);
 
 Obj *register_ffi_internal(char *name, VoidFn funptr, Obj *args, Obj *return_type_obj);
+
+// NULL (with 'error' set) for types that can't be given to foreign functions
+ffi_type *lisp_type_to_ffi_type(Obj *type_obj);
+FfiKind lisp_type_to_ffi_kind(Obj *type_obj);
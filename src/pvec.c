@@ -0,0 +1,189 @@
+#include "pvec.h"
+#include "gc.h"
+
+#define PVEC_BITS 5
+#define PVEC_WIDTH (1 << PVEC_BITS)
+#define PVEC_MASK (PVEC_WIDTH - 1)
+
+// The index of the first item in the tail
+int pvec_tail_offset(int count) {
+  return count < PVEC_WIDTH ? 0 : ((count - 1) >> PVEC_BITS) << PVEC_BITS;
+}
+
+// A copy of the node with room for one more item
+Obj *pvec_node_copy(Obj *node) {
+  Obj *copy = obj_new_array(node->count + 1);
+  memcpy(copy->items, node->items, sizeof(Obj*) * node->count);
+  copy->count = node->count;
+  return copy;
+}
+
+// Sets or (when i is the count) appends, the node must be a fresh copy
+void pvec_node_put(Obj *node, int i, Obj *o) {
+  if(i == node->count) {
+    obj_array_push(node, o);
+  }
+  else {
+    node->items[i] = o;
+  }
+}
+
+// The leaf array that holds item 'i'
+Obj *pvec_leaf(Obj *pvec, int i) {
+  if(i >= pvec_tail_offset(pvec->pvec_count)) {
+    return pvec->pvec_tail;
+  }
+  Obj *node = pvec->pvec_root;
+  for(int level = pvec->pvec_shift; level > 0; level -= PVEC_BITS) {
+    node = node->items[(i >> level) & PVEC_MASK];
+  }
+  return node;
+}
+
+Obj *pvec_nth(Obj *pvec, int i) {
+  assert(obj_tag(pvec) == 'R');
+  assert(i >= 0 && i < pvec->pvec_count);
+  return pvec_leaf(pvec, i)->items[i & PVEC_MASK];
+}
+
+// A chain of single child nodes down to 'node'
+Obj *pvec_new_path(int level, Obj *node) {
+  for(; level > 0; level -= PVEC_BITS) {
+    Obj *parent = obj_new_array(1);
+    obj_array_push(parent, node);
+    node = parent;
+  }
+  return node;
+}
+
+// A copy of 'parent' with the full tail of a vector with 'count' items added as its last leaf
+Obj *pvec_push_tail(int count, int level, Obj *parent, Obj *tail) {
+  int sub = ((count - 1) >> level) & PVEC_MASK;
+  Obj *node = pvec_node_copy(parent);
+  Obj *child;
+  if(level == PVEC_BITS) {
+    child = tail;
+  }
+  else if(sub < parent->count) {
+    child = pvec_push_tail(count, level - PVEC_BITS, parent->items[sub], tail);
+  }
+  else {
+    child = pvec_new_path(level - PVEC_BITS, tail);
+  }
+  pvec_node_put(node, sub, child);
+  return node;
+}
+
+// The root and shift after moving the full tail into the trie
+void pvec_grow_root(Obj *pvec, Obj **root, int *shift) {
+  int count = pvec->pvec_count;
+  *shift = pvec->pvec_shift;
+  if((count >> PVEC_BITS) > (1 << *shift)) {
+    // The trie is full, add a level
+    *root = obj_new_array(2);
+    obj_array_push(*root, pvec->pvec_root);
+    obj_array_push(*root, pvec_new_path(*shift, pvec->pvec_tail));
+    *shift += PVEC_BITS;
+  }
+  else {
+    *root = pvec_push_tail(count, *shift, pvec->pvec_root, pvec->pvec_tail);
+  }
+}
+
+Obj *pvec_push(Obj *pvec, Obj *o) {
+  assert(obj_tag(pvec) == 'R');
+  int count = pvec->pvec_count;
+  if(count - pvec_tail_offset(count) < PVEC_WIDTH) {
+    Obj *tail = pvec_node_copy(pvec->pvec_tail);
+    obj_array_push(tail, o);
+    return obj_new_pvec(pvec->pvec_root, tail, count + 1, pvec->pvec_shift);
+  }
+  Obj *root;
+  int shift;
+  pvec_grow_root(pvec, &root, &shift);
+  Obj *tail = obj_new_array(1);
+  obj_array_push(tail, o);
+  return obj_new_pvec(root, tail, count + 1, shift);
+}
+
+void pvec_push_bang(Obj *pvec, Obj *o) {
+  assert(obj_tag(pvec) == 'R');
+  int count = pvec->pvec_count;
+  if(count - pvec_tail_offset(count) == PVEC_WIDTH) {
+    Obj *root;
+    int shift;
+    pvec_grow_root(pvec, &root, &shift);
+    pvec->pvec_root = root;
+    pvec->pvec_shift = shift;
+    pvec->pvec_tail = obj_new_array(PVEC_WIDTH);
+    gc_write_barrier(pvec, root);
+    gc_write_barrier(pvec, pvec->pvec_tail);
+  }
+  // The tail is still only in this vector
+  obj_array_push(pvec->pvec_tail, o);
+  pvec->pvec_count++;
+}
+
+Obj *pvec_node_assoc(int level, Obj *node, int i, Obj *o) {
+  Obj *copy = pvec_node_copy(node);
+  if(level == 0) {
+    copy->items[i & PVEC_MASK] = o;
+  }
+  else {
+    int sub = (i >> level) & PVEC_MASK;
+    copy->items[sub] = pvec_node_assoc(level - PVEC_BITS, node->items[sub], i, o);
+  }
+  return copy;
+}
+
+Obj *pvec_assoc(Obj *pvec, int i, Obj *o) {
+  assert(obj_tag(pvec) == 'R');
+  int count = pvec->pvec_count;
+  assert(i >= 0 && i <= count);
+  if(i == count) {
+    return pvec_push(pvec, o);
+  }
+  if(i >= pvec_tail_offset(count)) {
+    Obj *tail = pvec_node_copy(pvec->pvec_tail);
+    tail->items[i & PVEC_MASK] = o;
+    return obj_new_pvec(pvec->pvec_root, tail, count, pvec->pvec_shift);
+  }
+  Obj *root = pvec_node_assoc(pvec->pvec_shift, pvec->pvec_root, i, o);
+  return obj_new_pvec(root, pvec->pvec_tail, count, pvec->pvec_shift);
+}
+
+Obj *pvec_new_empty() {
+  return obj_new_pvec(obj_new_array(0), obj_new_array(PVEC_WIDTH), 0, PVEC_BITS);
+}
+
+Obj *pvec_from_items(Obj **items, int count) {
+  Obj *pvec = pvec_new_empty();
+  for(int i = 0; i < count; i++) {
+    pvec_push_bang(pvec, items[i]);
+  }
+  return pvec;
+}
+
+Obj *pvec_from_list(Obj *list) {
+  Obj *pvec = pvec_new_empty();
+  for(Obj *p = list; p && p->car; p = p->cdr) {
+    pvec_push_bang(pvec, p->car);
+  }
+  return pvec;
+}
+
+Obj *pvec_to_list(Obj *pvec) {
+  assert(obj_tag(pvec) == 'R');
+  Obj *list = obj_new_cons(NULL, NULL);
+  Obj *last = list;
+  // One leaf at a time
+  for(int i = 0; i < pvec->pvec_count; i += PVEC_WIDTH) {
+    Obj *leaf = pvec_leaf(pvec, i);
+    for(int j = 0; j < leaf->count; j++) {
+      last->car = leaf->items[j];
+      last->cdr = obj_new_cons(NULL, NULL);
+      last = last->cdr;
+    }
+  }
+  return list;
+}
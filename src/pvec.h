@@ -0,0 +1,21 @@
+#pragma once
+
+#include "obj.h"
+
+// Persistent vectors ('R') are tries of arrays ('A' nodes) with 32 items or children per node,
+// plus a 'tail' array with the last (up to 32) items so that appending is mostly a small copy.
+// Nodes are never changed once they are in a vector, an updated vector shares all nodes
+// except the ones on the path to the changed index. Lookup and update are O(log32 n).
+
+Obj *pvec_nth(Obj *pvec, int i); // 'i' must be in bounds
+
+Obj *pvec_push(Obj *pvec, Obj *o); // new vector
+Obj *pvec_assoc(Obj *pvec, int i, Obj *o); // new vector, 'i' can be the count to append
+
+// Appends in place, only for new vectors that nothing else refers to yet
+void pvec_push_bang(Obj *pvec, Obj *o);
+
+Obj *pvec_new_empty();
+Obj *pvec_from_items(Obj **items, int count);
+Obj *pvec_from_list(Obj *list);
+Obj *pvec_to_list(Obj *pvec);
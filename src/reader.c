@@ -1,5 +1,6 @@
 #include "reader.h"
 #include <ctype.h>
+#include "dict.h"
 
 int read_line_nr;
 int read_line_pos;
@@ -63,7 +64,7 @@ Obj *read_internal(Obj *env, char *s) {
     print_read_pos();
     return nil;
   }
-  else if(CURRENT == '(' || CURRENT == '[') {
+  else if(CURRENT == '(') {
     Obj *list = obj_new_cons(NULL, NULL);
     Obj *prev = list;
     read_pos++;
@@ -74,7 +75,7 @@ Obj *read_internal(Obj *env, char *s) {
 	print_read_pos();
 	return nil;
       }
-      if(CURRENT == ')' || CURRENT == ']') {
+      if(CURRENT == ')') {
 	read_pos++;
 	break;
       }
@@ -86,9 +87,26 @@ Obj *read_internal(Obj *env, char *s) {
     }
     return list;
   }
+  else if(CURRENT == '[') {
+    Obj *array = obj_new_array(0);
+    read_pos++;
+    while(1) {
+      skip_whitespace(s);
+      if(CURRENT == '\0') {
+	printf("Missing ] at the end.\n");
+	print_read_pos();
+	return nil;
+      }
+      if(CURRENT == ']') {
+	read_pos++;
+	break;
+      }
+      obj_array_push(array, read_internal(env, s));
+    }
+    return array;
+  }
   else if(CURRENT == '{') {
-    Obj *list = obj_new_cons(NULL, NULL);
-    Obj *prev = list;
+    Obj *dict = obj_new_dict(NULL, 0);
     read_pos++;
     while(1) {
       skip_whitespace(s);
@@ -110,15 +128,8 @@ Obj *read_internal(Obj *env, char *s) {
       }
       
       Obj *value = read_internal(env, s);
-      
-      Obj *new = obj_new_cons(NULL, NULL);
-      Obj *pair = obj_new_cons(key, value);
-      prev->car = pair;
-      prev->cdr = new;
-      prev = new;
+      dict_set(dict, key, value);
     }
-    Obj *dict = obj_new_environment(NULL);
-    dict->bindings = list;
     return dict;
   }
   else if(CURRENT == '&') {
@@ -132,6 +143,7 @@ Obj *read_internal(Obj *env, char *s) {
       read_pos++;
     }
     bool is_floating = false;
+    bool is_double = false; // 1.5d
     char scratch[32];
     int i = 0;
     while(isdigit(CURRENT)) {
@@ -147,9 +159,17 @@ Obj *read_internal(Obj *env, char *s) {
 	read_pos++;
 	break;
       }
+      if(CURRENT == 'd') {
+	is_double = true;
+	read_pos++;
+	break;
+      }
     }
     scratch[i] = '\0';
-    if(is_floating) {
+    if(is_double) {
+      return obj_new_double(strtod(scratch, NULL) * negator);
+    }
+    else if(is_floating) {
       float x = atof(scratch) * negator;
       return obj_new_float(x);
     } else {
@@ -178,7 +198,7 @@ Obj *read_internal(Obj *env, char *s) {
     read_pos++;
     char name[512];
     int i = 0;
-    while(is_ok_in_symbol(CURRENT, true)) {
+    while(is_ok_in_symbol(CURRENT, i == 0)) {
       name[i++] = CURRENT;
       read_pos++;
     }
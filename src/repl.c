@@ -51,6 +51,7 @@ void pop_stacks_to_zero() {
 
 void env_new_global() {
   global_env = obj_new_environment(NULL);
+  register_special_forms();
 
   nil = obj_new_cons(NULL, NULL);
   define("nil", nil);
@@ -81,6 +82,18 @@ void env_new_global() {
 
   type_float = obj_new_keyword("float");
   define("type-float", type_float);
+
+  type_double = obj_new_keyword("double");
+  define("type-double", type_double);
+
+  type_i64 = obj_new_keyword("i64");
+  define("type-i64", type_i64);
+
+  type_u64 = obj_new_keyword("u64");
+  define("type-u64", type_u64);
+
+  type_char = obj_new_keyword("char");
+  define("type-char", type_char);
   
   type_string = obj_new_keyword("string");
   define("type-string", type_string);
@@ -99,6 +112,11 @@ void env_new_global() {
   
   type_env = obj_new_keyword("env");
   define("type-env", type_env);
+
+  type_dict = obj_new_keyword("dict");
+  define("type-dict", type_dict);
+  type_pvec = obj_new_keyword("pvec");
+  define("type-pvec", type_pvec);
   
   type_macro = obj_new_keyword("macro");
   define("type-macro", type_macro);
@@ -109,6 +127,15 @@ void env_new_global() {
   type_list = obj_new_keyword("list");
   define("type-list", type_list);
 
+  type_array = obj_new_keyword("array");
+  define("type-array", type_array);
+
+  type_int_vec = obj_new_keyword("int-vec");
+  define("type-int-vec", type_int_vec);
+
+  type_float_vec = obj_new_keyword("float-vec");
+  define("type-float-vec", type_float_vec);
+
   type_void = obj_new_keyword("void");
   define("type-void", type_void);
 
@@ -124,12 +151,26 @@ void env_new_global() {
   register_primop("mod", p_mod);
   register_primop("=", p_eq);
   register_primop("list", p_list);
+  register_primop("array", p_array);
+  register_primop("array-push!", p_array_push_bang);
+  register_primop("pvec", p_pvec);
+  register_primop("pvec-push", p_pvec_push);
+  register_primop("list-to-pvec", p_list_to_pvec);
+  register_primop("pvec-to-list", p_pvec_to_list);
+  register_primop("int-vec", p_int_vec);
+  register_primop("float-vec", p_float_vec);
+  register_primop("vec+", p_vec_add);
+  register_primop("vec*", p_vec_mul);
+  register_primop("vec-dot", p_vec_dot);
+  register_primop("vec-sum", p_vec_sum);
+  register_primop("vec-map", p_vec_map);
   register_primop("str", p_str);
   register_primop("str-append!", p_str_append_bang);
   register_primop("str-replace", p_str_replace);
   register_primop("register", p_register);
   register_primop("register-variable", p_register_variable);
   register_primop("register-builtin", p_register_builtin);
+  register_primop("register-struct", p_register_struct);
   register_primop("print", p_print);
   register_primop("println", p_println);
   register_primop("prn", p_prn);
@@ -138,6 +179,8 @@ void env_new_global() {
   register_primop("get-maybe", p_get_maybe);
   register_primop("dict-set!", p_dict_set_bang);
   register_primop("dict-remove!", p_dict_remove_bang);
+  register_primop("assoc", p_assoc);
+  register_primop("dissoc", p_dissoc);
   register_primop("first", p_first);
   register_primop("rest", p_rest);
   register_primop("cons", p_cons);
@@ -153,6 +196,19 @@ void env_new_global() {
   register_primop("type", p_type);
   register_primop("<", p_lt);
   register_primop("env", p_env);
+  register_primop("alloc-stats", p_alloc_stats);
+  register_primop("gc", p_gc);
+  register_primop("gc-stats", p_gc_stats);
+  register_primop("set-gc-growth!", p_set_gc_growth_bang);
+  register_primop("set-gc-budget!", p_set_gc_budget_bang);
+  register_primop("clear-gc-pauses!", p_clear_gc_pauses_bang);
+  register_primop("set-stack-limit!", p_set_stack_limit_bang);
+  register_primop("set-function-trace!", p_set_function_trace_bang);
+  register_primop("set-bytecode!", p_set_bytecode_bang);
+  register_primop("set-ffi-direct!", p_set_ffi_direct_bang);
+  register_primop("macro-stats", p_macro_stats);
+  register_primop("lookup-stats", p_lookup_stats);
+  register_primop("set-macro-cached!", p_set_macro_cached_bang);
   register_primop("load-lisp", p_load_lisp);
   register_primop("load-dylib", p_load_dylib);
   register_primop("unload-dylib", p_unload_dylib);
@@ -186,6 +242,7 @@ void env_new_global() {
 
 void env_new_global_mini() {
   global_env = obj_new_environment(NULL);
+  register_special_forms();
 
   nil = obj_new_cons(NULL, NULL);
   define("nil", nil);
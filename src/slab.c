@@ -0,0 +1,234 @@
+#include "slab.h"
+#include <sys/mman.h>
+
+#define LOG_SLABS 0
+
+// Number of empty slabs kept around per size class instead of unmapping them
+#define SLAB_SPARE_COUNT 1
+
+#define SIZE_CLASS_COUNT 6
+const int size_class_sizes[SIZE_CLASS_COUNT] = { 16, 24, 32, 48, 64, 96 };
+
+// Dead cells get tag 0 so that a sweep over the slab can tell them apart from objects.
+// The link to the next free cell is stored after the tag, where the payload of an Obj would be.
+typedef struct FreeCell {
+  char tag;
+  struct FreeCell *next;
+} FreeCell;
+
+typedef struct Slab {
+  struct Slab *next; // all slabs of the size class
+  struct Slab *next_partial; // slabs of the size class that have free cells
+  int cell_size;
+  int cell_count;
+  int live_count;
+  FreeCell *free_list;
+  char *cells;
+  char *bump; // cells never handed out yet start here
+  char *end;
+  bool sweep_pending; // not yet visited by the ongoing incremental sweep
+} Slab;
+
+typedef struct {
+  Slab *slabs;
+  Slab *partial;
+  Slab *current;
+} SizeClass;
+
+SizeClass size_classes[SIZE_CLASS_COUNT];
+
+// Position of the incremental sweep, see slab_sweep_step
+int sweep_class = SIZE_CLASS_COUNT;
+Slab *sweep_slab = NULL;
+
+int size_class_index(size_t size) {
+  for(int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    if(size <= size_class_sizes[i]) {
+      return i;
+    }
+  }
+  printf("No slab size class for an allocation of %zu bytes.\n", size);
+  assert(false);
+  return -1;
+}
+
+Slab *slab_of(void *cell) {
+  return (Slab*)((uintptr_t)cell & ~((uintptr_t)SLAB_SIZE - 1));
+}
+
+Slab *slab_new(int cell_size) {
+  // Map twice the size and trim, to get a block aligned to SLAB_SIZE
+  char *mem = mmap(NULL, SLAB_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(mem == MAP_FAILED) {
+    printf("Failed to map memory for a new slab.\n");
+    exit(1);
+  }
+  char *aligned = (char*)(((uintptr_t)mem + SLAB_SIZE - 1) & ~((uintptr_t)SLAB_SIZE - 1));
+  if(aligned > mem) {
+    munmap(mem, aligned - mem);
+  }
+  munmap(aligned + SLAB_SIZE, (mem + SLAB_SIZE * 2) - (aligned + SLAB_SIZE));
+
+  Slab *slab = (Slab*)aligned;
+  size_t header_size = (sizeof(Slab) + 15) & ~(size_t)15;
+  slab->next = NULL;
+  slab->next_partial = NULL;
+  slab->cell_size = cell_size;
+  slab->cell_count = (SLAB_SIZE - header_size) / cell_size;
+  slab->live_count = 0;
+  slab->free_list = NULL;
+  slab->cells = aligned + header_size;
+  slab->bump = slab->cells;
+  slab->end = slab->bump + slab->cell_count * cell_size;
+  slab->sweep_pending = false;
+  if(LOG_SLABS) {
+    printf("New slab %p for cells of size %d.\n", slab, cell_size);
+  }
+  return slab;
+}
+
+bool slab_is_full(Slab *slab) {
+  return !slab->free_list && slab->bump >= slab->end;
+}
+
+void *slab_alloc(size_t size) {
+  SizeClass *c = &size_classes[size_class_index(size)];
+  Slab *slab = c->current;
+
+  if(!slab || slab_is_full(slab)) {
+    while(c->partial && slab_is_full(c->partial)) {
+      c->partial = c->partial->next_partial;
+    }
+    if(c->partial) {
+      slab = c->partial;
+      c->partial = slab->next_partial;
+    }
+    else {
+      slab = slab_new(size_class_sizes[size_class_index(size)]);
+      slab->next = c->slabs;
+      c->slabs = slab;
+    }
+    c->current = slab;
+  }
+
+  void *cell;
+  if(slab->free_list) {
+    cell = slab->free_list;
+    slab->free_list = slab->free_list->next;
+  }
+  else {
+    cell = slab->bump;
+    slab->bump += slab->cell_size;
+  }
+  slab->live_count++;
+  return cell;
+}
+
+void slab_free(void *cell) {
+  Slab *slab = slab_of(cell);
+  FreeCell *free_cell = cell;
+  free_cell->tag = 0;
+  free_cell->next = slab->free_list;
+  slab->free_list = free_cell;
+  slab->live_count--;
+}
+
+void slab_each_obj(void (*visit)(Obj *o)) {
+  for(int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    Slab *slab = size_classes[i].slabs;
+    while(slab) {
+      for(char *cell = slab->cells; cell < slab->bump; cell += slab->cell_size) {
+        Obj *o = (Obj*)cell;
+        if(o->tag) {
+          visit(o);
+        }
+      }
+      slab = slab->next;
+    }
+  }
+}
+
+// The sweep visits one whole slab per step, so a cell is either in a slab that's done or
+// in one that is still pending (cells freed and handed out again within a slab can't be missed).
+void slab_sweep_begin() {
+  for(int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    for(Slab *slab = size_classes[i].slabs; slab; slab = slab->next) {
+      slab->sweep_pending = true;
+    }
+  }
+  sweep_class = 0;
+  sweep_slab = size_classes[0].slabs;
+}
+
+bool slab_sweep_step(void (*visit)(Obj *o)) {
+  // Slabs made after slab_sweep_begin aren't pending, they can be at the head of classes not reached yet
+  while(sweep_slab && !sweep_slab->sweep_pending) {
+    sweep_slab = sweep_slab->next;
+  }
+  while(!sweep_slab) {
+    if(++sweep_class >= SIZE_CLASS_COUNT) {
+      return true;
+    }
+    sweep_slab = size_classes[sweep_class].slabs;
+    while(sweep_slab && !sweep_slab->sweep_pending) {
+      sweep_slab = sweep_slab->next;
+    }
+  }
+  Slab *slab = sweep_slab;
+  for(char *cell = slab->cells; cell < slab->bump; cell += slab->cell_size) {
+    Obj *o = (Obj*)cell;
+    if(o->tag) {
+      visit(o);
+    }
+  }
+  slab->sweep_pending = false;
+  sweep_slab = slab->next;
+  return false;
+}
+
+bool slab_sweep_pending(void *cell) {
+  return slab_of(cell)->sweep_pending;
+}
+
+// Called after the GC has swept; unmaps empty slabs and rebuilds the lists of slabs with free cells
+void slab_release_empty() {
+  for(int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    SizeClass *c = &size_classes[i];
+    int spare = 0;
+    c->partial = NULL;
+    Slab **p = &c->slabs;
+    while(*p) {
+      Slab *slab = *p;
+      if(slab->live_count == 0 && slab != c->current && spare++ >= SLAB_SPARE_COUNT) {
+        *p = slab->next;
+        if(LOG_SLABS) {
+          printf("Releasing empty slab %p.\n", slab);
+        }
+        munmap(slab, SLAB_SIZE);
+      }
+      else {
+        if(slab != c->current && !slab_is_full(slab)) {
+          slab->next_partial = c->partial;
+          c->partial = slab;
+        }
+        p = &slab->next;
+      }
+    }
+  }
+}
+
+SlabStats slab_stats() {
+  SlabStats stats = { 0, 0, 0, 0, 0 };
+  for(int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    Slab *slab = size_classes[i].slabs;
+    while(slab) {
+      stats.slabs++;
+      stats.cells += slab->cell_count;
+      stats.live_cells += slab->live_count;
+      slab = slab->next;
+    }
+  }
+  stats.free_cells = stats.cells - stats.live_cells;
+  stats.bytes = (long)stats.slabs * SLAB_SIZE;
+  return stats;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "obj.h"
+
+// Obj cells are handed out from big aligned blocks ("slabs"), one set of slabs per size class.
+// Dead cells are threaded onto the free list of their slab and wholly empty slabs are given back to the OS.
+
+#define SLAB_SIZE (64 * 1024)
+
+void *slab_alloc(size_t size);
+void slab_free(void *cell);
+void slab_release_empty();
+
+// Calls 'visit' for every allocated object (it's fine for 'visit' to free the object)
+void slab_each_obj(void (*visit)(Obj *o));
+
+// Incremental version of slab_each_obj, each step visits the objects of one slab and
+// returns true when all slabs that existed at slab_sweep_begin have been visited.
+void slab_sweep_begin();
+bool slab_sweep_step(void (*visit)(Obj *o));
+bool slab_sweep_pending(void *cell);
+
+typedef struct {
+  int slabs;
+  int cells;
+  int live_cells;
+  int free_cells;
+  long bytes;
+} SlabStats;
+
+SlabStats slab_stats();
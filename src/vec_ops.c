@@ -0,0 +1,85 @@
+#include "vec_ops.h"
+
+typedef int v4i __attribute__((vector_size(16)));
+typedef float v4f __attribute__((vector_size(16)));
+
+// memcpy to and from the lanes since the buffers are only 4 byte aligned
+
+#define VEC_BINARY_OP(name, T, VT, OP)					\
+  void name(T *out, const T *a, const T *b, int n) {			\
+    int i = 0;								\
+    for(; i + 4 <= n; i += 4) {						\
+      VT x, y;								\
+      memcpy(&x, a + i, sizeof(VT));					\
+      memcpy(&y, b + i, sizeof(VT));					\
+      x = x OP y;							\
+      memcpy(out + i, &x, sizeof(VT));					\
+    }									\
+    for(; i < n; i++) {							\
+      out[i] = a[i] OP b[i];						\
+    }									\
+  }
+
+#define VEC_SCALAR_OP(name, T, VT, OP)					\
+  void name(T *out, const T *a, T k, int n) {				\
+    VT y = { k, k, k, k };						\
+    int i = 0;								\
+    for(; i + 4 <= n; i += 4) {						\
+      VT x;								\
+      memcpy(&x, a + i, sizeof(VT));					\
+      x = x OP y;							\
+      memcpy(out + i, &x, sizeof(VT));					\
+    }									\
+    for(; i < n; i++) {							\
+      out[i] = a[i] OP k;						\
+    }									\
+  }
+
+// Four partial sums, added together at the end
+#define VEC_DOT(name, T, VT)						\
+  T name(const T *a, const T *b, int n) {				\
+    VT acc = { 0, 0, 0, 0 };						\
+    int i = 0;								\
+    for(; i + 4 <= n; i += 4) {						\
+      VT x, y;								\
+      memcpy(&x, a + i, sizeof(VT));					\
+      memcpy(&y, b + i, sizeof(VT));					\
+      acc += x * y;							\
+    }									\
+    T total = acc[0] + acc[1] + acc[2] + acc[3];			\
+    for(; i < n; i++) {							\
+      total += a[i] * b[i];						\
+    }									\
+    return total;							\
+  }
+
+#define VEC_SUM(name, T, VT)						\
+  T name(const T *a, int n) {						\
+    VT acc = { 0, 0, 0, 0 };						\
+    int i = 0;								\
+    for(; i + 4 <= n; i += 4) {						\
+      VT x;								\
+      memcpy(&x, a + i, sizeof(VT));					\
+      acc += x;								\
+    }									\
+    T total = acc[0] + acc[1] + acc[2] + acc[3];			\
+    for(; i < n; i++) {							\
+      total += a[i];							\
+    }									\
+    return total;							\
+  }
+
+VEC_BINARY_OP(vec_add_ints, int, v4i, +)
+VEC_BINARY_OP(vec_add_floats, float, v4f, +)
+VEC_BINARY_OP(vec_mul_ints, int, v4i, *)
+VEC_BINARY_OP(vec_mul_floats, float, v4f, *)
+
+VEC_SCALAR_OP(vec_add_int_scalar, int, v4i, +)
+VEC_SCALAR_OP(vec_add_float_scalar, float, v4f, +)
+VEC_SCALAR_OP(vec_mul_int_scalar, int, v4i, *)
+VEC_SCALAR_OP(vec_mul_float_scalar, float, v4f, *)
+
+VEC_DOT(vec_dot_ints, int, v4i)
+VEC_DOT(vec_dot_floats, float, v4f)
+VEC_SUM(vec_sum_ints, int, v4i)
+VEC_SUM(vec_sum_floats, float, v4f)
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "obj.h"
+
+// Bulk operations on the raw buffers of numeric vectors ('N' objects).
+// The loops work on 4 lanes at a time with GCC/Clang vector extensions, so they become
+// SSE instructions even in unoptimized builds; the remaining items are done one by one.
+
+void vec_add_ints(int *out, const int *a, const int *b, int n);
+void vec_add_floats(float *out, const float *a, const float *b, int n);
+void vec_mul_ints(int *out, const int *a, const int *b, int n);
+void vec_mul_floats(float *out, const float *a, const float *b, int n);
+
+// out[i] = a[i] op k
+void vec_add_int_scalar(int *out, const int *a, int k, int n);
+void vec_add_float_scalar(float *out, const float *a, float k, int n);
+void vec_mul_int_scalar(int *out, const int *a, int k, int n);
+void vec_mul_float_scalar(float *out, const float *a, float k, int n);
+
+int vec_dot_ints(const int *a, const int *b, int n);
+float vec_dot_floats(const float *a, const float *b, int n);
+int vec_sum_ints(const int *a, int n);
+float vec_sum_floats(const float *a, int n);